@@ -6,8 +6,11 @@
 #include <sdlpp_graphics.h>
 #include <sdlpp_font.h>
 #include <sdlpp_anim.h>
+#include <sdlpp_atlas.h>
 #include <sdlpp_input.h>
+#include <sdlpp_mixer.h>
 #include <sdlpp_sound.h>
+#include <sdlpp_preload.h>
 #include <sysdep.h>
 
 namespace SDLPP {
@@ -40,7 +43,8 @@ public:
 };
 
 /** Called once per frame, calculates the time in ms for the frame
-    Useful for the parameter to call advance() */
+    Useful for the parameter to call advance().
+    Measured with the high resolution clock; fractions of a ms carry over to the next frame. */
 int  calculate_dt();
 
 } // namespace SDLPP
@@ -2,7 +2,10 @@
 #define H_SDLPP_ANIMATION
 
 #include <sdlpp_physics.h>
+#include <sdlpp_broadphase.h>
+#include <sdlpp_io.h>
 #include <properties.h>
+#include <xml.h>
 
 namespace SDLPP {
 
@@ -19,9 +22,9 @@ class Sprite
 {
   class Frame
   {
-    Bitmap           image;
-    int              duration;
-    CollisionModel2D col_model;
+    Bitmap              image;
+    int                 duration;
+    collision_model_ptr col_model;   // Shared with frames cut from the same region
   public:
     Bitmap                  get_bitmap() { return image; }
     void                    set_bitmap(Bitmap bmp) { image=bmp; }
@@ -30,9 +33,11 @@ class Sprite
 
     CollisionModel2D& get_col_model()
     { 
-      if (col_model.empty()) col_model.build(image);
-      return col_model;
+      // Loaders set the models up front.  Frames added by hand build it here.
+      if (!col_model) col_model.reset(new CollisionModel2D(image));
+      return *col_model;
     }
+    void set_col_model(collision_model_ptr cm) { col_model=cm; }
   };
 
   typedef std::vector<Frame> frame_vec;
@@ -72,13 +77,76 @@ public:
 
   int advance_sequence(int seq, int& last_t, int dt, const dVec2& velocity);
   Bitmap            get_bitmap(int seq, int frame);
+  void              set_bitmap(int seq, int frame, Bitmap bmp);
   CollisionModel2D& get_col_model(int seq, int frame);
+  void              set_col_model(int seq, int frame, collision_model_ptr cm);
+};
+
+/** Sprite description compiled offline from a sprite XML, stored in the
+    resources as the XML name followed by '.spr'.
+    Sequences, frames, flags and precomputed collision masks are fixed size
+    records in one buffer, with strings referenced by offset.  Loading is one
+    read, or none from a memory mapped resource file, and a bounds check of
+    the offsets.  Frames still refer to their source images, and use the
+    TextureAtlas when it holds them.
+
+    Offline, into a resource pack:
+      ResourceFileWriter w("rsc.dat");
+      CompiledSprite::compile(w,"rsc/boy.xml");
+
+    SpriteLoader and Preloader use the compiled form when it is present.
+*/
+class CompiledSprite
+{
+public:
+  CompiledSprite();
+
+  /** Loads the compiled form of the named sprite XML.  Returns false if it is missing or invalid */
+  bool    load(const xstring& name);
+
+  Uint32  get_color_key() const;
+
+  /** Names of the images frames are cut from, each listed once */
+  void    get_images(str_vec& images) const;
+
+  /** Adds the sequences, frames, masks and flags to s */
+  void    build(Sprite& s) const;
+
+  /** Compiles a sprite XML, and adds it to w */
+  static void compile(ResourceFileWriter& w, const xstring& name, ResourceCodec codec=CODEC_NONE);
+
+  static xstring compiled_name(const xstring& name) { return name+".spr"; }
+private:
+  CompiledSprite(const CompiledSprite&) {}
+  CompiledSprite& operator= (const CompiledSprite&) { return *this; }
+
+  struct Header;
+  struct SequenceRecord;
+  struct FrameRecord;
+  struct FlagRecord;
+  struct MaskRecord;
+
+  bool        fix_up(const char* data, size_t size);
+  const char* get_string(Uint32 offset) const { return m_Strings+offset; }
+
+  char_vec              m_Buffer;   // Not used when the resource is mapped in place
+  const Header*         m_Header;
+  const SequenceRecord* m_Sequences;
+  const FrameRecord*    m_Frames;
+  const FlagRecord*     m_Flags;
+  const MaskRecord*     m_Masks;
+  const Uint64*         m_MaskWords;
+  const char*           m_Strings;
 };
 
 class SpriteLoader : public Loader<Sprite>
 {
 public:
+  /** Uses the compiled sprite when there is one, and parses the XML otherwise */
   virtual bool load(const xstring& name, Sprite& s) override;
+
+  /** Builds a sprite from an already parsed sprite XML */
+  static void build(xml_element* root, Sprite& s);
 };
 
 class SpriteCache : public Cache<Sprite>
@@ -119,6 +187,7 @@ class AnimatedSprite : public RigidBody2D
   int              m_CurrentFrame;
   Bitmap           m_CurrentImage;
   bool             m_Volatile;
+  bool             m_ThreadSafe;
   PropertyBag      m_Properties;
 
   void init();
@@ -135,15 +204,19 @@ public:
   int  get_current_frame() const { return m_CurrentFrame; }
   void set_current_frame(int frame); 
 
+  /** Off by default, since subclasses may touch other objects in advance().
+      The sprite's own advance() only changes the sprite itself. */
+  void set_thread_safe(bool state) { m_ThreadSafe=state; }
+
   Bitmap get_current_image() { return m_CurrentImage; }
 
   // GameObject overrides
   virtual bool        advance(int dt);
   virtual void        render(GameView& gv);
   virtual bool        is_volatile() const { return m_Volatile; }
-  virtual bool        is_static_sprite() const { return false; }
   // RigidBody2D overrides
   virtual iRect2             get_rect() const;
+  virtual bool               is_thread_safe() const { return m_ThreadSafe; }
 
   iVec2 get_center_position() const
   {
@@ -192,44 +265,155 @@ public:
   void start_animation_scene()
   {
     m_Scene=true;
+    m_Timer.reset();
+    m_Accumulator=0;
   }
 
-  void add_animation_object(RigidBody2D* obj)
+  /** Adds an object to the scene, and returns a handle to it.
+      Static sprites are advanced only once, on the next call to advance(),
+      and are only tested for collisions against moving objects.
+      Objects added during advance(), by other objects, join the scene when the
+      step is over: they are first advanced, and collide, on the next step. */
+  SlotHandle add_animation_object(RigidBody2D* obj)
   {
     if (!m_Scene) THROW("Animation Scene not started.");
-    m_Objects.push_back(obj);
-    if (obj->is_collidable()) m_CollidableObjects.push_back(obj);
+    Entry e = { obj, obj->is_static_sprite(), false };
+    SlotHandle h=m_Objects.insert(e);
+    if (m_InStep) m_Joining.push_back(h);
+    else join(obj,e.is_static);
+    return h;
   }
 
-  virtual bool advance(int dt);
+  /** Removes an object, and deletes it if it is volatile.
+      During advance(), this happens once all objects were advanced. */
+  void remove_animation_object(SlotHandle h);
+
+  /** Returns the object, or 0 if it has been removed since */
+  RigidBody2D* find_animation_object(SlotHandle h)
+  {
+    Entry* e=m_Objects.get(h);
+    return e ? e->obj : 0;
+  }
+
+  /** Replaces the collision broadphase (a GridBroadphase by default).
+      Objects already added are moved to the new one. */
+  void set_broadphase(broadphase_ptr bp);
+  broadphase_ptr get_broadphase() const { return m_Broadphase; }
+
+  /** Static sprites are indexed for collisions when first checked.
+      Call this after moving any of them later on. */
+  void refresh_static_bodies() { m_Broadphase->invalidate_static(); }
+
+  /** When enabled, moving objects added from then on keep their motion state
+      in get_kinematics(), which integrates all of them in one pass at the start
+      of each step, before their advance() is called.
+      Objects may also attach themselves to get_kinematics() directly. */
+  void set_batch_kinematics(bool state) { m_BatchKinematics=state; }
+  bool get_batch_kinematics() const { return m_BatchKinematics; }
+  KinematicsStore& get_kinematics() { return m_Kinematics; }
+
+  /** Runs the first phase of each step on jobs: the integration of get_kinematics(),
+      and advance() of the objects that are thread safe (RigidBody2D::is_thread_safe).
+      Those are advanced together, before all the others, which are still advanced
+      in order on this thread.  The pixel level collision tests of all the pairs
+      then run on jobs too, and handle_collision() is called on this thread,
+      in the same order as without jobs.
+      The system must outlive its use here.  0, the default, runs everything serially. */
+  void       set_job_system(JobSystem* jobs) { m_Jobs=jobs; }
+  JobSystem* get_job_system() const { return m_Jobs; }
+
+  /** Fixed step mode: the time given to advance() is accumulated, and run in
+      whole steps of step_ms each, at most max_steps per call.  Time beyond
+      that is dropped, so a slow frame slows the game down for a moment,
+      instead of making the following frames slower still.
+      What is left of a step is passed to render(), in the view's interpolation,
+      so moving objects are drawn between their last two positions.
+      A step of 0 goes back to variable steps of up to 100 ms, the default. */
+  void set_fixed_step(int step_ms, int max_steps=5);
+  /** Fixed steps by rate.  Steps are whole ms, so 120 gives 8 ms steps */
+  void set_fixed_rate(int hz, int max_steps=5) 
+  { 
+    set_fixed_step(hz>0 ? Max(1,(1000+hz/2)/hz) : 0, max_steps); 
+  }
+  int    get_fixed_step() const { return m_FixedStep; }
+  /** Fraction of a fixed step accumulated but not run yet, or 1 with variable steps */
+  double get_interpolation() const { return m_FixedStep>0 ? m_Accumulator/m_FixedStep : 1.0; }
+  /** Fixed steps dropped so far, because a frame needed more than max_steps */
+  int    get_dropped_steps() const { return m_DroppedSteps; }
+
+  virtual bool advance(int dt) { return advance_time(dt); }
+  /** Advances by ms, which may have a fraction.  Fractions are carried over */
+  bool advance_time(double ms);
+  /** Advances by the time since the previous call, or since the scene started,
+      measured with the high resolution clock */
+  bool advance_frame() { return advance_time(m_Timer.calc_elapsed()); }
   virtual void render(GameView& view)
   {
-    obj_list::iterator b=m_Objects.begin(),e=m_Objects.end();
-    for(;b!=e;++b)
+    double alpha=get_interpolation();
+    for(int i=0;i<m_Objects.size();++i)
     {
-      GameObject* obj=*b;
-      obj->render(view);
+      if (m_Objects.is_erased(i)) continue;
+      const Entry& e=m_Objects[i];
+      // Objects not stepped yet have no previous position
+      view.set_interpolation(e.is_static || !e.advanced ? 1.0 : alpha);
+      e.obj->render(view);
     }
+    view.set_interpolation(1.0);
   }
 
   void clear();
+
+  /** Objects in rendering order */
+  int          get_object_count() const { return m_Objects.size(); }
+  RigidBody2D* get_object(int i) const { return m_Objects[i].obj; }
 private:
+  struct Entry
+  {
+    RigidBody2D* obj;
+    bool         is_static;
+    bool         advanced;     // Static objects are only advanced once
+  };
+
+  void step(int dt);
+  void advance_parallel(int dt, int n);
+  void join(RigidBody2D* obj, bool is_static);
+  void join_pending();
+  void flush_removed();
   void check_for_collisions(int dt);
 
   friend class std::auto_ptr<AnimationManager>;
-  AnimationManager() : m_Scene(false) {}
+  AnimationManager() 
+    : m_Broadphase(new GridBroadphase)
+    , m_Scene(false)
+    , m_InStep(false)
+    , m_BatchKinematics(false) 
+    , m_FixedStep(0)
+    , m_MaxSteps(5)
+    , m_Accumulator(0)
+    , m_DroppedSteps(0)
+    , m_Jobs(0)
+  {}
   ~AnimationManager() {}
   AnimationManager(const AnimationManager&) {}
 
-  typedef std::list<RigidBody2D*> obj_list;
-  typedef obj_list::iterator iterator;
-  obj_list m_Objects;
-  obj_list m_CollidableObjects;
-  bool     m_Scene;
-public:
-  typedef obj_list::const_iterator const_iterator;
-  const_iterator begin() const { return m_Objects.begin(); }
-  const_iterator end()   const { return m_Objects.end(); }
+  SlotMap<Entry>          m_Objects;   // All objects, in rendering order
+  std::vector<SlotHandle> m_Joining;   // Added during the current step
+  Broadphase::body_vec    m_Removed;   // Erased during the current step, not deleted yet
+  broadphase_ptr          m_Broadphase;
+  Broadphase::pair_vec    m_Pairs;
+  contact_vec             m_Contacts;
+  bool                    m_Scene;
+  bool                    m_InStep;
+  KinematicsStore         m_Kinematics;
+  bool                    m_BatchKinematics;
+  FrameTimer              m_Timer;
+  int                     m_FixedStep;
+  int                     m_MaxSteps;
+  double                  m_Accumulator;   // ms not run yet
+  int                     m_DroppedSteps;
+  JobSystem*              m_Jobs;
+  int_vec                 m_Parallel;      // Positions advanced on jobs in this step
+  std::vector<char>       m_Alive;         // Their advance() results
 };
 
 class AnimationScene
@@ -241,9 +425,9 @@ public:
 
 #define ANIMATION_SCENE AnimationScene l_##__LINE__
 
-inline void add_animation_object(RigidBody2D* obj)
+inline SlotHandle add_animation_object(RigidBody2D* obj)
 {
-  AnimationManager::instance()->add_animation_object(obj);
+  return AnimationManager::instance()->add_animation_object(obj);
 }
 
 inline void advance(int dt) 
@@ -251,6 +435,11 @@ inline void advance(int dt)
   AnimationManager::instance()->advance(dt); 
 }
 
+inline void advance_frame() 
+{ 
+  AnimationManager::instance()->advance_frame(); 
+}
+
 inline void render(GameView& view) 
 { 
   AnimationManager::instance()->render(view); 
@@ -0,0 +1,133 @@
+#ifndef sdlpp_atlas_h__
+#define sdlpp_atlas_h__
+
+#include <sdlpp_graphics.h>
+#include <sdlpp_anim.h>
+#include <sdlpp_io.h>
+
+namespace SDLPP
+{
+
+  /** Packs rectangles into a fixed size area using the skyline bottom-left heuristic */
+  class AtlasPacker
+  {
+  public:
+    AtlasPacker(int width, int height);
+
+    /** Finds room for a w x h rectangle.  Returns false if it does not fit */
+    bool insert(int w, int h, iVec2& pos);
+
+    /** Lowest y that is not used by any rectangle */
+    int  get_used_height() const;
+  private:
+    struct Segment
+    {
+      int x, y, width;
+    };
+    typedef std::vector<Segment> segment_vec;
+
+    int fit(int index, int w, int h) const;
+
+    int         m_Width;
+    int         m_Height;
+    segment_vec m_Skyline;
+  };
+
+  /** Packs sprite frames into a few large pages, so that sprites share textures.
+      Pages are 32 bit surfaces where transparency is stored in the alpha channel,
+      and color keyed pixels of the source images become fully transparent.
+
+      At load time:
+        TextureAtlas* atlas=TextureAtlas::instance();
+        atlas->add_sprite("rsc/boy.xml");
+        atlas->add_sprite("rsc/ogre.xml");
+        atlas->build();
+
+      Offline, into a resource pack:
+        TextureAtlas atlas;
+        atlas.add_sprite("rsc/boy.xml");
+        atlas.build();
+        ResourceFileWriter w("rsc.dat");
+        atlas.save(w,"rsc/atlas.xml");
+
+      And then at run time:
+        TextureAtlas::instance()->load("rsc/atlas.xml");
+
+      Sprites already in the SpriteCache are rebound to the atlas by build(),
+      and by load() for the sprites that were added before save().
+      SpriteLoader takes frames from TextureAtlas::instance() when they are there,
+      so sprites loaded later use the atlas as well.
+  */
+  class TextureAtlas
+  {
+  public:
+    TextureAtlas(int page_size=1024, int padding=1);
+
+    /** The atlas consulted by SpriteLoader */
+    static TextureAtlas* instance()
+    {
+      static std::unique_ptr<TextureAtlas> ptr(new TextureAtlas);
+      return ptr.get();
+    }
+
+    /** Queue all the frames referenced by a sprite XML */
+    void add_sprite(const xstring& name);
+
+    /** Pack all queued frames into pages, and rebind cached sprites to them */
+    void build();
+
+    /** Write the pages and the frame index into a resource pack.
+        The index is stored as 'name', and the pages as 'name.0', 'name.1' ... */
+    void save(ResourceFileWriter& w, const xstring& name, ResourceCodec codec=CODEC_LZ4);
+
+    /** Load an atlas previously written by save().
+        Throws if a frame is on a missing page or outside of its page */
+    bool load(const xstring& name);
+
+    /** Looks up a frame by its source image and 'Rect' attribute (empty for the whole image) */
+    bool find(const xstring& image, const xstring& rect, Bitmap& bmp) const;
+
+    /** Looks up a frame by a key made by frame_key(), so the rect is not parsed again */
+    bool find_key(const xstring& key, Bitmap& bmp) const;
+
+    static xstring frame_key(const xstring& image, const xstring& rect);
+
+    int    get_page_count() const { return int(m_Pages.size()); }
+    Bitmap get_page(int i) const { return Bitmap(m_Pages[i]); }
+
+    void clear();
+  private:
+    TextureAtlas(const TextureAtlas&) {}
+    TextureAtlas& operator= (const TextureAtlas&) { return *this; }
+
+    struct Entry
+    {
+      xstring image;
+      iRect2  source;
+      int     page;
+      iRect2  region;
+    };
+    typedef std::map<xstring,Entry> entry_map;
+
+    struct SpriteFrame
+    {
+      int     sequence;
+      int     frame;
+      xstring key;
+    };
+    typedef std::vector<SpriteFrame> frame_vec;
+    typedef std::map<xstring,frame_vec> sprite_map;
+
+    bitmap_pixels_ptr create_page(int w, int h);
+    void rebind_sprites();
+
+    int                            m_PageSize;
+    int                            m_Padding;
+    std::vector<bitmap_pixels_ptr> m_Pages;
+    entry_map                      m_Entries;
+    sprite_map                     m_Sprites;
+  };
+
+} // namespace SDLPP
+
+#endif // sdlpp_atlas_h__
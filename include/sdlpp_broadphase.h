@@ -0,0 +1,114 @@
+#ifndef H_SDLPP_BROADPHASE
+#define H_SDLPP_BROADPHASE
+
+#include <sdlpp_physics.h>
+
+namespace SDLPP {
+
+/** Finds pairs of bodies whose rectangles overlap, before the pixel level test.
+    Static bodies (see RigidBody2D::is_static_sprite) are indexed on the first
+    query after they are added, and are not tested against each other.
+    Empty rectangles never collide, so they are not reported.
+*/
+class Broadphase
+{
+public:
+  typedef std::vector<RigidBody2D*> body_vec;
+  typedef std::pair<RigidBody2D*,RigidBody2D*> body_pair;
+  typedef std::vector<body_pair> pair_vec;
+
+  Broadphase() : m_StaticDirty(false) {}
+  virtual ~Broadphase() {}
+
+  void add(RigidBody2D* body, bool is_static);
+  void remove(RigidBody2D* body);
+  /** Removes many bodies in one pass over the lists, keeping their order */
+  void remove(const body_vec& bodies);
+  void clear();
+
+  /** Index static bodies again on the next query.  Call after moving them. */
+  void invalidate_static() { m_StaticDirty=true; }
+
+  /** Fills pairs with candidate pairs, each pair once.  Order is deterministic */
+  virtual void find_pairs(pair_vec& pairs) = 0;
+
+  const body_vec& get_static() const { return m_Static; }
+  const body_vec& get_dynamic() const { return m_Dynamic; }
+protected:
+  /** Refreshes static rectangles and calls index_static(), if needed */
+  void update_static();
+  virtual void index_static() = 0;
+
+  body_vec            m_Static;
+  std::vector<iRect2> m_StaticRects;
+  body_vec            m_Dynamic;      // Implementations may reorder this
+private:
+  bool                m_StaticDirty;
+};
+
+typedef std::shared_ptr<Broadphase> broadphase_ptr;
+
+/** Spatial hash over a uniform grid.  Each body is listed in every cell its
+    rectangle touches.  The static cells are sorted once, and the dynamic cells
+    are sorted on every query, so no hashing containers are used.
+*/
+class GridBroadphase : public Broadphase
+{
+public:
+  GridBroadphase(int cell_size=64) : m_CellSize(cell_size) {}
+  virtual void find_pairs(pair_vec& pairs) override;
+protected:
+  virtual void index_static() override;
+private:
+  struct CellEntry
+  {
+    Uint64 cell;
+    int    index;
+    bool operator< (const CellEntry& rhs) const
+    {
+      if (cell!=rhs.cell) return cell<rhs.cell;
+      return index<rhs.index;
+    }
+  };
+  typedef std::vector<CellEntry> cell_vec;
+
+  int    cell_coord(int v) const { return v>=0 ? v/m_CellSize : -((-v-1)/m_CellSize)-1; }
+  Uint64 cell_key(int x, int y) const
+  {
+    return (Uint64(Uint32(cell_coord(x)))<<32) | Uint32(cell_coord(y));
+  }
+  void   add_cells(const iRect2& r, int index, cell_vec& cells) const;
+
+  int                 m_CellSize;
+  cell_vec            m_StaticCells;
+  cell_vec            m_DynamicCells;
+  std::vector<iRect2> m_DynamicRects;
+};
+
+/** Sweep and prune along the x axis.  The dynamic list stays sorted between
+    queries, so re-sorting it with insertion sort is close to linear.
+*/
+class SweepAndPrune : public Broadphase
+{
+public:
+  SweepAndPrune() : m_MaxStaticWidth(0) {}
+  virtual void find_pairs(pair_vec& pairs) override;
+protected:
+  virtual void index_static() override;
+private:
+  struct Entry
+  {
+    RigidBody2D* body;
+    iRect2       rect;
+    bool operator< (const Entry& rhs) const { return rect.tl.x<rhs.rect.tl.x; }
+  };
+  typedef std::vector<Entry> entry_vec;
+
+  entry_vec m_StaticSorted;
+  entry_vec m_DynamicSorted;
+  int       m_MaxStaticWidth;
+};
+
+} // namespace SDLPP
+
+#endif // H_SDLPP_BROADPHASE
@@ -218,6 +218,144 @@ namespace SDLPP {
   };
   
   
+  /** Refers to a SlotMap value.  A handle to an erased value stays invalid,
+      even after its slot is reused, since the slot's generation changes. */
+  struct SlotHandle
+  {
+    Uint32 index;
+    Uint32 generation;
+    SlotHandle() : index(0xFFFFFFFF), generation(0) {}
+    SlotHandle(Uint32 i, Uint32 g) : index(i), generation(g) {}
+    bool is_null() const { return index == 0xFFFFFFFF; }
+    bool operator== (const SlotHandle& rhs) const { return index == rhs.index && generation == rhs.generation; }
+    bool operator!= (const SlotHandle& rhs) const { return !(*this == rhs); }
+  };
+
+  /** Values kept densely, in insertion order, and addressed by generational handles.
+      insert() and erase() are O(1), and neither moves other values, so iterating
+      by position is safe while they are called.
+      erase() only marks the value: it is still at its position, but no longer
+      valid, until compact() drops all erased values in one pass, keeping the
+      order of the rest.
+  */
+  template<class T>
+  class SlotMap
+  {
+  public:
+    SlotMap() : m_ErasedCount(0) {}
+
+    SlotHandle insert(const T& value)
+    {
+      Uint32 slot;
+      if (!m_Free.empty())
+      {
+        slot = m_Free.back();
+        m_Free.pop_back();
+      }
+      else
+      {
+        slot = Uint32(m_Slots.size());
+        m_Slots.push_back(Slot());
+      }
+      m_Slots[slot].dense = Uint32(m_Values.size());
+      m_Values.push_back(value);
+      m_DenseSlot.push_back(slot);
+      m_Erased.push_back(false);
+      return SlotHandle(slot, m_Slots[slot].generation);
+    }
+
+    bool is_valid(const SlotHandle& h) const
+    {
+      return h.index < m_Slots.size() && m_Slots[h.index].generation == h.generation;
+    }
+
+    T* get(const SlotHandle& h)
+    {
+      if (!is_valid(h)) return 0;
+      return &m_Values[m_Slots[h.index].dense];
+    }
+
+    /** Returns false if the handle is not valid */
+    bool erase(const SlotHandle& h)
+    {
+      if (!is_valid(h)) return false;
+      Slot& s = m_Slots[h.index];
+      ++s.generation;
+      m_Erased[s.dense] = true;
+      ++m_ErasedCount;
+      return true;
+    }
+
+    /** Drops erased values.  Positions change, handles stay valid */
+    void compact()
+    {
+      if (m_ErasedCount == 0) return;
+      Uint32 n = Uint32(m_Values.size()), out = 0;
+      for (Uint32 i = 0; i < n; ++i)
+      {
+        Uint32 slot = m_DenseSlot[i];
+        if (m_Erased[i])
+        {
+          m_Free.push_back(slot);
+          continue;
+        }
+        if (out != i)
+        {
+          m_Values[out] = m_Values[i];
+          m_DenseSlot[out] = slot;
+          m_Erased[out] = false;
+        }
+        m_Slots[slot].dense = out++;
+      }
+      m_Values.resize(out);
+      m_DenseSlot.resize(out);
+      m_Erased.resize(out);
+      m_ErasedCount = 0;
+    }
+
+    void clear()
+    {
+      for (Uint32 i = 0; i < m_DenseSlot.size(); ++i)
+      {
+        ++m_Slots[m_DenseSlot[i]].generation;
+        m_Free.push_back(m_DenseSlot[i]);
+      }
+      m_Values.clear();
+      m_DenseSlot.clear();
+      m_Erased.clear();
+      m_ErasedCount = 0;
+    }
+
+    /** Number of positions, including values erased since the last compact() */
+    int  size() const { return int(m_Values.size()); }
+    bool empty() const { return m_Values.empty(); }
+    int  get_erased_count() const { return m_ErasedCount; }
+
+    T&         operator[] (int i) { return m_Values[i]; }
+    const T&   operator[] (int i) const { return m_Values[i]; }
+    bool       is_erased(int i) const { return m_Erased[i]; }
+    SlotHandle get_handle(int i) const
+    {
+      if (m_Erased[i]) return SlotHandle();
+      Uint32 slot = m_DenseSlot[i];
+      return SlotHandle(slot, m_Slots[slot].generation);
+    }
+  private:
+    struct Slot
+    {
+      Uint32 dense;
+      Uint32 generation;
+      Slot() : dense(0), generation(0) {}
+    };
+
+    std::vector<T>      m_Values;
+    std::vector<Uint32> m_DenseSlot;   // Slot of each value
+    std::vector<bool>   m_Erased;
+    std::vector<Slot>   m_Slots;
+    std::vector<Uint32> m_Free;        // Slots of compacted values, for reuse
+    int                 m_ErasedCount;
+  };
+
   template<class T>
   class Accumulator
   {
@@ -334,13 +472,20 @@ namespace SDLPP {
   {
     iRect2 m_ScreenView;
     iVec2  m_Offset;
+    double m_Interpolation;
   public:
 	  GameView(int w=0, int h=0)
       : m_ScreenView(iVec2(0,0),iVec2(w,h)),
-        m_Offset(0,0)
+        m_Offset(0,0),
+        m_Interpolation(1.0)
 	  {
 	  }
 
+    /** How far between the previous simulation step and the current one
+        objects should be drawn (0..1).  Set by the AnimationManager. */
+    void   set_interpolation(double alpha) { m_Interpolation = alpha; }
+    double get_interpolation() const       { return m_Interpolation; }
+
     void set_screen_view(const iRect2& r) { m_ScreenView=r; }
     void set_offset(const iVec2& v)       { m_Offset=v; }
     void delta_offset(const iVec2& delta) { m_Offset+=delta; }
@@ -0,0 +1,28 @@
+#ifndef sdlpp_compress_h__
+#define sdlpp_compress_h__
+
+#include <sdlpp_common.h>
+
+namespace SDLPP
+{
+
+  /** Compression codecs used for resources.
+      LZ4 block format (compatible with the reference implementation),
+      tuned for fast decompression rather than ratio.
+  */
+
+  /** Returns the worst case compressed size of a buffer of the given size */
+  int lz4_compress_bound(int size);
+
+  /** Compresses size bytes of src into dst.
+      Returns the compressed size, or 0 if it does not fit in capacity. */
+  int lz4_compress(const char* src, int size, char* dst, int capacity);
+
+  /** Decompresses a block into dst.
+      Returns the decompressed size, or -1 if the input is corrupt or
+      does not fit in capacity. */
+  int lz4_decompress(const char* src, int size, char* dst, int capacity);
+
+} // namespace SDLPP
+
+#endif // sdlpp_compress_h__
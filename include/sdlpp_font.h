@@ -2,21 +2,61 @@
 #define sdlpp_font_h__
 
 #include <sdlpp_graphics.h>
+#include <sdlpp_atlas.h>
+#include <list>
 
 struct TTF_Font;
 
 namespace SDLPP
 {
 
+  /** Text is drawn from glyphs that are rendered once into atlas pages.
+      Layouts of recently drawn strings are kept, so drawing the same text
+      again does not allocate or upload anything. */
   class Font
   {
+    struct Glyph
+    {
+      int    page;
+      iRect2 rect;
+      int    advance;
+    };
+
+    struct GlyphQuad
+    {
+      int    page;
+      iRect2 src;
+      iVec2  offset;
+    };
+
+    struct Layout
+    {
+      xstring                text;
+      std::vector<GlyphQuad> quads;
+      iVec2                  size;
+    };
+
+    typedef std::unordered_map<Uint32, Glyph> glyph_map;
+    typedef std::list<Layout> layout_list;
+    typedef std::unordered_map<xstring, layout_list::iterator> layout_map;
+
+    static const int MAX_LAYOUTS = 64;
+
     TTF_Font*         m_TTF_Font;
     std::vector<char> m_FontData;
     SDL_RWops*        m_RWops;
 
+    glyph_map                      m_Glyphs;
+    std::vector<bitmap_pixels_ptr> m_Pages;
+    std::vector<AtlasPacker>       m_Packers;
+    layout_list                    m_Layouts;    // Most recently used first
+    layout_map                     m_LayoutIndex;
+
     friend class FontManager;
     //Font(TTF_Font* font, std::vector<char>* font_data, SDL_RWops* rw) : m_TTF_Font(font), m_FontData(font_data), m_RWops(rw) {}
     void destroy();
+    const Glyph&  get_glyph(Uint32 ch);
+    const Layout& get_layout(const xstring& text);
 
     Font(const Font& rhs) {}
     Font& operator= (const Font& rhs) { return *this; }
@@ -11,6 +11,7 @@ namespace SDLPP
   {
     SDL_Surface* m_Surface;
     SDL_Texture* m_Texture;
+    bool         m_AlphaKey;
 
     BitmapPixels(const BitmapPixels&) {}
     BitmapPixels& operator= (const BitmapPixels&) { return *this; }
@@ -26,6 +27,7 @@ namespace SDLPP
     BitmapPixels(unsigned w, unsigned h)
       : m_Surface(0)
       , m_Texture(0)
+      , m_AlphaKey(false)
       , m_Size(w,h)
     {
       m_Surface = SDL_CreateRGBSurface(0, w, h, 32, 0, 0, 0, 0);
@@ -35,6 +37,7 @@ namespace SDLPP
     BitmapPixels(SDL_Surface* surface)
       : m_Surface(surface)
       , m_Texture(0)
+      , m_AlphaKey(false)
       , m_Size(surface->w,surface->h)
     {}
 
@@ -48,8 +51,21 @@ namespace SDLPP
 
     void draw(const iRect2& src, const iRect2& dst);
 
+    /** Returns the texture for this surface, creating it on first use */
+    SDL_Texture* get_texture();
+
+    /** Uploads a modified part of the surface to an existing texture */
+    void update_texture(const iRect2& r)
+    {
+      if (!m_Texture) return;
+      SDL_Rect rect = R(r);
+      const Uint8* pixels = get_buffer() + r.tl.y*get_pitch() + r.tl.x*m_Surface->format->BytesPerPixel;
+      SDL_UpdateTexture(m_Texture, &rect, pixels, get_pitch());
+    }
+
     Uint32 get_colorkey() const 
     { 
+      if (m_AlphaKey) return 0;
       Uint32 res = 0x12345678;
       SDL_GetColorKey(m_Surface,&res);
       return res;
@@ -57,10 +73,22 @@ namespace SDLPP
 
     void set_colorkey(Uint32 color)
     {
+      if (m_AlphaKey) return;
       invalidate_texture();
       SDL_SetColorKey(m_Surface, 1, color);
     }
 
+    /** Use the alpha channel for transparency instead of a color key.
+        Transparent pixels must be stored as 0, which is then reported as the color key. */
+    void set_alpha_key()
+    {
+      invalidate_texture();
+      m_AlphaKey = true;
+      SDL_SetSurfaceBlendMode(m_Surface, SDL_BLENDMODE_BLEND);
+    }
+
+    SDL_Surface* get_surface() const { return m_Surface; }
+
     Uint32 get_pitch() const { return m_Surface->pitch; }
 
     const Uint8* get_buffer() const 
@@ -98,6 +126,9 @@ namespace SDLPP
     int get_width() const { return m_Region.get_width(); }
     int get_height() const { return m_Region.get_height(); }
 
+    const iRect2&     get_region() const { return m_Region; }
+    bitmap_pixels_ptr get_pixels() const { return m_Pixels; }
+
     Bitmap cut(const iRect2& sub_rect)
     {
       return Bitmap(m_Pixels, sub_rect.translate(m_Region.tl));
@@ -129,6 +160,13 @@ namespace SDLPP
   {
   public:
     virtual bool load(const xstring& name, Bitmap&) override;
+
+    /** Reads and decodes an image into a new surface, or returns NULL if not found.
+        Does not use the renderer, so it may be called from worker threads. */
+    static SDL_Surface* decode(const xstring& name);
+
+    /** Returns true if the file extension is of a supported image type */
+    static bool is_image(const xstring& name);
   };
 
   class BitmapCache : public Cache<Bitmap>
@@ -186,14 +224,39 @@ namespace SDLPP
       return SDL_CreateTextureFromSurface(m_Renderer, surface);
     }
 
+    /** Draws immediately, after flushing any batched sprites */
     void draw(SDL_Texture* texture, const iRect2& src, const iRect2& dst)
     {
+      flush();
       SDL_Rect rsrc=R(src),rdst=R(dst);
       SDL_RenderCopy(m_Renderer, texture,&rsrc,&rdst);
     }
 
+    /** Queues a textured quad in the sprite batch.
+        Consecutive quads from the same pixels are drawn in a single call,
+        so sprites packed in a TextureAtlas are drawn together.
+        The pixels are kept alive until the batch is flushed. */
+    void draw(bitmap_pixels_ptr pixels, const iRect2& src, const iRect2& dst);
+
+    /** Queues a quad, with its texture modulated by color */
+    void draw(bitmap_pixels_ptr pixels, const iRect2& src, const iRect2& dst, const SDL_Color& color);
+
+    /** Draws all batched sprites.  Called automatically by flip() and before
+        any immediate drawing. */
+    void flush();
+
+    /** Batching is on by default.  When off, every draw is issued immediately.
+        Batching needs SDL 2.0.18 or newer, and is always off with older versions. */
+#if SDL_VERSION_ATLEAST(2,0,18)
+    void set_batching(bool state) { flush(); m_Batching=state; }
+#else
+    void set_batching(bool) {}
+#endif
+    bool get_batching() const { return m_Batching; }
+
     void render(SDL_Texture* texture)
     {
+      flush();
     	SDL_RenderCopy(m_Renderer, texture,0,0);
     }
 
@@ -218,7 +281,11 @@ namespace SDLPP
     iVec2 position(float x, float y) const;
   private:
     friend struct std::default_delete<Graphics>;
-    Graphics() {}
+#if SDL_VERSION_ATLEAST(2,0,18)
+    Graphics() : m_Batching(true) {}
+#else
+    Graphics() : m_Batching(false) {}
+#endif
     ~Graphics() {}
     Graphics(const Graphics&) {}
     Graphics& operator= (const Graphics&) { return *this; }
@@ -229,6 +296,15 @@ namespace SDLPP
     SDL_Renderer*    m_Renderer;
     SDL_Texture*     m_BackBuffer;
     SDL_PixelFormat* m_ScreenFormat;
+
+    bool                    m_Batching;
+#if SDL_VERSION_ATLEAST(2,0,18)
+    void batch(bitmap_pixels_ptr pixels, const iRect2& src, const iRect2& dst, const SDL_Color& color);
+
+    bitmap_pixels_ptr       m_BatchPixels;
+    std::vector<SDL_Vertex> m_BatchVertices;
+    std::vector<int>        m_BatchIndices;
+#endif
   };
   
   inline Uint32 MapRGB(int r, int g, int b)
@@ -24,38 +24,94 @@ public:
 typedef std::shared_ptr<std::istream> istream_ptr;
 
 
+/** Storage codec of a single resource inside a resource file */
+enum ResourceCodec { CODEC_NONE=0, CODEC_LZ4=1 };
+
 /** A Resource File is an aggregate of several files into one.
     Use an instance of the ResourceFileWriter class to create such a file
     from a set of data files.
+
+    Files are written with a trailing table of contents, sorted by name hash,
+    followed by a fixed size footer.  Opening such a file reads only the footer
+    and the table.  Older files without a table are still readable, by walking
+    the header of every resource.
+
+    Resources may be stored compressed.  They are decompressed transparently
+    when read, either as a stream or into a buffer.
 */
 class ResourceFile
 {
-  struct Resource { int position; int size; };
+  struct Resource 
+  { 
+    Uint32 hash;
+    int    position;
+    int    size;
+    int    name_offset;
+    int    name_length;
+    int    codec;
+    int    original_size;
+  };
+  typedef std::vector<Resource> rsc_vec;
   typedef std::map<xstring,Resource> rsc_map;
-  rsc_map   m_Resources;
-  xstring   m_Filename;
+  rsc_vec     m_Resources;
+  char_vec    m_Names;
+  xstring     m_Filename;
+  const char* m_Mapping;
+  size_t      m_MappingSize;
+  size_t      m_DataEnd;
   ResourceFile(const ResourceFile& rhs) {}
   ResourceFile& operator= (const ResourceFile& rhs) { return *this; }
+
+  friend class ResourceFileWriter;
+  static Uint32 hash_name(const char* name, int length);
+  static void   build_index(const rsc_map& m, rsc_vec& resources, char_vec& names);
+  void          index_file();
+  void          index_mapping();
+  void          index_headers(SDL_RWops* rw, size_t size);
+  const Resource* find(const xstring& resource_name) const;
+  xstring       get_name(const Resource& r) const { return xstring(&m_Names[r.name_offset],r.name_length); }
 public:
   /** Open a resource file for reading.  Resources are indexed for later lookup.
       If there is more than one resource with the same name, the last one in
       the file will be used. 
       Passing a NULL value in the filename will use resources from the file system directly.
+      If memory_mapped is true, the whole file is mapped once, and resources are
+      served directly from the mapping without reopening or copying.
   */
-  ResourceFile(const char* filename);
-  virtual ~ResourceFile() {}
+  ResourceFile(const char* filename, bool memory_mapped=false);
+  virtual ~ResourceFile();
 
   /** Returns a dynamically allocated stream to read the resource requested.
       Caller must delete the stream when done. */
   SDL_RWops*  get(const xstring& resource_name);
 
-  /** Return the size (in bytes) of the resource */
+  /** Return the size (in bytes) of the resource, after decompression */
   size_t      get_size(const xstring& resource_name);
 
-  typedef rsc_map::const_iterator base_iterator;
-  typedef KeyIterator<base_iterator> const_iterator;
-  const_iterator begin() const { return const_iterator(m_Resources.begin()); }
-  const_iterator end() const { return const_iterator(m_Resources.end()); }
+  /** Returns a pointer to the resource bytes inside the file mapping.
+      The pointer is valid for the lifetime of this object.
+      Returns NULL if the file is not mapped, the resource does not exist
+      or it is stored compressed. */
+  const char* get_data(const xstring& resource_name, size_t& size);
+
+  /** Reads the entire resource into cv, decompressing directly into it if needed */
+  bool        read_contents(const xstring& resource_name, char_vec& cv);
+
+  bool        is_mapped() const { return m_Mapping!=0; }
+
+  /** Iterates over resource names, in table order (not alphabetical) */
+  class const_iterator
+  {
+    const ResourceFile*     m_File;
+    rsc_vec::const_iterator m_Iter;
+  public:
+    const_iterator(const ResourceFile* file, rsc_vec::const_iterator it) : m_File(file), m_Iter(it) {}
+    xstring operator*() const { return m_File->get_name(*m_Iter); }
+    const_iterator& operator++() { ++m_Iter; return *this; }
+    bool operator!=(const const_iterator& rhs) const { return m_Iter != rhs.m_Iter; }
+  };
+  const_iterator begin() const { return const_iterator(this,m_Resources.begin()); }
+  const_iterator end() const { return const_iterator(this,m_Resources.end()); }
 };
 
 void set_default_resource_file(ResourceFile* rf);
@@ -65,27 +121,39 @@ ResourceFile* get_default_resource_file();
 /** This class is used to create a resource file.
     It is usually used outside the main application by a utility that gathers
     various data files and creates a single aggregate.
+    The table of contents is written when the writer is closed or destroyed.
 
     The utility  rscfile  uses this class.
 */
 class ResourceFileWriter
 {
-  std::ofstream m_File;
+  std::fstream          m_File;
+  ResourceFile::rsc_map m_Entries;
+  bool                  m_Closed;
   ResourceFileWriter(const ResourceFileWriter& rhs) {}
   ResourceFileWriter& operator= (const ResourceFileWriter& rhs) { return *this; }
+
+  void begin_entry(const char* name, int length, ResourceCodec codec, int original_size);
 public:
   /** Open a resource file for writing.  If append is true, new resources will
       be added while maintaining the existing ones.
       Otherwise, existing resources will be removed.
+      Appending to a file in the old format converts it to the new one.
   */
   ResourceFileWriter(const char* filename, bool append=true);
-  virtual ~ResourceFileWriter() {}
+  virtual ~ResourceFileWriter();
 
-  /** Add a resource by copying the contents of a file. */
-  void add_resource(const char* filename);
+  /** Add a resource by copying the contents of a file.
+      If a codec is specified, the resource is stored compressed,
+      unless compression does not make it smaller. */
+  void add_resource(const char* filename, ResourceCodec codec=CODEC_NONE);
 
   /** Add a resource from a memory buffer. */
-  void add_resource(const char* name, const char* buffer, int length);
+  void add_resource(const char* name, const char* buffer, int length, ResourceCodec codec=CODEC_NONE);
+
+  /** Write the table of contents and close the file.
+      No resources can be added afterwards. */
+  void close();
 };
 
 /** Create an SDL IO object that implements stdio basic IO operations
@@ -98,9 +166,15 @@ public:
 SDL_RWops *SDL_RWFromStream(istream_ptr input);
 
 bool    read_contents(const xstring& name, char_vec& cv);
+
+/** Returns a pointer to the resource bytes if the default resource file is
+    memory mapped, so it can be used without copying.  Returns NULL otherwise. */
+const char* get_contents_data(const xstring& name, size_t& size);
 xstring read_contents_as_string(const xstring& name);
 
 void handle_xml_eol(xstring& s);
+/** Parses an XML resource in place.  Mapped resources are read only, and the
+    parser writes into its buffer, so they are copied once first. */
 xml_element* load_xml(const xstring& name);
 
 } // namespace SDLPP
@@ -0,0 +1,59 @@
+#ifndef sdlpp_mixer_h__
+#define sdlpp_mixer_h__
+
+#include <sdlpp_common.h>
+
+namespace SDLPP
+{
+
+  /** Inner loops of the audio mixer, on 16 bit samples mixed in 32 bit ints.
+      The scalar kernels are the reference.  The SSE2, AVX2 and NEON kernels
+      produce exactly the same output, and get_mix_kernels() picks the best one
+      the running CPU supports.
+  */
+  struct MixKernels
+  {
+    /** acc[i] += src[i] */
+    typedef void (*accumulate_func)(int* acc, const short* src, int n);
+
+    /** out[i] = saturate(acc[i] * gain[i]), truncated toward zero.
+        When gain is 0, the samples are only saturated. */
+    typedef void (*output_func)(short* out, const int* acc, int n, const float* gain);
+
+    const char*     name;
+    accumulate_func accumulate;
+    output_func     output;
+  };
+
+  /** The fastest kernels for this CPU.  Selected once, on the first call */
+  const MixKernels& get_mix_kernels();
+
+  /** All the kernels the running CPU supports.  The scalar reference is first */
+  std::vector<const MixKernels*> get_supported_mix_kernels();
+
+  enum ResampleMode
+  {
+    RESAMPLE_LINEAR,
+    RESAMPLE_SINC      // 8 tap Blackman windowed sinc.  The cutoff does not follow the rate,
+                       // so raising the pitch far above 1 may alias
+  };
+
+  /** Interleaved 16 bit samples, read by mix_resampled() */
+  struct MixSource
+  {
+    const short* data;
+    int          frames;
+    int          channels;
+    bool         loop;
+  };
+
+  /** Mixes n frames of src, starting at frame position pos and advancing by step
+      per output frame, into acc.  Channel c is scaled by gains[c].
+      Past the end, a looping source wraps around, and any other source is silent.
+      Returns the next position, or a negative value if the source has ended. */
+  double mix_resampled(int* acc, int n, const MixSource& src, double pos, double step,
+                       const float* gains, ResampleMode mode);
+
+} // namespace SDLPP
+
+#endif // sdlpp_mixer_h__
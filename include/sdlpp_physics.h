@@ -2,75 +2,96 @@
 #define H_SDLPP_PHYSICS
 
 #include <sdlpp_common.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace SDLPP {
 
+/** A row of collision bits, stored in 64 bit words.
+    The span of set bits is tracked, so tests only look where both rows have bits.
+*/
 class BitRow
 {
-  enum { BITS=8*sizeof(unsigned) };
-  typedef std::vector<unsigned> base_vec;
-  base_vec m_Data;
+  enum { BITS=64 };
+  typedef std::vector<Uint64> base_vec;
+  base_vec m_Data;     // One extra zero word, so unaligned reads need no bounds checks
   int      m_Size;
+  int      m_First;    // Set bits are all in [m_First,m_Last)
+  int      m_Last;
 
-  unsigned get_word(int i) const { if (i<0 || i>=int(m_Data.size())) return 0; return m_Data[i]; }
-  unsigned get_word_at(int offset) const
+  Uint64 get_word_at(int offset) const
   {
-    int w=offset/BITS;
-    int o=offset-(w*BITS);
-    unsigned word=(get_word(w)>>o);
-    if (o>0)
-    {
-      unsigned next=get_word(w+1);
-      next<<=(BITS-o);
-      word|=next;
-    }
+    if (offset<0) return (offset<=-BITS ? 0 : m_Data[0]<<(-offset));
+    int w=offset>>6;
+    int o=offset&(BITS-1);
+    if (w>=int(m_Data.size())-1) return 0;
+    Uint64 word=m_Data[w]>>o;
+    if (o>0) word|=m_Data[w+1]<<(BITS-o);
     return word;
   }
 
-  int get_first_one(unsigned u) const
+  static int get_first_one(Uint64 u)
+  {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i,u);
+    return int(i);
+#else
+    return __builtin_ctzll(u);
+#endif
+  }
+
+  static int get_last_one(Uint64 u)
   {
-    for(int i=0;i<BITS && u;++i,u>>=1)
-      if ((u&1)!=0) return i;
-    return 0;
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i,u);
+    return int(i);
+#else
+    return BITS-1-__builtin_clzll(u);
+#endif
   }
 public:
   BitRow(int size) 
-    : m_Data((size+BITS-1)/BITS,0), 
-      m_Size(size)
+    : m_Data((size+BITS-1)/BITS+1,0), 
+      m_Size(size),
+      m_First(size),
+      m_Last(0)
   {}
   void set(int i, bool state=true)
   {
     if (i<0 || i>=m_Size) return;
-    int wi=i/BITS;
-    int oi=i-(wi*BITS);
-    unsigned& word=m_Data[wi];
-    unsigned value=(1<<oi);
-    if (state) word|=value;
+    Uint64& word=m_Data[i>>6];
+    Uint64 value=Uint64(1)<<(i&(BITS-1));
+    if (state) 
+    {
+      word|=value;
+      m_First=Min(m_First,i);
+      m_Last=Max(m_Last,i+1);
+    }
     else word&=~value;
   }
 
+  bool empty() const { return m_First>=m_Last; }
+
+  /** Number of 64 bit words holding the bits, without the padding word */
+  int    get_word_count() const { return int(m_Data.size())-1; }
+  Uint64 get_word(int i) const { return m_Data[i]; }
+
+  /** Replaces all the bits with get_word_count() words.  Bits past the size are ignored */
+  void assign(const Uint64* words);
+
   unsigned get_bits(int offset, int len) const
   {
-    unsigned word=get_word_at(offset);
-    unsigned mask=-1;
-    mask <<= len;
-    mask = ~mask;
-    return word&mask;
+    Uint64 word=get_word_at(offset);
+    if (len<BITS) word&=(Uint64(1)<<len)-1;
+    return unsigned(word);
   }
 
-  int test(const BitRow& br, int offset, int br_offset) const
-  {
-    if (offset<0) return br.test(*this,-offset,0);
-    int len=Min(m_Size-offset,br.m_Size-br_offset);
-    for(int i=0;i<len;i+=BITS)
-    {
-      unsigned w=get_word_at(i+offset);
-      unsigned brw=br.get_word_at(i+br_offset);
-      w&=brw;
-      if (w) return i+get_first_one(w);
-    }
-    return -1;
-  }
+  /** Returns the first position, relative to offset, where both rows have a bit set.
+      Returns -1 if there is none. */
+  int test(const BitRow& br, int offset, int br_offset) const;
 };
 
 class CollisionModel2D
@@ -78,6 +99,8 @@ class CollisionModel2D
   typedef std::vector<BitRow>  Grid;
   Grid   m_Grid;
   iRect2 m_Rect;
+  int    m_FirstRow;   // Rows with bits set are all in [m_FirstRow,m_LastRow)
+  int    m_LastRow;
 
   const BitRow& get_row(int y) const
   {
@@ -87,15 +110,139 @@ class CollisionModel2D
   }
 
 public:
-  CollisionModel2D() {}
+  CollisionModel2D() : m_FirstRow(0), m_LastRow(0) {}
   CollisionModel2D(Bitmap image);
   bool empty() const { return m_Grid.empty(); }
   bool test(const CollisionModel2D& o, iVec2& offset);
   unsigned get_bits(const iVec2& offset, int len) const;
   void build(Bitmap image);
+
+  int  get_width() const { return m_Rect.get_width(); }
+  int  get_height() const { return m_Rect.get_height(); }
+
+  /** Appends the mask rows to words, as BitRow words, so it can be stored precomputed */
+  void get_words(std::vector<Uint64>& words) const;
+
+  /** Rebuilds the mask from rows written by get_words() */
+  void assign(int width, int height, const Uint64* words);
+};
+
+typedef std::shared_ptr<CollisionModel2D> collision_model_ptr;
+
+class WorkerPool;
+class JobSystem;
+
+/** Collision masks shared by every frame cut from the same source region,
+    so each one is built once, at load time, and not during gameplay.
+    Sprites use TextureAtlas::frame_key() for keys.
+*/
+class CollisionModelCache : public Singleton
+{
+public:
+  static CollisionModelCache* instance()
+  {
+    static std::unique_ptr<CollisionModelCache> ptr(new CollisionModelCache);
+    return ptr.get();
+  }
+
+  struct Request
+  {
+    xstring             key;
+    Bitmap              image;
+    collision_model_ptr model;   // Filled by resolve()
+  };
+  typedef std::vector<Request> request_vec;
+
+  /** Fills in the model of every request, taking it from the cache or building it.
+      Masks are built on the worker pool, when one is set, and resolve() waits for them. */
+  void resolve(request_vec& requests);
+
+  collision_model_ptr find(const xstring& key) const;
+  void                insert(const xstring& key, collision_model_ptr model) { m_Models[key]=model; }
+  int                 size() const { return int(m_Models.size()); }
+
+  /** Pool used to build masks in parallel.  Null (the default) builds them on the calling thread */
+  void set_worker_pool(WorkerPool* pool) { m_Pool=pool; }
+
+  void clear() { m_Models.clear(); }
+  virtual void shutdown() override { clear(); }
+private:
+  friend struct std::default_delete<CollisionModelCache>;
+  CollisionModelCache() : m_Pool(0) {}
+  ~CollisionModelCache() {}
+  CollisionModelCache(const CollisionModelCache&) {}
+
+  typedef std::unordered_map<xstring,collision_model_ptr> model_map;
+  model_map   m_Models;
+  WorkerPool* m_Pool;
 };
 
   
+/** Kinematic state of many bodies, stored as structure of arrays, so a
+    single integrate() pass updates all of them with streaming loops the
+    compiler can vectorize.
+    Bodies join with RigidBody2D::attach_kinematics(), and keep a handle,
+    which is a slot index that stays valid until the body detaches.
+    Freed slots are zeroed, so integrating them does nothing, and are reused.
+*/
+class KinematicsStore
+{
+public:
+  typedef std::vector<double> double_vec;
+
+  /** Returns a handle to a new slot, with all values zero */
+  int  add();
+  void remove(int h);
+
+  /** Number of bodies in the store */
+  int  get_count() const { return int(m_PX.size()-m_Free.size()); }
+
+  /** Advances every body by dt milliseconds, the same way RigidBody2D::advance does */
+  void integrate(int dt) { integrate(dt,0,get_slot_count()); }
+  /** Advances the slots in [begin,end) only.  Separate ranges may run in parallel */
+  void integrate(int dt, int begin, int end);
+  /** Slots in use or free, the range of integrate() */
+  int  get_slot_count() const { return int(m_PX.size()); }
+
+  dVec2  get_position(int h) const { return dVec2(m_PX[h],m_PY[h]); }
+  void   set_position(int h, const dVec2& p) { m_PX[h]=p.x; m_PY[h]=p.y; }
+  dVec2  get_velocity(int h) const { return dVec2(m_VX[h],m_VY[h]); }
+  void   set_velocity(int h, const dVec2& v) { m_VX[h]=v.x; m_VY[h]=v.y; }
+  dVec2  get_acceleration(int h) const { return dVec2(m_AX[h],m_AY[h]); }
+  void   set_acceleration(int h, const dVec2& a) { m_AX[h]=a.x; m_AY[h]=a.y; }
+  double get_angle(int h) const { return m_Angle[h]; }
+  void   set_angle(int h, double a) { m_Angle[h]=a; }
+  double get_angular_velocity(int h) const { return m_AVelocity[h]; }
+  void   set_angular_velocity(int h, double v) { m_AVelocity[h]=v; }
+  double get_angular_acceleration(int h) const { return m_AAcceleration[h]; }
+  void   set_angular_acceleration(int h, double a) { m_AAcceleration[h]=a; }
+private:
+  double_vec m_PX, m_PY;
+  double_vec m_VX, m_VY;
+  double_vec m_AX, m_AY;
+  double_vec m_Angle;
+  double_vec m_AVelocity;
+  double_vec m_AAcceleration;
+  int_vec    m_Free;
+};
+
+class RigidBody2D;
+
+/** A candidate pair for the pixel level collision test.
+    Filled by RigidBody2D::prepare_contact() on the game thread.  test_contact()
+    only reads the masks, so contacts may be tested in parallel. */
+struct Contact2D
+{
+  RigidBody2D*      body1;     // The heavier of the two
+  RigidBody2D*      body2;
+  CollisionModel2D* model1;
+  CollisionModel2D* model2;
+  iVec2             offset;    // Of body2 relative to body1.  Moved to the first hit by the test
+  bool              hit;
+  dVec2             normal;    // Of the collision, as seen by body2
+};
+typedef std::vector<Contact2D> contact_vec;
+
 class RigidBody2D : public GameObject
 {
   dVec2       m_Position;
@@ -114,7 +261,13 @@ class RigidBody2D : public GameObject
   double      m_Mass;
   xstring     m_Name;
 
-  dVec2 get_collision_normal(CollisionModel2D& cm, const iVec2& offset);
+  dVec2       m_PrevPosition; // At the start of the last fixed step, for rendering
+
+  // When attached, the motion state above is not used, and lives in the store
+  KinematicsStore* m_Kinematics;
+  int              m_Handle;
+
+  static dVec2 get_collision_normal(const CollisionModel2D& cm, const iVec2& offset);
 public:
   RigidBody2D(double mass=0) 
     : m_Mass(mass)
@@ -122,17 +275,38 @@ public:
     , m_BaseAngle(0)
     , m_AVelocity(0)
     , m_AAcceleration(0) 
+    , m_Kinematics(0)
+    , m_Handle(-1)
   {}
+  virtual ~RigidBody2D() { detach_kinematics(); }
 
-  virtual void               interact(RigidBody2D* o, int dt);
+  /** Tests for a collision with o, and calls handle_collision() on both if found.
+      Same as prepare_contact(), test_contact() and respond() in a row.
+      The AnimationManager calls these separately, for all pairs at once, so
+      this is not virtual: customize the response in handle_collision(). */
+  void                       interact(RigidBody2D* o, int dt);
+  /** Returns false if the rectangles do not overlap, and there is nothing to test.
+      Gets the collision models, so it must be called on the game thread. */
+  bool                       prepare_contact(RigidBody2D* o, Contact2D& c);
+  /** Sets c.hit and c.normal.  Thread safe, as long as the models do not change */
+  static void                test_contact(Contact2D& c);
+  /** Calls handle_collision() on both bodies, if c.hit */
+  static void                respond(const Contact2D& c);
   virtual iRect2             get_rect() const = 0;
   virtual bool               is_collidable() const { return true; }
+  /** Static sprites do not move, so they are indexed for collisions only once */
+  virtual bool               is_static_sprite() const { return false; }
+  /** Thread safe objects only change themselves in advance(), so it may run
+      on a job thread, alongside other objects.  See AnimationManager::set_job_system() */
+  virtual bool               is_thread_safe() const { return false; }
   virtual CollisionModel2D&  get_col_model() = 0;
   virtual xstring            get_flag(const xstring& flag) = 0;
   virtual const xstring&     get(const xstring& property) const = 0;
   virtual void               handle_collision(RigidBody2D* o, const dVec2& normal) {}
   virtual bool               advance(int dt)
   {
+    // Attached bodies are integrated by their store, in one pass for all
+    if (m_Kinematics) return true;
     double DT=dt*0.001;
     m_AVelocity+=m_AAcceleration*DT;
     m_Angle+=m_AVelocity*DT;
@@ -142,71 +316,147 @@ public:
     return true;
   }
 
+  /** Moves the motion state into a store, which must outlive the attachment.
+      From then on the store's owner integrates the body, with KinematicsStore::integrate(). */
+  void attach_kinematics(KinematicsStore* store);
+  /** Moves the motion state back into the body */
+  void detach_kinematics();
+  KinematicsStore* get_kinematics() const { return m_Kinematics; }
+  int              get_kinematics_handle() const { return m_Handle; }
+
   double get_mass() const { return m_Mass; }
   void   set_mass(double m) { m_Mass=m; }
-  iVec2 get_position() const { return iVec2(int(m_Position.x),int(m_Position.y)); }
-  dVec2 get_position(int) const { return m_Position; }
-  const dVec2& get_velocity() const { return m_Velocity; }
-  const dVec2& get_acceleration() const { return m_Acceleration; }
+  iVec2 get_position() const 
+  { 
+    dVec2 p=get_position(0);
+    return iVec2(int(p.x),int(p.y)); 
+  }
+  dVec2 get_position(int) const 
+  { 
+    return m_Kinematics ? m_Kinematics->get_position(m_Handle) : m_Position; 
+  }
+  dVec2 get_velocity() const 
+  { 
+    return m_Kinematics ? m_Kinematics->get_velocity(m_Handle) : m_Velocity; 
+  }
+  dVec2 get_acceleration() const 
+  { 
+    return m_Kinematics ? m_Kinematics->get_acceleration(m_Handle) : m_Acceleration; 
+  }
   
+  /** Position between the previous step and the current one, by alpha (0..1).
+      Used to render fixed steps smoothly, see AnimationManager::set_fixed_step() */
+  dVec2 get_interpolated_position(double alpha) const
+  {
+    dVec2 p=get_position(0);
+    if (alpha>=1.0) return p;
+    return m_PrevPosition+(p-m_PrevPosition)*alpha;
+  }
+  void  save_previous_position() { m_PrevPosition=get_position(0); }
   void  offset_position(const dVec2& dp)
   {
-    m_Position+=dp;
+    set_position(get_position(0)+dp);
   }
   
   void  set_position(const iVec2& p) 
   { 
-    m_Position=dVec2(p.x,p.y); 
+    set_position(dVec2(p.x,p.y)); 
   }
   
   void  set_position(const dVec2& p) 
   { 
-    m_Position=p;
+    if (m_Kinematics) m_Kinematics->set_position(m_Handle,p);
+    else m_Position=p;
   }
 
   void  set_velocity(const dVec2& v) 
   { 
-    m_Velocity=v; 
+    if (m_Kinematics) m_Kinematics->set_velocity(m_Handle,v);
+    else m_Velocity=v; 
   }
 
   void  set_velocity(const dVec2& direction, double speed)
   { 
     set_velocity(direction.normalized()*speed); 
   }
-  void  set_acceleration(const dVec2& a) { m_Acceleration=a; }
+  void  set_acceleration(const dVec2& a) 
+  { 
+    if (m_Kinematics) m_Kinematics->set_acceleration(m_Handle,a);
+    else m_Acceleration=a; 
+  }
   void  set_acceleration(const dVec2& direction, double magnitude) 
   { 
     set_acceleration(direction.normalized()*magnitude); 
   }
   void  set_acceleration(double magnitude)
   {
-    dVec2 dir(magnitude*sin(m_BaseAngle+m_Angle),-magnitude*cos(m_BaseAngle+m_Angle));
+    double angle=m_BaseAngle+get_angle();
+    dVec2 dir(magnitude*sin(angle),-magnitude*cos(angle));
     set_acceleration(dir);
   }
   
-  void set_angular_velocity(double v) { m_AVelocity=v; }
-  void set_angular_acceleration(double a) { m_AAcceleration=a; }
-  void set_angle(double a) { m_Angle=a; }
+  void set_angular_velocity(double v) 
+  { 
+    if (m_Kinematics) m_Kinematics->set_angular_velocity(m_Handle,v);
+    else m_AVelocity=v; 
+  }
+  void set_angular_acceleration(double a) 
+  { 
+    if (m_Kinematics) m_Kinematics->set_angular_acceleration(m_Handle,a);
+    else m_AAcceleration=a; 
+  }
+  void set_angle(double a) 
+  { 
+    if (m_Kinematics) m_Kinematics->set_angle(m_Handle,a);
+    else m_Angle=a; 
+  }
   void set_base_angle(double a) { m_BaseAngle=a; }
   double get_base_angle() const { return m_BaseAngle; }
-  double get_angle() const { return m_Angle; }
-  double get_angular_velocity() const { return m_AVelocity; }
-  double get_angular_acceleration() const { return m_AAcceleration; }
+  double get_angle() const 
+  { 
+    return m_Kinematics ? m_Kinematics->get_angle(m_Handle) : m_Angle; 
+  }
+  double get_angular_velocity() const 
+  { 
+    return m_Kinematics ? m_Kinematics->get_angular_velocity(m_Handle) : m_AVelocity; 
+  }
+  double get_angular_acceleration() const 
+  { 
+    return m_Kinematics ? m_Kinematics->get_angular_acceleration(m_Handle) : m_AAcceleration; 
+  }
 
   void set_name(const xstring& name) { m_Name=name; }
   const xstring& get_name() const { return m_Name; }
 };
 
+/** Measures frame times with the high resolution performance counter */
 class FrameTimer
 {
-  int m_LastTicks;
+  Uint64 m_Last;
+  Uint64 m_Frequency;
+  double m_Remainder;   // Fraction of a ms not returned by calc_dt() yet
 public:
-  FrameTimer() : m_LastTicks(SDL_GetTicks()) {}
+  FrameTimer() 
+    : m_Last(SDL_GetPerformanceCounter())
+    , m_Frequency(SDL_GetPerformanceFrequency())
+    , m_Remainder(0) 
+  {}
+  void reset() { m_Last=SDL_GetPerformanceCounter(); m_Remainder=0; }
+  /** Time since the previous call, in ms */
+  double calc_elapsed()
+  {
+    Uint64 cur=SDL_GetPerformanceCounter();
+    double ms=double(cur-m_Last)*1000.0/double(m_Frequency);
+    m_Last=cur;
+    return ms;
+  }
+  /** Whole ms since the previous call.  The fractions are carried over,
+      so the sum of the results follows the clock. */
   int calc_dt()
   {
-    int cur=SDL_GetTicks();
-    int dt=cur-m_LastTicks;
-    m_LastTicks=cur;
+    m_Remainder+=calc_elapsed();
+    int dt=int(m_Remainder);
+    m_Remainder-=dt;
     return dt;
   }
 };
@@ -0,0 +1,93 @@
+#ifndef sdlpp_preload_h__
+#define sdlpp_preload_h__
+
+#include <sdlpp_thread.h>
+#include <sdlpp_graphics.h>
+#include <sdlpp_anim.h>
+
+namespace SDLPP
+{
+
+  /** Loads bitmaps and sprites ahead of time on a pool of worker threads.
+      Workers read the files, parse sprite XML (or load compiled sprites) and
+      decode images into surfaces.
+      The results are published into BitmapCache and SpriteCache by poll() or wait(),
+      which must be called from the game thread.  Textures are still created on
+      first draw.
+
+      Usage:
+        Preloader pl;
+        pl.add_manifest("all_rsc.txt");
+        while (!pl.poll()) draw_progress_bar(pl.get_progress());
+  */
+  class Preloader
+  {
+  public:
+    Preloader(int threads=0);
+    ~Preloader();
+
+    /** Queue every resource listed in a manifest (whitespace separated names).
+        Sprite XMLs and images are loaded, other resources are ignored. */
+    void add_manifest(const xstring& manifest_name);
+
+    /** Queue a sprite XML, along with all the images it references */
+    void add_sprite(const xstring& name);
+
+    /** Queue an image.  Images referenced by queued sprites are given the
+        sprite's color key, so they are loaded after all sprites are parsed. */
+    void add_bitmap(const xstring& name);
+
+    /** Publishes all finished work into the caches.
+        Returns true when everything queued has been published. */
+    bool poll();
+
+    /** Blocks until all queued work is published */
+    void wait();
+
+    int    get_total() const;
+    int    get_completed() const;
+    double get_progress() const;
+
+    /** Names of resources that failed to load */
+    const str_vec& get_errors() const { return m_Errors; }
+  private:
+    Preloader(const Preloader&) {}
+    Preloader& operator= (const Preloader&) { return *this; }
+
+    struct LoadedBitmap
+    {
+      xstring      name;
+      SDL_Surface* surface;
+    };
+
+    struct LoadedSprite
+    {
+      xstring      name;
+      xml_element* root;       // Set when there is no compiled sprite
+      std::shared_ptr<CompiledSprite> compiled;
+      str_vec      images;
+    };
+
+    void load_sprite(const xstring& name);
+    void load_bitmap(const xstring& name, bool use_key, Uint32 color_key);
+    void request_bitmap(const xstring& name, bool use_key, Uint32 color_key);
+    void release_deferred();
+    bool sprite_ready(const LoadedSprite& ls, bool all_done);
+
+    SDL_mutex*                m_Mutex;
+    std::set<xstring>         m_Requested;
+    str_vec                   m_Deferred;
+    std::vector<LoadedBitmap> m_Bitmaps;
+    std::list<LoadedSprite>   m_Sprites;
+    str_vec                   m_Errors;
+    str_vec                   m_NewErrors;
+    int                       m_PendingSprites;
+    int                       m_Total;
+    int                       m_Finished;
+    int                       m_Completed;
+    WorkerPool                m_Pool;     // Last, so workers stop before the rest is destroyed
+  };
+
+} // namespace SDLPP
+
+#endif // sdlpp_preload_h__
@@ -3,6 +3,8 @@
 
 #include "sdlpp_common.h"
 #include "sdlpp_io.h"
+#include "sdlpp_thread.h"
+#include "sdlpp_mixer.h"
 
 class MP3Decoder;
 
@@ -27,6 +29,9 @@ const int SOUND_BUFFER_SIZE = 1024;
 /// SoundClips in their nature allocate memory.  In order to make their usage simple
 /// and still not waste resources by duplicating clips in memory, SoundClip objects
 /// should be used through shared_ptr called   sound_clip_ptr
+/// and are best obtained from SoundClipCache (see sound_clip() below).
+/// If the resource file holds 'name.pcm', written by write_converted() in the
+/// device format, it is used as is instead of loading and converting the WAV.
 class SoundClip
 {
   SoundClip(const SoundClip& rhs) {}
@@ -35,18 +40,71 @@ public:
   SoundClip(const xstring& filename);
   virtual ~SoundClip();
 
+  /** Largest absolute sample value.  Used to find the quietest voice to steal */
+  int get_peak() const { return m_Peak; }
+
+  /** Offline: converts the WAV resource 'name' to 16 bit samples at the given
+      frequency, and adds it to the resource pack as 'name.pcm'. */
+  static void write_converted(ResourceFileWriter& w, const xstring& name, int freq, bool stereo,
+                              ResourceCodec codec=CODEC_LZ4);
 private:
   void destroy();
   void load_from_rwop(SDL_RWops* rwops, const char* name);
+  bool load_converted(ResourceFile* rf, const xstring& name);
+  void compute_peak();
   friend class SoundManager;
   uint8_vec m_Buffer;
-  Uint8*    m_Wave;
+  int       m_Peak;
 };
 
 typedef std::shared_ptr<SoundClip> sound_clip_ptr;
 
-/** Start playback of this sound clip. */
-void play(sound_clip_ptr clip, bool loop = false);
+class SoundClipLoader : public Loader<sound_clip_ptr>
+{
+public:
+  virtual bool load(const xstring& name, sound_clip_ptr& clip) override;
+};
+
+/** Shares clips by resource name, so that each is loaded and converted once */
+class SoundClipCache : public Cache<sound_clip_ptr>
+{
+public:
+  static SoundClipCache* instance()
+  {
+    static std::unique_ptr<SoundClipCache> ptr(new SoundClipCache);
+    return ptr.get();
+  }
+private:
+  friend struct std::default_delete<SoundClipCache>;
+  SoundClipCache()
+  {
+    set_loader(loader_ptr(new SoundClipLoader));
+  }
+  ~SoundClipCache() {}
+  SoundClipCache(const SoundClipCache&) {}
+};
+
+inline sound_clip_ptr sound_clip(const xstring& name)
+{
+  return SoundClipCache::instance()->get(name);
+}
+
+/** Volume, stereo position and playback rate of a playing clip */
+struct VoiceParams
+{
+  VoiceParams(float g=1.0f, float p=0.0f, float r=1.0f) : gain(g), pan(p), rate(r) {}
+  float gain;    // 1 is the clip's own level
+  float pan;     // -1 is left, 0 is center and 1 is right.  Ignored on mono output
+  float rate;    // 2 plays an octave higher and twice as fast
+
+  bool is_unity() const { return gain==1.0f && pan==0.0f && rate==1.0f; }
+};
+
+/** Start playback of this sound clip.
+    Higher priority clips may steal voices from lower priority ones, see SoundManager.
+    Returns a voice id, for SoundManager::set_voice_params and stop_voice */
+int play(sound_clip_ptr clip, bool loop = false, int priority = 0,
+         const VoiceParams& params = VoiceParams());
 
 
 
@@ -71,22 +129,39 @@ public:
   /** Start playback of this sound stream. */
   void play();
 
-  /** Stop playback of this stream */
+  /** Stop playback of this stream.  What was already decoded is still played */
   void stop();
+
+  /** Blocks until the given number of frames (SOUND_BUFFER_SIZE samples each) are
+      decoded, or the stream ends.  Call before play() to avoid starting with silence.
+      Returns false if the stream ended first. */
+  bool prefill(int frames);
+
+  /** Fraction of the decode buffer that is filled, 0 to 1 */
+  float get_fill() const { return float(m_Data->m_Ring.size())/m_Data->m_Ring.capacity(); }
+
+  /** Number of times the audio callback asked for a frame before the decoder
+      had it ready.  Silence is played instead. */
+  int  get_underruns() const { return m_Data->m_Underruns; }
 protected:
   void destroy();
 
+  /** Called from the audio callback.  Returns 0 when the stream has ended */
   virtual Uint8* get_frame(int bytes);
 private:
   void load_from_rwop(SDL_RWops* rwops, const char* name);
   void load(const xstring& filename);
   friend class SoundManager;
-  friend struct SoundStream_Thread;
+  friend class StreamDecoder;
+
+  /** True when the decoder is done, and everything it produced was played */
+  bool is_finished() const;
 
-  int frames_available();
-  int frames_to_fill();
+  /** True if the decoder can add a chunk */
+  bool needs_decode() const;
 
-  int    decode_thread();
+  /** Decodes one chunk into the ring.  Called by the StreamDecoder thread */
+  void decode_chunk();
 
   struct Data
   {
@@ -94,54 +169,192 @@ private:
       : //m_DataStream(0),
         m_Source(0),
         m_Decoder(0),
-        m_Buffer(new Uint8[size]),
-        m_Start(0), 
-        m_Stop(0),
-        m_DecodeThread(0),
-        m_Semaphore(0),
+        m_Ring(size),
         m_Finished(false),
-        m_ThreadDone(false)
+        m_DecodeDone(false),
+        m_Underruns(0)
     {}
     SDL_RWops*           m_Source;
     //Sound_State          m_State;
     MP3Decoder*          m_Decoder;
     std::vector<Uint8>   m_EncodedStream;
-    Uint8*               m_Buffer;
-    int                  m_Start,m_Stop;
-    SDL_Thread*          m_DecodeThread;
-    SDL_sem*             m_Semaphore;
-    bool                 m_Finished;
-    bool                 m_ThreadDone;
+    SpscRing<Uint8>      m_Ring;        // Decoder thread writes, audio callback reads
+    uint8_vec            m_Frame;       // Contiguous copy handed to the mixer
+    std::atomic<bool>    m_Finished;
+    std::atomic<bool>    m_DecodeDone;
+    std::atomic<int>     m_Underruns;
   } *m_Data;
 };
 
 typedef std::shared_ptr<SoundStream> sound_stream_ptr;
 
+/// Decodes all loaded streams on a single shared thread.
+/// Each time, the stream with the emptiest buffer gets the next chunk.
+/// The thread sleeps until a stream's buffer has room, and the audio callback
+/// wakes it without taking any lock.
+class StreamDecoder : public Singleton
+{
+public:
+  static StreamDecoder* instance()
+  {
+    static std::unique_ptr<StreamDecoder> ptr(new StreamDecoder);
+    return ptr.get();
+  }
+
+  /** Stops the decoding thread */
+  virtual void shutdown() override;
+
+  void add(SoundStream* stream);
+
+  /** Returns once the stream is not being decoded, and never will be again */
+  void remove(SoundStream* stream);
+
+  /** Lock free, so it may be called from the audio callback */
+  void wake() { SDL_SemPost(m_Wakeup); }
+
+  /** Blocks until the stream has the given number of bytes buffered, or has ended */
+  bool wait_for(SoundStream* stream, int bytes);
+private:
+  friend struct std::default_delete<StreamDecoder>;
+  StreamDecoder();
+  ~StreamDecoder();
+  StreamDecoder(const StreamDecoder&) {}
+  StreamDecoder& operator= (const StreamDecoder&) { return *this; }
+
+  static int SDLCALL thread_main(void* decoder);
+  void run();
+  SoundStream* pick() const;
+
+  std::vector<SoundStream*> m_Streams;
+  SDL_Thread*               m_Thread;
+  SDL_mutex*                m_Mutex;     // Held while a chunk is decoded
+  SDL_cond*                 m_Progress;  // Signalled after each chunk
+  SDL_sem*                  m_Wakeup;
+  bool                      m_Stop;
+};
+
+/// Fixed set of voices, used only by the audio thread.
+/// Allocating and freeing are O(1), and never touch the heap.
+class VoicePool
+{
+public:
+  struct Voice
+  {
+    Voice() : pos(0), loop(false), priority(0), serial(0), id(0) {}
+    sound_clip_ptr clip;
+    double         pos;           // Frame position, negative when done
+    bool           loop;
+    int            priority;
+    Uint32         serial;        // Start order, for stealing the oldest
+    int            id;            // Returned by SoundManager::play
+    VoiceParams    params;
+  };
+
+  enum StealPolicy { STEAL_OLDEST, STEAL_QUIETEST, STEAL_PRIORITY };
+
+  VoicePool(int capacity=32) { resize(capacity); }
+
+  /** Changes the capacity.  All voices are discarded */
+  void resize(int capacity);
+
+  int capacity() const { return int(m_Voices.size()); }
+  int size() const { return int(m_Active.size()); }
+
+  /** Returns the i'th playing voice, for 0<=i<size() */
+  Voice& active(int i) { return m_Voices[m_Active[i]]; }
+
+  /** Returns a free voice, or when there is none, a playing voice chosen by policy.
+      The pool never releases clips: the caller must dispose of a stolen voice's clip.
+      Returns 0 if the new voice loses (only with STEAL_PRIORITY). */
+  Voice* allocate(StealPolicy policy, int priority);
+
+  /** Returns the i'th playing voice to the free list, after its clip was disposed of.
+      The last playing voice takes its place in the active list. */
+  void free(int i);
+private:
+  Voice* find_victim(StealPolicy policy, int priority);
+
+  std::vector<Voice> m_Voices;
+  int_vec            m_Active;
+  int_vec            m_Free;
+  Uint32             m_Serial;
+};
+
+/// Snapshot of the audio thread counters, see SoundManager::get_stats
+struct AudioStats
+{
+  enum { HISTOGRAM_BUCKETS=16 };
+
+  /** Callback durations.  Bucket 0 counts callbacks shorter than 1us, bucket i
+      those from 2^(i-1) to 2^i us, and the last bucket all longer ones. */
+  Uint32 callback_histogram[HISTOGRAM_BUCKETS];
+  Uint32 callbacks;
+  Uint32 max_callback_us;
+  Uint32 late_callbacks;    // Took longer than the audio they produced lasts
+  int    voices;            // Playing in the last callback
+  int    max_voices;
+  float  min_stream_fill;   // Emptiest stream buffer in the last callback, 1 with no streams
+  Uint32 underruns;         // Stream frames that were not decoded in time
+  Uint32 steals;            // Voices taken over by newer clips
+  Uint32 dropped;           // Clips not played, because they lost to every voice or the queue was full
+
+  /** Upper bound of histogram bucket i, in microseconds */
+  static Uint32 bucket_limit(int i) { return Uint32(1)<<i; }
+};
+
 /// Audio subsystem management singleton object
 /// Provides management, mixing and streaming functionality.
 /// It is initialized by the Application::init_audio function and then used automatically
 /// by SoundClip objects.
+/// Clips are played on a fixed number of voices.  play() hands clips to the audio
+/// thread through a lock free queue, and when all voices are busy the audio thread
+/// steals one according to the steal policy.  When the queue is full, play()
+/// drops the clip, but stops and parameter changes wait for the queue under the audio lock.
 class SoundManager : public Singleton
 {
-  struct SoundClipState
+  struct Command
   {
-    SoundClipState(sound_clip_ptr c, bool l) : clip(c), pos(0), loop(l) {}
-    sound_clip_ptr  clip;
-    int             pos;
-    bool            loop;
+    enum Type { PLAY, SET_PARAMS, STOP, STOP_ALL };
+    Command(Type t=PLAY, int i=0) : type(t), id(i), loop(false), priority(0) {}
+    Type           type;
+    int            id;
+    sound_clip_ptr clip;
+    bool           loop;
+    int            priority;
+    VoiceParams    params;
   };
 
-  typedef std::list<SoundClipState> clip_seq;
   typedef std::list<sound_stream_ptr> stream_seq;
-  clip_seq   m_Clips;
+  VoicePool  m_Voices;
   stream_seq m_Streams;
   double     m_Gain,m_dGain;
   bool       m_Fading;
 
+  std::unique_ptr<SpscRing<Command>>        m_Commands;   // Game thread to audio thread
+  std::unique_ptr<SpscRing<sound_clip_ptr>> m_Retired;    // Clips released on the game thread
+  std::atomic<int>                          m_StealPolicy;
+  std::atomic<int>                          m_ResampleMode;
+  int                                       m_NextVoiceId;
+
+  // Written by the audio thread (and dropped also by play), read by get_stats
+  std::atomic<Uint32> m_Histogram[AudioStats::HISTOGRAM_BUCKETS];
+  std::atomic<Uint32> m_Callbacks,m_MaxCallback,m_LateCallbacks;
+  std::atomic<int>    m_VoiceCount,m_MaxVoices,m_MinStreamFill;  // Fill in 1/1000
+  std::atomic<Uint32> m_Underruns,m_Steals,m_Dropped;
+  Uint64              m_PerfFrequency;
+
   void cleanup();
+  void send(const Command& cmd);
+  void release_retired();
+  void process_commands();
+  void retire(sound_clip_ptr& clip);
+  VoicePool::Voice* find_voice(int id);
+  void mix_voice(VoicePool::Voice& v, int* mix, int samples, const MixKernels& kernels);
+  void record_callback(Uint64 start, int samples);
   void AudioCallback(Uint8 *stream, int len);
   static void AudioCallback(void *userdata, Uint8 *stream, int len);
-  static Accumulator<int> s_MixingBuffer;
+  static int_vec s_MixingBuffer;
+  std::vector<float> m_GainRamp;
 public:
   /** Returns a pointer to the sound management object */
   static SoundManager* instance(bool destroy=false)
@@ -158,8 +371,16 @@ public:
   virtual void shutdown();
 
   /// Initialize audio system to 16 bit signed.
-  /// Specify sampling frequency and mono/stereo.
-  void initialize(int freq, bool stereo);
+  /// Specify sampling frequency and mono/stereo, and how many clips may play at once.
+  void initialize(int freq, bool stereo, int voices=32);
+
+  /** Selects which voice is replaced when a clip is played while all voices are busy */
+  void set_steal_policy(VoicePool::StealPolicy policy) { m_StealPolicy=policy; }
+  VoicePool::StealPolicy get_steal_policy() const { return VoicePool::StealPolicy(int(m_StealPolicy)); }
+
+  /** Interpolation used for voices that do not play at their natural rate */
+  void set_resample_mode(ResampleMode mode) { m_ResampleMode=mode; }
+  ResampleMode get_resample_mode() const { return ResampleMode(int(m_ResampleMode)); }
 
   /** Stop all playback.   Clips will continue from where they were when unpause is done. */
   void pause(bool state=true);
@@ -175,8 +396,20 @@ public:
   int  get_freq() const { return m_Spec.freq; }
   bool is_stereo() const { return m_Spec.channels==2; }
 
-  /** Send a sound clip */
-  void play(sound_clip_ptr clip, bool loop);
+  /** Send a sound clip.  Never blocks on the audio thread.
+      Returns an id for controlling the voice while it plays, or 0 if audio is not initialized */
+  int  play(sound_clip_ptr clip, bool loop, int priority=0, const VoiceParams& params=VoiceParams());
+
+  /** Reads the counters of the audio thread, without blocking it.
+      Each value is current, but they are not taken at exactly the same moment. */
+  void get_stats(AudioStats& stats) const;
+  void reset_stats();
+
+  /** Changes a playing voice.  Ignored if the voice has already ended */
+  void set_voice_params(int id, const VoiceParams& params);
+
+  /** Stops a single voice */
+  void stop_voice(int id);
 
   /** Send a stream for playback */
   void play(sound_stream_ptr stream);
@@ -184,7 +417,12 @@ public:
   SDL_AudioSpec* get_audio_spec() { return &m_Spec; }
 private:
   friend struct std::default_delete<SoundManager>;
-  SoundManager() : m_Fading(false), m_Gain(1.0), m_dGain(0.0) {}
+  SoundManager() : m_Gain(1.0), m_dGain(0.0), m_Fading(false), m_StealPolicy(VoicePool::STEAL_OLDEST),
+                   m_ResampleMode(RESAMPLE_LINEAR), m_NextVoiceId(0),
+                   m_PerfFrequency(SDL_GetPerformanceFrequency())
+  {
+    reset_stats();
+  }
   ~SoundManager() 
   {
     SDL_CloseAudio();
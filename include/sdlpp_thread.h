@@ -0,0 +1,228 @@
+#ifndef sdlpp_thread_h__
+#define sdlpp_thread_h__
+
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <sdlpp_common.h>
+
+namespace SDLPP
+{
+
+  /** Locks an SDL mutex for the duration of a scope */
+  class MutexLock
+  {
+    SDL_mutex* m_Mutex;
+    MutexLock(const MutexLock&) {}
+    MutexLock& operator= (const MutexLock&) { return *this; }
+  public:
+    MutexLock(SDL_mutex* mutex) : m_Mutex(mutex) { SDL_LockMutex(m_Mutex); }
+    ~MutexLock() { SDL_UnlockMutex(m_Mutex); }
+  };
+
+  /** A fixed set of worker threads, executing queued tasks in FIFO order.
+      Tasks must not throw, and must not touch the caches or the renderer,
+      which are only safe to use from the game thread.
+  */
+  class WorkerPool
+  {
+  public:
+    typedef std::function<void()> task;
+
+    /** Create the pool with the given number of threads.
+        Zero selects one thread less than the number of CPUs (at least one). */
+    WorkerPool(int threads=0);
+
+    /** Discards tasks that have not started, and waits for running ones */
+    ~WorkerPool();
+
+    void push(const task& t);
+
+    /** Blocks until the queue is empty and no task is running */
+    void wait_idle();
+
+    int  get_thread_count() const { return int(m_Threads.size()); }
+  private:
+    WorkerPool(const WorkerPool&) {}
+    WorkerPool& operator= (const WorkerPool&) { return *this; }
+
+    static int SDLCALL thread_main(void* pool);
+    void run();
+
+    std::deque<task>         m_Tasks;
+    std::vector<SDL_Thread*> m_Threads;
+    SDL_mutex*               m_Mutex;
+    SDL_cond*                m_TaskReady;
+    SDL_cond*                m_Idle;
+    int                      m_Busy;
+    bool                     m_Stop;
+  };
+
+  /** Jobs pushed together, so they can be waited for together.
+      Must outlive its jobs, so wait for it before it goes out of scope.
+  */
+  class JobGroup
+  {
+  public:
+    JobGroup() : m_Pending(0), m_ErrorLock(0) {}
+
+    bool is_done() const { return m_Pending.load(std::memory_order_acquire) == 0; }
+  private:
+    JobGroup(const JobGroup&) {}
+    JobGroup& operator= (const JobGroup&) { return *this; }
+    friend class JobSystem;
+
+    std::atomic<int>   m_Pending;
+    std::exception_ptr m_Error;      // The first exception thrown by a job
+    SDL_SpinLock       m_ErrorLock;
+  };
+
+  /** Worker threads for short, fine grained jobs, such as the parts of one frame.
+      Each thread has its own queue, and when it runs out of jobs it steals from
+      the others.  Jobs pushed from a worker go to its own queue, so a job that
+      splits its work keeps most of it local.
+      Threads that wait for a group run jobs meanwhile, instead of sleeping.
+      Unlike the WorkerPool, jobs may throw: wait() rethrows the first exception.
+  */
+  class JobSystem
+  {
+  public:
+    typedef std::function<void()>         job;
+    typedef std::function<void(int,int)>  range_func;
+
+    /** Zero threads selects one thread less than the number of CPUs.
+        The calling thread takes part in wait(), so with one CPU there may be no
+        worker threads at all, and everything runs on the caller. */
+    JobSystem(int threads = 0);
+
+    /** Waits for the running jobs.  Jobs that have not started are discarded */
+    ~JobSystem();
+
+    void push(JobGroup& group, const job& j);
+
+    /** Runs queued jobs until all the jobs of the group are done */
+    void wait(JobGroup& group);
+
+    /** Calls f(b,e) on sub ranges of [begin,end), of up to grain items each,
+        and returns when all are done.  The range is split in halves, so idle
+        threads steal big pieces first. */
+    void parallel_for(int begin, int end, int grain, const range_func& f);
+
+    int  get_thread_count() const { return int(m_Threads.size()); }
+  private:
+    JobSystem(const JobSystem&) {}
+    JobSystem& operator= (const JobSystem&) { return *this; }
+
+    struct Job
+    {
+      job       run;
+      JobGroup* group;
+    };
+
+    struct Queue
+    {
+      Queue() : lock(0) {}
+      SDL_SpinLock    lock;
+      std::deque<Job> jobs;
+      char            pad[64];      // Keep the locks apart
+    };
+
+    struct Worker
+    {
+      JobSystem* system;
+      int        index;
+    };
+
+    static int SDLCALL thread_main(void* worker);
+    void run(int index);
+    int  current_queue() const;
+    bool find_job(int index, Job& j);
+    void execute(Job& j);
+    void split(int begin, int end, int grain, const range_func& f, JobGroup& group);
+
+    // Queue 0 is for threads outside the system, and queue i+1 for worker i
+    std::vector<Queue>       m_Queues;
+    std::vector<Worker>      m_Workers;
+    std::vector<SDL_Thread*> m_Threads;
+    SDL_sem*                 m_Wake;       // Posted once per job
+    std::atomic<bool>        m_Stop;
+  };
+
+  /** Lock free ring buffer for exactly one producer thread and one consumer thread.
+      The producer only calls write() and the consumer only calls read().
+      size() and space() may be called from either side, and are exact for the
+      caller's own direction: the producer never sees less space, and the
+      consumer never sees fewer items, than there really are.
+      The capacity is rounded up to a power of two.
+  */
+  template<class T>
+  class SpscRing
+  {
+  public:
+    SpscRing(int capacity)
+      : m_Head(0)
+      , m_Tail(0)
+    {
+      int cap = 1;
+      while (cap < capacity) cap <<= 1;
+      m_Data.resize(cap);
+      m_Mask = unsigned(cap - 1);
+    }
+
+    int capacity() const { return int(m_Mask + 1); }
+    int size() const
+    {
+      return int(m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire));
+    }
+    int space() const { return capacity() - size(); }
+
+    /** Producer side.  Copies up to n items, and returns how many were written */
+    int write(const T* src, int n)
+    {
+      unsigned head = m_Head.load(std::memory_order_relaxed);
+      unsigned tail = m_Tail.load(std::memory_order_acquire);
+      n = Min(n, capacity() - int(head - tail));
+      unsigned pos = head & m_Mask;
+      int first = Min(n, capacity() - int(pos));
+      std::copy(src, src + first, &m_Data[pos]);
+      std::copy(src + first, src + n, &m_Data[0]);
+      m_Head.store(head + unsigned(n), std::memory_order_release);
+      return n;
+    }
+
+    /** Consumer side.  Moves up to n items out, and returns how many were read.
+        Items are moved, so that the ring does not hold on to shared resources. */
+    int read(T* dst, int n)
+    {
+      unsigned tail = m_Tail.load(std::memory_order_relaxed);
+      unsigned head = m_Head.load(std::memory_order_acquire);
+      n = Min(n, int(head - tail));
+      unsigned pos = tail & m_Mask;
+      int first = Min(n, capacity() - int(pos));
+      std::move(&m_Data[pos], &m_Data[pos] + first, dst);
+      std::move(&m_Data[0], &m_Data[0] + (n - first), dst + first);
+      m_Tail.store(tail + unsigned(n), std::memory_order_release);
+      return n;
+    }
+
+    /** Empties the ring.  Only valid while neither side is active */
+    void reset()
+    {
+      m_Head.store(0, std::memory_order_relaxed);
+      m_Tail.store(0, std::memory_order_relaxed);
+    }
+  private:
+    SpscRing(const SpscRing&) {}
+    SpscRing& operator= (const SpscRing&) { return *this; }
+
+    std::vector<T>        m_Data;
+    unsigned              m_Mask;
+    // Free running indices, kept on separate cache lines
+    std::atomic<unsigned> m_Head;   // Written by the producer
+    char                  m_Pad[64];
+    std::atomic<unsigned> m_Tail;   // Written by the consumer
+  };
+
+} // namespace SDLPP
+
+#endif // sdlpp_thread_h__
@@ -9,6 +9,11 @@ namespace SDLPP
   function get_function(const char* module, const char* name);
   void display_message(const xstring& msg);
 
+  /** Map an entire file read-only into memory.
+      Returns the base address and sets size, or NULL on failure. */
+  const char* map_file(const char* filename, size_t& size);
+  void unmap_file(const char* data, size_t size);
+
 } // namespace SDLPP
 
 
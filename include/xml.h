@@ -5,27 +5,106 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
-#include <map>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <new>
 #include <xstring.h>
 
 namespace SDLPP {
 
+  /** Bump allocator holding a parsed tree: the source text, which names and
+      values point into, the child elements and their attribute arrays.
+      Nothing is released before the arena itself.
+      */
+  class xml_arena
+  {
+    enum { BLOCK_SIZE = 16384, ALIGNMENT = 16 };
+
+    std::vector<char*> m_Blocks;
+    size_t             m_Used;
+    size_t             m_Size;    ///  of the last block
+    std::vector<char>  m_Text;
+
+    xml_arena(const xml_arena&) {}
+    xml_arena& operator= (const xml_arena&) { return *this; }
+  public:
+    xml_arena() : m_Used(0), m_Size(0) {}
+    ~xml_arena()
+    {
+      for (size_t i = 0; i < m_Blocks.size(); ++i) delete[] m_Blocks[i];
+    }
+
+    void* allocate(size_t size)
+    {
+      size = (size + ALIGNMENT - 1) & ~size_t(ALIGNMENT - 1);
+      if (m_Blocks.empty() || m_Used + size > m_Size)
+      {
+        m_Size = (size > BLOCK_SIZE ? size : size_t(BLOCK_SIZE));
+        m_Blocks.push_back(new char[m_Size]);
+        m_Used = 0;
+      }
+      void* p = m_Blocks.back() + m_Used;
+      m_Used += size;
+      return p;
+    }
+
+    /** Copies n characters, and a terminating zero */
+    const char* store(const char* s, size_t n)
+    {
+      char* p = static_cast<char*>(allocate(n + 1));
+      memcpy(p, s, n);
+      p[n] = 0;
+      return p;
+    }
+
+    /** Source text of the tree, parsed in place */
+    std::vector<char>& text() { return m_Text; }
+  };
+
+  /** Zero terminated attribute name and value, owned by the element's arena */
+  struct xml_attr
+  {
+    const char* name;
+    const char* value;
+  };
+
   /** Main class for an XML node / element
       Each element provides access to:
       * Attributes via get/set methods
       * Children elements in a tree structures via add/remove/iterators
+      Children created by the parser or by add_child(type) live in the root's
+      arena, so a child detached with remove(child, false) must not outlive it.
+      Attribute iterators point to xml_attr, with 'name' and 'value' as zero terminated
+      strings, in document order.  They used to be std::map iterators, sorted by name,
+      with 'first' and 'second'.  print() still writes attributes sorted by name.
       */
   class xml_element
   {
     typedef xml_element& reference;
     typedef xml_element* pointer;
     typedef std::vector<xml_element*> child_vec;
-    typedef std::map<xstring, xstring> attr_map;
 
     xstring    m_Type;       ///  <type attr="value" .... >content</type>
     child_vec  m_Children;
-    attr_map   m_Attributes;
+    xml_attr*  m_Attributes; ///  In order of appearance
+    int        m_AttrCount;
+    int        m_AttrCapacity;
     xstring    m_Content;    ///  not supported yet
+    xml_arena* m_Arena;      ///  Created on first use by heap elements
+    std::unique_ptr<xml_arena> m_OwnedArena;
+    bool       m_InArena;    ///  Destroyed, but not deleted, by the parent
+
+    friend class xml_parser;
+
+    static bool attr_less(const xml_attr* a, const xml_attr* b)
+    {
+      return strcmp(a->name, b->name) < 0;
+    }
+
+    explicit xml_element(xml_arena* arena)
+      : m_Attributes(0), m_AttrCount(0), m_AttrCapacity(0), m_Arena(arena), m_InArena(true) {}
 
     /** Copying disabled to avoid hazardous shallow copies
       Deep copies not implemented by default copy constructor / assignment
@@ -34,11 +113,45 @@ namespace SDLPP {
       */
     xml_element(const xml_element&) {}
     xml_element& operator= (const xml_element&) { return *this; }
+
+    xml_arena& arena()
+    {
+      if (!m_Arena)
+      {
+        m_OwnedArena.reset(new xml_arena);
+        m_Arena = m_OwnedArena.get();
+      }
+      return *m_Arena;
+    }
+
+    xml_element* create_child()
+    {
+      xml_arena& a = arena();
+      xml_element* child = new (a.allocate(sizeof(xml_element))) xml_element(&a);
+      add_child(child);
+      return child;
+    }
+
+    static void destroy(pointer p)
+    {
+      if (p->m_InArena) p->~xml_element();
+      else delete p;
+    }
+
+    void reserve_attributes(int n)
+    {
+      if (n <= m_AttrCapacity) return;
+      xml_attr* attrs = static_cast<xml_attr*>(arena().allocate(n * sizeof(xml_attr)));
+      if (m_AttrCount > 0) memcpy(attrs, m_Attributes, m_AttrCount * sizeof(xml_attr));
+      m_Attributes = attrs;
+      m_AttrCapacity = n;
+    }
   public:
-    xml_element(const xstring& type = "") : m_Type(type) {}
+    xml_element(const xstring& type = "")
+      : m_Type(type), m_Attributes(0), m_AttrCount(0), m_AttrCapacity(0), m_Arena(0), m_InArena(false) {}
     ~xml_element()
     {
-      for (iterator b = begin(); b != end(); ++b) delete *b;
+      for (iterator b = begin(); b != end(); ++b) destroy(*b);
     }
 
     void set_type(const xstring& type) { m_Type = type; }
@@ -49,8 +162,8 @@ namespace SDLPP {
 
     xml_element* add_child(const xstring& type)
     {
-      xml_element* child = new xml_element(type);
-      add_child(child);
+      xml_element* child = create_child();
+      child->set_type(type);
       return child;
     }
 
@@ -63,7 +176,7 @@ namespace SDLPP {
         xml_element* c = *it;
         if (c == child) { m_Children.erase(it); break; }
       }
-      if (delete_child) delete child;
+      if (delete_child) destroy(child);
     }
 
     /** Finds first child with the given type */
@@ -77,13 +190,34 @@ namespace SDLPP {
       return 0;
     }
 
-    bool has_attribute(const xstring& name) const { return m_Attributes.count(name) > 0; }
-    void set_attribute(const xstring& name, const xstring& value) { m_Attributes[name] = value; }
+    /** Returns the attribute's value, valid as long as the element, or 0 if missing.
+        Unlike get_attribute, nothing is copied. */
+    const char* find_attribute(const char* name) const
+    {
+      // Searched backwards, so that a repeated attribute keeps its last value
+      for (int i = m_AttrCount - 1; i >= 0; --i)
+        if (strcmp(m_Attributes[i].name, name) == 0) return m_Attributes[i].value;
+      return 0;
+    }
+
+    bool has_attribute(const xstring& name) const { return find_attribute(name.c_str()) != 0; }
+
+    void set_attribute(const xstring& name, const xstring& value)
+    {
+      xml_arena& a = arena();
+      const char* v = a.store(value.c_str(), value.length());
+      for (int i = m_AttrCount - 1; i >= 0; --i)
+        if (strcmp(m_Attributes[i].name, name.c_str()) == 0) { m_Attributes[i].value = v; return; }
+      if (m_AttrCount == m_AttrCapacity) reserve_attributes(m_AttrCapacity > 0 ? m_AttrCapacity * 2 : 4);
+      xml_attr attr = { a.store(name.c_str(), name.length()), v };
+      m_Attributes[m_AttrCount++] = attr;
+    }
+
     xstring get_attribute(const xstring& name) const
     {
-      attr_map::const_iterator it = m_Attributes.find(name);
-      if (it == m_Attributes.end()) return "";
-      return it->second;
+      const char* value = find_attribute(name.c_str());
+      if (!value) return "";
+      return value;
     }
 
     typedef child_vec::iterator iterator;
@@ -93,17 +227,25 @@ namespace SDLPP {
     const_iterator begin() const { return m_Children.begin(); }
     const_iterator end()   const { return m_Children.end(); }
 
-    typedef attr_map::const_iterator attr_iterator;
-    attr_iterator attr_begin() const { return m_Attributes.begin(); }
-    attr_iterator attr_end()   const { return m_Attributes.end(); }
+    /** In document order.  A repeated attribute appears each time, and the last one counts */
+    typedef const xml_attr* attr_iterator;
+    attr_iterator attr_begin() const { return m_Attributes; }
+    attr_iterator attr_end()   const { return m_Attributes + m_AttrCount; }
 
     void print(std::ostream& os = std::cout, int indent = 0, bool packed = false) const
     {
       xstring spaces = packed ? xstring("") : xstring(indent, ' ');
       xstring eol = packed ? xstring("") : xstring("\n");
       os << spaces << "<" << get_type();
-      for (attr_iterator it = attr_begin(); it != attr_end(); ++it)
-        os << " " << it->first << "=\"" << it->second << "\"";
+      // Sorted by name, and repeats written once with the last value, as before
+      std::vector<const xml_attr*> attrs;
+      for (attr_iterator it = attr_begin(); it != attr_end(); ++it) attrs.push_back(it);
+      std::stable_sort(attrs.begin(), attrs.end(), attr_less);
+      for (size_t i = 0; i < attrs.size(); ++i)
+      {
+        if (i + 1 < attrs.size() && strcmp(attrs[i]->name, attrs[i + 1]->name) == 0) continue;
+        os << " " << attrs[i]->name << "=\"" << attrs[i]->value << "\"";
+      }
       if (get_child_count() == 0 && m_Content.empty()) { os << "/>" << eol; return; }
       os << ">" << eol;
       if (!m_Content.empty()) os << spaces << m_Content << eol;
@@ -120,189 +262,192 @@ namespace SDLPP {
     }
   };
 
+  /** Parses in place: the text is kept by the returned root, and names and
+      values are terminated inside it instead of being copied.
+      Declarations, comments and text content are skipped.  Entities are not decoded.
+      */
   class xml_parser
   {
   public:
-    xml_parser() : m_InQuotes(false), m_LineNumber(1) {}
+    xml_parser() : m_Begin(0), m_Pos(0) {}
   private:
-    enum Token { LTAG, RTAG, EQ, QUOTES, SLASH, IDENT, TEXT, QUESTION, XEOF };
-
-    bool m_InQuotes;
-    int  m_LineNumber;
+    char*                 m_Begin;
+    char*                 m_Pos;
+    std::vector<xml_attr> m_Attrs;   ///  Attributes of the element being read
 
     static bool is_white_space(char c)
     {
-      return (c <= 32);
+      return c != 0 && (unsigned char)(c) <= 32;
+    }
+
+    static bool is_name_end(char c)
+    {
+      return c == 0 || is_white_space(c) || c == '/' || c == '>' || c == '=';
+    }
+
+    int line_number() const
+    {
+      return 1 + int(std::count(m_Begin, m_Pos, '\n'));
     }
 
-    static bool quotes_pred(char c)
+#define SYNTAX_ERROR throw "Syntax Error"
+
+    void skip_white_space()
     {
-      return c == '"';
+      while (is_white_space(*m_Pos)) ++m_Pos;
     }
 
-    static bool not_alnum(char c)
+    char* skip_name()
     {
-      return ((c<'A' || c>'Z') && (c<'a' || c>'z') && (c<'0' || c>'9') && c != '_');
+      char* start = m_Pos;
+      while (!is_name_end(*m_Pos)) ++m_Pos;
+      if (m_Pos == start) SYNTAX_ERROR;
+      return start;
     }
 
-    static bool is_question(char c)
+    void skip_past(const char* terminator)
     {
-      return (c == '?');
+      char* p = strstr(m_Pos, terminator);
+      if (!p) SYNTAX_ERROR;
+      m_Pos = p + strlen(terminator);
     }
 
-    Token analyze(std::istream& is, xstring& token_text)
+    /** Moves to the next '<' that opens or closes an element.
+        Returns false at the end of the text */
+    bool next_tag()
     {
-      char ch = ' ';
-      while (!is.eof() && is_white_space(ch))
+      while (true)
       {
-        ch = is.get();
-        if (ch == '\n') ++m_LineNumber;
+        while (*m_Pos && *m_Pos != '<') ++m_Pos;
+        if (!*m_Pos) return false;
+        if (m_Pos[1] == '?') skip_past("?>");
+        else if (strncmp(m_Pos, "<!--", 4) == 0) skip_past("-->");
+        else if (m_Pos[1] == '!') skip_past(">");
+        else return true;
       }
-      token_text = "";
-      if (is.eof()) return XEOF;
-      token_text = xstring(1, ch);
-      if (ch == '"')
+    }
+
+    // Only text behind m_Pos is ever overwritten, so the scanning ahead is not affected
+    void parse_attribute(xml_element* e)
+    {
+      xml_attr attr;
+      char* name = skip_name();
+      char* name_end = m_Pos;
+      skip_white_space();
+      if (*m_Pos != '=') SYNTAX_ERROR;
+      ++m_Pos;
+      *name_end = 0;
+      attr.name = name;
+      skip_white_space();
+      char quote = *m_Pos;
+      if (quote == '"' || quote == '\'')
       {
-        m_InQuotes = !m_InQuotes;
-        return QUOTES;
+        attr.value = ++m_Pos;
+        while (*m_Pos && *m_Pos != quote) ++m_Pos;
+        if (!*m_Pos) SYNTAX_ERROR;
+        *m_Pos++ = 0;
       }
-      if (m_InQuotes)
+      else // Old format, quotes optional
       {
-        token_text += read_until(is, quotes_pred);
-        return TEXT;
+        char* value = skip_name();
+        attr.value = e->arena().store(value, m_Pos - value);
       }
-      if (ch == '<') { return LTAG; }
-      if (ch == '>') { return RTAG; }
-      if (ch == '=') { return EQ; }
-      if (ch == '/') { return SLASH; }
-      if (ch == '?') { return QUESTION; }
-      token_text += read_until(is, not_alnum);
-      return IDENT;
+      m_Attrs.push_back(attr);
     }
 
-    template<class PRED>
-    xstring read_until(std::istream& is, PRED p)
+    void store_attributes(xml_element* e)
     {
-      xstring res;
-      while (!is.eof())
-      {
-        char ch = is.peek();
-        if (p(ch)) return res;
-        ch = is.get();
-        res += xstring(1, ch);
-      }
-      return res;
+      if (m_Attrs.empty()) return;
+      int n = int(m_Attrs.size());
+      e->reserve_attributes(n);
+      memcpy(e->m_Attributes, &m_Attrs[0], n * sizeof(xml_attr));
+      e->m_AttrCount = n;
+      m_Attrs.clear();
     }
 
-#define SYNTAX_ERROR throw "Syntax Error"
-#define EXPECT(t) { token=analyze(is,last); if (token!=t) SYNTAX_ERROR; }
-
-    void parse_element(std::istream& is, xml_element* parent)
+    /** Called after the '<' */
+    void parse_element(xml_element* e)
     {
-      xstring last;
-      Token  token;
+      char* name = skip_name();
+      e->m_Type.assign(name, m_Pos);
       while (true)
       {
-        token = analyze(is, last);
-        if (token == XEOF) return;
-        if (token == LTAG)
+        skip_white_space();
+        if (*m_Pos == '/')
+        {
+          if (m_Pos[1] != '>') SYNTAX_ERROR;
+          m_Pos += 2;
+          store_attributes(e);
+          return;
+        }
+        if (*m_Pos == '>')
         {
-          token = analyze(is, last);
-          if (token == QUESTION)
-          {
-            read_until(is, is_question);
-            EXPECT(QUESTION);
-            EXPECT(RTAG);
-            continue;
-          }
-          if (token == SLASH)
-          {
-            if (!parent) SYNTAX_ERROR;
-            EXPECT(IDENT);
-            if (last != parent->get_type()) SYNTAX_ERROR;
-            EXPECT(RTAG);
-            return;
-          }
-          else
-            if (token == IDENT)
-            {
-            xml_element* child = new xml_element;
-            child->set_type(last);
-            parent->add_child(child);
-            while (true)
-            {
-              token = analyze(is, last);
-              if (token == XEOF) return;
-              if (token == IDENT)  // Attribute
-              {
-                xstring attr_value, attr_name = last;
-                EXPECT(EQ);
-                token = analyze(is, last);
-                if (token == QUOTES)
-                {
-                  token = analyze(is, last);
-                  if (token == TEXT)
-                  {
-                    attr_value = last;
-                    EXPECT(QUOTES);
-                  }
-                  else
-                    if (token != QUOTES) SYNTAX_ERROR;
-                }
-                else // Old format, quotes optional
-                {
-                  attr_value = last;
-                }
-                child->set_attribute(attr_name, attr_value);
-              }
-              else
-                if (token == SLASH)
-                {
-                EXPECT(RTAG);
-                break;
-                }
-                else
-                  if (token == RTAG)
-                  {
-                parse_element(is, child);
-                break;
-                  }
-            }
-            }
+          ++m_Pos;
+          store_attributes(e);
+          break;
         }
+        if (*m_Pos == 0) SYNTAX_ERROR;
+        parse_attribute(e);
+      }
+      while (next_tag())
+      {
+        ++m_Pos;
+        if (*m_Pos == '/')
+        {
+          ++m_Pos;
+          name = skip_name();
+          if (e->m_Type.compare(0, e->m_Type.size(), name, m_Pos - name) != 0) SYNTAX_ERROR;
+          skip_white_space();
+          if (*m_Pos != '>') SYNTAX_ERROR;
+          ++m_Pos;
+          return;
+        }
+        parse_element(e->create_child());
       }
     }
 
   public:
 
-    xml_element* parse(std::istream& is)
+    /** Parses text in place.  Its contents are taken over by the returned root.
+        Names and values are terminated inside the buffer, so it must be writable:
+        read only data, such as a mapped file, has to be copied into it first. */
+    xml_element* parse(std::vector<char>& text)
     {
-      if (is.fail()) return 0;
       xml_element* root = new xml_element;
+      std::vector<char>& buffer = root->arena().text();
+      buffer.swap(text);
+      buffer.push_back(0);
+      m_Begin = m_Pos = &buffer[0];
       try
       {
-        parse_element(is, root);
-        int n = root->get_child_count();
-        if (n > 1) throw "Error: Multiple root nodes";
-        if (n == 0) throw "Error: No root node";
-        xml_element* new_root = *(root->begin());
-        root->remove(new_root, false);
-        delete root;
-        root = new_root;
+        if (!next_tag()) throw "Error: No root node";
+        if (m_Pos[1] == '/') SYNTAX_ERROR;
+        ++m_Pos;
+        parse_element(root);
+        if (next_tag()) throw "Error: Multiple root nodes";
       }
       catch (const char* msg)
       {
-        std::cerr << "Line " << m_LineNumber << " - " << msg << std::endl;
+        std::cerr << "Line " << line_number() << " - " << msg << std::endl;
         delete root; root = 0;
       }
       return root;
     }
+
+    xml_element* parse(std::istream& is)
+    {
+      if (is.fail()) return 0;
+      std::vector<char> text((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      return parse(text);
+    }
   };
 
+#undef SYNTAX_ERROR
+
   inline xml_element* load_xml_from_text(const xstring& text)
   {
-    std::istringstream is(text);
-    return xml_parser().parse(is);
+    std::vector<char> buffer(text.begin(), text.end());
+    return xml_parser().parse(buffer);
   }
 
   xstring read_contents_as_string(const xstring& name);
@@ -0,0 +1,231 @@
+/** Compares the collision masks against the previous implementation, which
+    used 32 bit words and scanned every row and bit, on the jungleboy sprites.
+    Every frame is tested against every frame, at a grid of offsets, with both
+    implementations.  The hits must be identical.
+
+    Run from src/apps/jungleboy, or pass sprite XML names as arguments.
+*/
+#include <sdlpp.h>
+
+using namespace SDLPP;
+
+namespace Old {
+
+class BitRow
+{
+  enum { BITS=8*sizeof(unsigned) };
+  typedef std::vector<unsigned> base_vec;
+  base_vec m_Data;
+  int      m_Size;
+
+  unsigned get_word(int i) const { if (i<0 || i>=int(m_Data.size())) return 0; return m_Data[i]; }
+  unsigned get_word_at(int offset) const
+  {
+    int w=offset/BITS;
+    int o=offset-(w*BITS);
+    unsigned word=(get_word(w)>>o);
+    if (o>0)
+    {
+      unsigned next=get_word(w+1);
+      next<<=(BITS-o);
+      word|=next;
+    }
+    return word;
+  }
+
+  int get_first_one(unsigned u) const
+  {
+    for(int i=0;i<BITS && u;++i,u>>=1)
+      if ((u&1)!=0) return i;
+    return 0;
+  }
+public:
+  BitRow(int size)
+    : m_Data((size+BITS-1)/BITS,0),
+      m_Size(size)
+  {}
+  void set(int i)
+  {
+    if (i<0 || i>=m_Size) return;
+    m_Data[i/BITS]|=(1u<<(i%BITS));
+  }
+
+  int test(const BitRow& br, int offset, int br_offset) const
+  {
+    if (offset<0) return br.test(*this,-offset,0);
+    int len=Min(m_Size-offset,br.m_Size-br_offset);
+    for(int i=0;i<len;i+=BITS)
+    {
+      unsigned w=get_word_at(i+offset);
+      unsigned brw=br.get_word_at(i+br_offset);
+      w&=brw;
+      if (w) return i+get_first_one(w);
+    }
+    return -1;
+  }
+};
+
+class CollisionModel2D
+{
+  typedef std::vector<BitRow>  Grid;
+  Grid   m_Grid;
+  iRect2 m_Rect;
+
+  const BitRow& get_row(int y) const
+  {
+    static const BitRow empty_row(64);
+    if (y<0 || y>=int(m_Grid.size())) return empty_row;
+    return m_Grid[y];
+  }
+public:
+  CollisionModel2D(Bitmap image)
+  {
+    m_Grid.resize(image.get_height(),BitRow(image.get_width()));
+    m_Rect=iRect2(0,0,image.get_width(),image.get_height());
+    Uint32 ck=image.get_colorkey();
+    for(int y=0;y<image.get_height();++y)
+    {
+      const Uint32* row=image.get_row(y);
+      for(int x=0;x<image.get_width();++x)
+        if (row[x]!=ck) m_Grid[y].set(x);
+    }
+  }
+
+  bool test(const CollisionModel2D& o, iVec2& offset) const
+  {
+    iRect2 orect=o.m_Rect;
+    orect+=offset;
+    iRect2 overlap=m_Rect.overlap(orect);
+    int h=overlap.get_height();
+    int oy=overlap.tl.y-offset.y;
+    for(int y=0;y<h;++y)
+    {
+      int hit=get_row(y+overlap.tl.y).test(o.get_row(oy+y),offset.x,0);
+      if (hit>=0)
+      {
+        offset=iVec2(offset.x+hit,offset.y+y);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+} // namespace Old
+
+struct Mask
+{
+  CollisionModel2D*     current;
+  Old::CollisionModel2D old;
+  iVec2                 size;
+};
+
+struct Probe
+{
+  int   a,b;
+  iVec2 offset;
+};
+
+double seconds_since(Uint64 start)
+{
+  return double(SDL_GetPerformanceCounter()-start)/double(SDL_GetPerformanceFrequency());
+}
+
+int main(int argc, char* argv[])
+{
+  const char* default_sprites[] = {
+    "rsc/boy.xml", "rsc/dragon.xml", "rsc/ogre.xml", "rsc/pickup.xml", "rsc/bgrass.xml",
+    "rsc/cloud1.xml", "rsc/cloud2.xml", "rsc/cloud3.xml",
+    "rsc/food/apple.xml", "rsc/food/bagel.xml", "rsc/food/banana.xml",
+    "rsc/food/berry.xml", "rsc/food/carrot.xml", "rsc/food/grapes.xml",
+    "rsc/food/orange.xml", "rsc/food/pear.xml", "rsc/food/tberry.xml"
+  };
+  str_vec names;
+  for(int i=1;i<argc;++i) names.push_back(argv[i]);
+  if (names.empty()) names.assign(default_sprites,default_sprites+sizeof(default_sprites)/sizeof(default_sprites[0]));
+
+  std::vector<Mask*> masks;
+  try
+  {
+    for(size_t i=0;i<names.size();++i)
+    {
+      Sprite& spr=sprite(names[i]);
+      for(int s=0;s<spr.get_sequences_count();++s)
+      {
+        for(int f=0;f<spr.get_sequence_frame_count(s);++f)
+        {
+          Bitmap bmp=spr.get_bitmap(s,f);
+          Mask* m=new Mask { &spr.get_col_model(s,f), Old::CollisionModel2D(bmp), bmp.get_size() };
+          masks.push_back(m);
+        }
+      }
+    }
+  } catch (const xstring& msg) {
+    std::cerr << msg << std::endl;
+    return 1;
+  }
+
+  // Offsets step over the whole range where the rectangles overlap
+  const int STEP=3;
+  std::vector<Probe> probes;
+  for(int a=0;a<int(masks.size());++a)
+  {
+    for(int b=0;b<int(masks.size());++b)
+    {
+      const iVec2& sa=masks[a]->size;
+      const iVec2& sb=masks[b]->size;
+      for(int y=1-sb.y;y<sa.y;y+=STEP)
+        for(int x=1-sb.x;x<sa.x;x+=STEP)
+        {
+          Probe p = { a, b, iVec2(x,y) };
+          probes.push_back(p);
+        }
+    }
+  }
+
+  int mismatches=0,hits=0;
+  for(size_t i=0;i<probes.size();++i)
+  {
+    const Probe& p=probes[i];
+    iVec2 o1=p.offset,o2=p.offset;
+    bool h1=masks[p.a]->current->test(*masks[p.b]->current,o1);
+    bool h2=masks[p.a]->old.test(masks[p.b]->old,o2);
+    if (h1) ++hits;
+    if (h1!=h2 || (h1 && o1!=o2)) ++mismatches;
+  }
+
+  const int REPEAT=20;
+  int sink=0;
+  Uint64 start=SDL_GetPerformanceCounter();
+  for(int r=0;r<REPEAT;++r)
+    for(size_t i=0;i<probes.size();++i)
+    {
+      iVec2 o=probes[i].offset;
+      sink+=masks[probes[i].a]->old.test(masks[probes[i].b]->old,o) ? 1 : 0;
+    }
+  double old_time=seconds_since(start);
+  start=SDL_GetPerformanceCounter();
+  for(int r=0;r<REPEAT;++r)
+    for(size_t i=0;i<probes.size();++i)
+    {
+      iVec2 o=probes[i].offset;
+      sink+=masks[probes[i].a]->current->test(*masks[probes[i].b]->current,o) ? 1 : 0;
+    }
+  double new_time=seconds_since(start);
+
+#if defined(__AVX2__)
+  const char* path="avx2";
+#elif defined(__SSE2__) || defined(_M_X64)
+  const char* path="sse2";
+#else
+  const char* path="scalar";
+#endif
+  double n=double(probes.size())*REPEAT;
+  std::cout << masks.size() << " frames, " << probes.size() << " offsets, " << hits << " hits\n";
+  std::cout << "old:     " << old_time*1e9/n << " ns/test\n";
+  std::cout << "current: " << new_time*1e9/n << " ns/test (" << path << ")\n";
+  std::cout << "speedup: " << old_time/new_time << "x\n";
+  std::cout << "mismatches: " << mismatches << "  (" << sink << ")\n";
+  for(size_t i=0;i<masks.size();++i) delete masks[i];
+  return mismatches==0 ? 0 : 1;
+}
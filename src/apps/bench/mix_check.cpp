@@ -0,0 +1,95 @@
+/** Checks that every mixing kernel the CPU supports produces exactly the same
+    output as the scalar reference, on random input with saturating values,
+    odd lengths and unaligned buffers.
+*/
+#include <sdlpp.h>
+
+using namespace SDLPP;
+
+namespace {
+
+  Uint32 g_Seed = 12345;
+
+  int random_int(int lo, int hi)
+  {
+    g_Seed = g_Seed * 1664525u + 1013904223u;
+    return lo + int((g_Seed >> 8) % Uint32(hi - lo + 1));
+  }
+
+  /** Mostly full range samples, with runs at the extremes */
+  short random_sample()
+  {
+    switch (random_int(0, 7))
+    {
+      case 0:  return short(-32768);
+      case 1:  return short(32767);
+      default: return short(random_int(-32768, 32767));
+    }
+  }
+
+  /** Sums of up to 40 voices, so that many saturate */
+  int random_sum()
+  {
+    return random_int(-40 * 32768, 40 * 32767);
+  }
+
+  float random_gain()
+  {
+    switch (random_int(0, 5))
+    {
+      case 0:  return 0.0f;
+      case 1:  return 1.0f;
+      case 2:  return 4.0f;
+      default: return float(random_int(0, 1 << 16)) / float(1 << 16);
+    }
+  }
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  const int MAX_LEN = 1037;
+  const int ROUNDS = 2000;
+  std::vector<const MixKernels*> kernels = get_supported_mix_kernels();
+  const MixKernels& ref = *kernels[0];
+  int failures = 0;
+  for (size_t k = 1; k < kernels.size(); ++k)
+  {
+    const MixKernels& test = *kernels[k];
+    int bad = 0;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+      // Odd lengths and offsets, so every kernel runs its tail loop on unaligned data
+      int n = random_int(0, MAX_LEN);
+      int offset = random_int(0, 7);
+      std::vector<short> src(n + offset);
+      std::vector<int>   acc(n + offset), acc_ref(n + offset);
+      std::vector<float> gain(n + offset);
+      std::vector<short> out(n + offset), out_ref(n + offset);
+      for (int i = 0; i < n + offset; ++i)
+      {
+        src[i] = random_sample();
+        acc[i] = acc_ref[i] = random_sum();
+        gain[i] = random_gain();
+      }
+
+      ref.accumulate(&acc_ref[offset], &src[offset], n);
+      test.accumulate(&acc[offset], &src[offset], n);
+      if (acc != acc_ref) ++bad;
+
+      ref.output(&out_ref[offset], &acc_ref[offset], n, 0);
+      test.output(&out[offset], &acc_ref[offset], n, 0);
+      if (out != out_ref) ++bad;
+
+      ref.output(&out_ref[offset], &acc_ref[offset], n, &gain[offset]);
+      test.output(&out[offset], &acc_ref[offset], n, &gain[offset]);
+      if (out != out_ref) ++bad;
+    }
+    std::cout << test.name << ": " << (bad == 0 ? "identical" : "DIFFERENT")
+              << " to " << ref.name << " (" << bad << " failures)" << std::endl;
+    if (bad) ++failures;
+  }
+  if (kernels.size() == 1)
+    std::cout << "Only the " << ref.name << " kernels are supported" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
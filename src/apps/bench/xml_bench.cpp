@@ -0,0 +1,105 @@
+/** Compares the in place XML parser against the previous, istream based one,
+    on the jungleboy XML files.  Both must produce the same trees,
+    apart from the order of attributes.
+    Times include building and deleting the trees.
+
+    Run from src/apps/jungleboy, or pass XML names as arguments.
+*/
+#include <sdlpp.h>
+#include "old_xml.h"
+
+using namespace SDLPP;
+
+/** The old parser keeps attributes sorted by name, and the new one in
+    document order, so attributes are compared as sets */
+bool same_tree(const xml_element* cur, const OldXml::xml_element* old)
+{
+  if (cur->get_type()!=old->get_type()) return false;
+  if (cur->get_child_count()!=old->get_child_count()) return false;
+  std::map<xstring,xstring> attrs;
+  for(xml_element::attr_iterator it=cur->attr_begin();it!=cur->attr_end();++it)
+    attrs[it->name]=it->value;
+  std::map<xstring,xstring> old_attrs(old->attr_begin(),old->attr_end());
+  if (attrs!=old_attrs) return false;
+  xml_element::const_iterator c=cur->begin();
+  OldXml::xml_element::const_iterator o=old->begin();
+  for(;c!=cur->end();++c,++o)
+    if (!same_tree(*c,*o)) return false;
+  return true;
+}
+
+double seconds_since(Uint64 start)
+{
+  return double(SDL_GetPerformanceCounter()-start)/double(SDL_GetPerformanceFrequency());
+}
+
+int main(int argc, char* argv[])
+{
+  const char* default_files[] = {
+    "config.xml",
+    "rsc/boy.xml", "rsc/dragon.xml", "rsc/ogre.xml", "rsc/pickup.xml", "rsc/bgrass.xml",
+    "rsc/cloud1.xml", "rsc/cloud2.xml", "rsc/cloud3.xml",
+    "rsc/food/apple.xml", "rsc/food/bagel.xml", "rsc/food/banana.xml",
+    "rsc/food/berry.xml", "rsc/food/carrot.xml", "rsc/food/grapes.xml",
+    "rsc/food/orange.xml", "rsc/food/pear.xml", "rsc/food/tberry.xml"
+  };
+  str_vec names;
+  for(int i=1;i<argc;++i) names.push_back(argv[i]);
+  if (names.empty()) names.assign(default_files,default_files+sizeof(default_files)/sizeof(default_files[0]));
+
+  std::vector<char_vec> texts;
+  str_vec old_texts;       // With the line ends the old parser expects, as load_xml did
+  size_t bytes=0;
+  for(size_t i=0;i<names.size();++i)
+  {
+    char_vec cv;
+    if (!read_contents(names[i],cv))
+    {
+      std::cerr << "Not found: " << names[i] << std::endl;
+      return 1;
+    }
+    bytes+=cv.size();
+    texts.push_back(cv);
+    xstring s(std::string(cv.begin(),cv.end()));
+    handle_xml_eol(s);
+    old_texts.push_back(s);
+  }
+
+  int mismatches=0;
+  for(size_t i=0;i<texts.size();++i)
+  {
+    char_vec cv(texts[i]);
+    xml_element* cur=xml_parser().parse(cv);
+    OldXml::xml_element* old=OldXml::load_xml_from_text(old_texts[i]);
+    if (!cur || !old || !same_tree(cur,old))
+    {
+      std::cerr << "Different trees: " << names[i] << std::endl;
+      ++mismatches;
+    }
+    delete cur;
+    delete old;
+  }
+
+  const int REPEAT=200;
+  Uint64 start=SDL_GetPerformanceCounter();
+  for(int r=0;r<REPEAT;++r)
+    for(size_t i=0;i<old_texts.size();++i)
+      delete OldXml::load_xml_from_text(old_texts[i]);
+  double old_time=seconds_since(start);
+  start=SDL_GetPerformanceCounter();
+  for(int r=0;r<REPEAT;++r)
+    for(size_t i=0;i<texts.size();++i)
+    {
+      // The parser takes the buffer over, as load_xml does
+      char_vec cv(texts[i]);
+      delete xml_parser().parse(cv);
+    }
+  double new_time=seconds_since(start);
+
+  std::cout << texts.size() << " files, " << bytes << " bytes\n";
+  std::cout << "old:     " << old_time*1e6/REPEAT << " us per pass\n";
+  std::cout << "current: " << new_time*1e6/REPEAT << " us per pass\n";
+  std::cout << "speedup: " << old_time/new_time << "x\n";
+  std::cout << "mismatches: " << mismatches << std::endl;
+  return mismatches==0 ? 0 : 1;
+}
@@ -29,9 +29,9 @@ class JungleBoy : public AnimatedSprite
 public:
   JungleBoy()
     : AnimatedSprite("rsc/boy.xml"),
-      m_EatSound(new SoundClip("rsc/eat2.wav")),
-      m_AaahhSound(new SoundClip("rsc/aaahh.wav")),
-      m_DeathSound(new SoundClip("rsc/death.wav")),
+      m_EatSound(sound_clip("rsc/eat2.wav")),
+      m_AaahhSound(sound_clip("rsc/aaahh.wav")),
+      m_DeathSound(sound_clip("rsc/death.wav")),
       m_LastRight(true),
       m_OnGround(0),
       m_Dying(false),
@@ -243,7 +243,7 @@ int main(int argc, char* argv[])
         print_food();
         boy.reset();
         boy.set_position(iVec2(10,360));
-        int last_ticks=SDL_GetTicks();
+        FrameTimer timer;
         g_next_screen=false;
         while (!g_next_screen)
         {
@@ -266,9 +266,7 @@ int main(int argc, char* argv[])
             continue;
           }
           if (!g_easy && irand(500-screen_number*2)==0) new Dragon;
-          int cur_ticks=SDL_GetTicks();
-          int dt=cur_ticks-last_ticks;
-          last_ticks=cur_ticks;
+          int dt=timer.calc_dt();
           poll();
           try {
             advance(dt);
@@ -23,12 +23,10 @@ ResourceFile* get_default_resource_file()
 
 int calculate_dt()
 {
-  static Uint32 last_tick=0;
-  Uint32 cur=SDL_GetTicks();
-  int dt=20;
-  if (last_tick!=0) dt=cur-last_tick;
-  last_tick=cur;
-  return dt;
+  static bool first=true;
+  static FrameTimer timer;   // Starts on the first call
+  if (first) { first=false; return 20; }
+  return timer.calc_dt();
 }
 
 
@@ -12,11 +12,13 @@ Sprite::~Sprite()
 
 Sprite::Sprite(const Sprite& rhs)
 : m_Sequences(rhs.m_Sequences)
+, m_Flags(rhs.m_Flags)
 {}
 
 Sprite& Sprite::operator= (const Sprite& rhs)
 {
   m_Sequences=rhs.m_Sequences;
+  m_Flags=rhs.m_Flags;
   return *this;
 }
 
@@ -71,6 +73,16 @@ Bitmap Sprite::get_bitmap(int seq, int frame)
   return sequence.frames[frame].get_bitmap();
 }
 
+void Sprite::set_bitmap(int seq, int frame, Bitmap bmp)
+{
+  if (seq<0 || seq>=int(m_Sequences.size())) 
+    THROW("Invalid sequence number");
+  Sequence& sequence=m_Sequences[seq];
+  if (frame<0 || frame>=int(sequence.frames.size()))
+    THROW("Invalid frame number");
+  sequence.frames[frame].set_bitmap(bmp);
+}
+
 CollisionModel2D& Sprite::get_col_model(int seq, int frame)
 {
   if (seq<0 || seq>=int(m_Sequences.size())) 
@@ -81,6 +93,16 @@ CollisionModel2D& Sprite::get_col_model(int seq, int frame)
   return sequence.frames[frame].get_col_model();
 }
 
+void Sprite::set_col_model(int seq, int frame, collision_model_ptr cm)
+{
+  if (seq<0 || seq>=int(m_Sequences.size())) 
+    THROW("Invalid sequence number");
+  Sequence& sequence=m_Sequences[seq];
+  if (frame<0 || frame>=int(sequence.frames.size()))
+    THROW("Invalid frame number");
+  sequence.frames[frame].set_col_model(cm);
+}
+
 int  Sprite::get_sequences_count() const
 {
   return m_Sequences.size();
@@ -148,11 +170,24 @@ int Sprite::advance_sequence(int seq, int& last_t, int dt, const dVec2& velocity
 
 bool SpriteLoader::load(const xstring& name, Sprite& s)
 {
-  //ResourceFile* rf = get_default_resource_file();
-  xml_element* root=load_xml(name);
+  CompiledSprite compiled;
+  if (compiled.load(name))
+  {
+    compiled.build(s);
+    return true;
+  }
+  std::unique_ptr<xml_element> root(load_xml(name));
   if (!root) THROW("Resource not found: " << name);
+  build(root.get(),s);
+  return true;
+}
+
+void SpriteLoader::build(xml_element* root, Sprite& s)
+{
   int ck=atoi(root->get_attribute("ColorKey").c_str());
   Uint32 color_key=Uint32(ck);
+  CollisionModelCache::request_vec masks;
+  std::vector<std::pair<int,int> > mask_frames;
   xml_element::iterator seq_b=root->begin(),seq_e=root->end();
   for(;seq_b!=seq_e;++seq_b)
   {
@@ -168,22 +203,31 @@ bool SpriteLoader::load(const xstring& name, Sprite& s)
       if (frame->get_type()!="Frame") continue;
       xstring image_name=frame->get_attribute("Image");
       xstring rect_str=frame->get_attribute("Rect");
-      Bitmap base_image=BitmapCache::instance()->load(image_name,color_key);
       Bitmap image;
+      if (TextureAtlas::instance()->find(image_name,rect_str,image)) {}
+      else
       if (!rect_str.empty())
       {
         iRect2 r=parse_rect(rect_str);
-        image = base_image.cut(r);
+        image = BitmapCache::instance()->load(image_name,color_key).cut(r);
       }
       else
-        image=base_image;
+        image=BitmapCache::instance()->load(image_name,color_key);
       //if (rf) image=Bitmap(*rf,image_name);
       //else image=Bitmap(image_name);
       //image.set_colorkey(color_key);
       int duration=atoi(frame->get_attribute("Duration").c_str());
-      s.add_animation_frame(seq_id,image,duration);
+      int frame_id=s.add_animation_frame(seq_id,image,duration);
+      CollisionModelCache::Request r;
+      r.key=TextureAtlas::frame_key(image_name,rect_str);
+      r.image=image;
+      masks.push_back(r);
+      mask_frames.push_back(std::make_pair(seq_id,frame_id));
     }
   }
+  CollisionModelCache::instance()->resolve(masks);
+  for(size_t i=0;i<masks.size();++i)
+    s.set_col_model(mask_frames[i].first,mask_frames[i].second,masks[i].model);
   xml_element::iterator flb=root->begin(),fle=root->end();
   for(;flb!=fle;++flb)
   {
@@ -193,17 +237,340 @@ bool SpriteLoader::load(const xstring& name, Sprite& s)
     xstring value=flag->get_attribute("Value");
     s.set_flag(name,value);
   }
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Compiled sprite layout.  All records are 8 byte multiples, in this order:
+//   Header
+//   SequenceRecord[sequence_count]
+//   FrameRecord[frame_count]        Sequences own consecutive frames
+//   FlagRecord[flag_count]
+//   MaskRecord[mask_count]
+//   Uint64[mask_words]              Collision mask rows, as BitRow words
+//   char[string_bytes]              Zero terminated strings.  Offset 0 is ""
+//
+//////////////////////////////////////////////////////////////////////////
+
+namespace {
+  const Uint32 SPRITE_MAGIC   = 0x42525053;  // "SPRB"
+  const Uint32 SPRITE_VERSION = 1;
+}
+
+struct CompiledSprite::Header
+{
+  Uint32 magic;
+  Uint32 version;
+  Uint32 color_key;
+  Uint32 sequence_count;
+  Uint32 frame_count;
+  Uint32 flag_count;
+  Uint32 mask_count;
+  Uint32 mask_words;
+  Uint32 string_bytes;
+  Uint32 reserved;
+};
+
+struct CompiledSprite::SequenceRecord
+{
+  double base_velocity;
+  Uint32 name;
+  Uint32 first_frame;
+  Uint32 frame_count;
+  Uint32 reserved;
+};
+
+struct CompiledSprite::FrameRecord
+{
+  Uint32 image;
+  Uint32 atlas_key;
+  Sint32 rect[4];     // tl.x, tl.y, br.x, br.y
+  Sint32 has_rect;
+  Sint32 duration;
+  Sint32 mask;        // -1 for none
+  Uint32 reserved;
+};
+
+struct CompiledSprite::FlagRecord
+{
+  Uint32 name;
+  Uint32 value;
+};
+
+struct CompiledSprite::MaskRecord
+{
+  Sint32 width;
+  Sint32 height;
+  Uint32 first_word;
+  Uint32 word_count;
+};
+
+CompiledSprite::CompiledSprite()
+: m_Header(0)
+, m_Sequences(0)
+, m_Frames(0)
+, m_Flags(0)
+, m_Masks(0)
+, m_MaskWords(0)
+, m_Strings(0)
+{}
+
+bool CompiledSprite::load(const xstring& name)
+{
+  xstring cname=compiled_name(name);
+  size_t size=0;
+  const char* mapped=get_contents_data(cname,size);
+  // Records are read in place, which needs 8 byte alignment
+  if (mapped && (size_t(mapped)&7)==0)
+  {
+    m_Buffer.clear();
+    return fix_up(mapped,size);
+  }
+  if (mapped) m_Buffer.assign(mapped,mapped+size);
+  else
+  if (!read_contents(cname,m_Buffer)) return false;
+  if (m_Buffer.empty()) return false;
+  return fix_up(&m_Buffer[0],m_Buffer.size());
+}
+
+bool CompiledSprite::fix_up(const char* data, size_t size)
+{
+  m_Header=0;
+  if (size<sizeof(Header)) return false;
+  const Header* h=reinterpret_cast<const Header*>(data);
+  if (h->magic!=SPRITE_MAGIC || h->version!=SPRITE_VERSION) return false;
+  size_t offset=sizeof(Header);
+  size_t sequences=offset;  offset+=h->sequence_count*sizeof(SequenceRecord);
+  size_t frames=offset;     offset+=h->frame_count*sizeof(FrameRecord);
+  size_t flags=offset;      offset+=h->flag_count*sizeof(FlagRecord);
+  size_t masks=offset;      offset+=h->mask_count*sizeof(MaskRecord);
+  size_t words=offset;      offset+=h->mask_words*sizeof(Uint64);
+  size_t strings=offset;    offset+=h->string_bytes;
+  if (offset!=size || h->string_bytes==0 || data[size-1]!=0) return false;
+  m_Sequences=reinterpret_cast<const SequenceRecord*>(data+sequences);
+  m_Frames=reinterpret_cast<const FrameRecord*>(data+frames);
+  m_Flags=reinterpret_cast<const FlagRecord*>(data+flags);
+  m_Masks=reinterpret_cast<const MaskRecord*>(data+masks);
+  m_MaskWords=reinterpret_cast<const Uint64*>(data+words);
+  m_Strings=data+strings;
+
+  // Every offset and index is checked once here, so build() can trust them
+  for(Uint32 i=0;i<h->sequence_count;++i)
+  {
+    const SequenceRecord& sr=m_Sequences[i];
+    if (sr.name>=h->string_bytes || sr.first_frame>h->frame_count || 
+        sr.frame_count>h->frame_count-sr.first_frame) return false;
+  }
+  for(Uint32 i=0;i<h->frame_count;++i)
+  {
+    const FrameRecord& fr=m_Frames[i];
+    if (fr.image>=h->string_bytes || fr.atlas_key>=h->string_bytes) return false;
+    if (fr.mask<-1 || fr.mask>=Sint32(h->mask_count)) return false;
+  }
+  for(Uint32 i=0;i<h->flag_count;++i)
+    if (m_Flags[i].name>=h->string_bytes || m_Flags[i].value>=h->string_bytes) return false;
+  for(Uint32 i=0;i<h->mask_count;++i)
+  {
+    const MaskRecord& mr=m_Masks[i];
+    if (mr.width<0 || mr.height<0) return false;
+    if (Uint64(mr.height)*((mr.width+63)/64)!=mr.word_count) return false;
+    if (mr.first_word>h->mask_words || mr.word_count>h->mask_words-mr.first_word) return false;
+  }
+  m_Header=h;
   return true;
 }
 
+Uint32 CompiledSprite::get_color_key() const
+{
+  return m_Header ? m_Header->color_key : 0;
+}
+
+void CompiledSprite::get_images(str_vec& images) const
+{
+  if (!m_Header) return;
+  std::set<Uint32> seen;
+  for(Uint32 i=0;i<m_Header->frame_count;++i)
+  {
+    Uint32 image=m_Frames[i].image;
+    if (seen.insert(image).second) images.push_back(get_string(image));
+  }
+}
+
+void CompiledSprite::build(Sprite& s) const
+{
+  if (!m_Header) THROW("Compiled sprite not loaded");
+  TextureAtlas* atlas=TextureAtlas::instance();
+  BitmapCache* bc=BitmapCache::instance();
+  CollisionModelCache* cmc=CollisionModelCache::instance();
+  for(Uint32 i=0;i<m_Header->sequence_count;++i)
+  {
+    const SequenceRecord& sr=m_Sequences[i];
+    int seq_id=s.add_animation_sequence(get_string(sr.name),sr.base_velocity);
+    for(Uint32 j=0;j<sr.frame_count;++j)
+    {
+      const FrameRecord& fr=m_Frames[sr.first_frame+j];
+      Bitmap image;
+      if (!atlas->find_key(get_string(fr.atlas_key),image))
+      {
+        image=bc->load(get_string(fr.image),m_Header->color_key);
+        if (fr.has_rect) image=image.cut(iRect2(fr.rect[0],fr.rect[1],fr.rect[2],fr.rect[3]));
+      }
+      int frame_id=s.add_animation_frame(seq_id,image,fr.duration);
+      if (fr.mask>=0)
+      {
+        xstring key=get_string(fr.atlas_key);
+        collision_model_ptr cm=cmc->find(key);
+        if (!cm)
+        {
+          const MaskRecord& mr=m_Masks[fr.mask];
+          cm.reset(new CollisionModel2D);
+          cm->assign(mr.width,mr.height,m_MaskWords+mr.first_word);
+          cmc->insert(key,cm);
+        }
+        s.set_col_model(seq_id,frame_id,cm);
+      }
+    }
+  }
+  for(Uint32 i=0;i<m_Header->flag_count;++i)
+    s.set_flag(get_string(m_Flags[i].name),get_string(m_Flags[i].value));
+}
+
+namespace {
+  /** Collects zero terminated strings, each stored once */
+  class StringTable
+  {
+    char_vec                m_Data;
+    std::map<xstring,Uint32> m_Offsets;
+  public:
+    StringTable() : m_Data(1,0) { m_Offsets[""]=0; }
+    Uint32 add(const xstring& s)
+    {
+      std::map<xstring,Uint32>::iterator it=m_Offsets.find(s);
+      if (it!=m_Offsets.end()) return it->second;
+      Uint32 offset=Uint32(m_Data.size());
+      m_Data.insert(m_Data.end(),s.begin(),s.end());
+      m_Data.push_back(0);
+      m_Offsets[s]=offset;
+      return offset;
+    }
+    /** Padded with zeros to a multiple of 8 bytes */
+    const char_vec& get_data()
+    {
+      while (m_Data.size()%8) m_Data.push_back(0);
+      return m_Data;
+    }
+  };
+
+  template<class T>
+  void append_records(char_vec& out, const std::vector<T>& records)
+  {
+    if (records.empty()) return;
+    const char* p=reinterpret_cast<const char*>(&records[0]);
+    out.insert(out.end(),p,p+records.size()*sizeof(T));
+  }
+}
+
+void CompiledSprite::compile(ResourceFileWriter& w, const xstring& name, ResourceCodec codec)
+{
+  std::unique_ptr<xml_element> root(load_xml(name));
+  if (!root) THROW("Resource not found: " << name);
+  StringTable strings;
+  std::vector<SequenceRecord> sequences;
+  std::vector<FrameRecord>    frames;
+  std::vector<FlagRecord>     flags;
+  std::vector<MaskRecord>     masks;
+  std::vector<Uint64>         words;
+  std::map<Uint32,Sint32>     mask_of_key;   // Frames cut from the same region share a mask
+  Header h;
+  memset(&h,0,sizeof(h));
+  h.magic=SPRITE_MAGIC;
+  h.version=SPRITE_VERSION;
+  h.color_key=Uint32(atoi(root->get_attribute("ColorKey").c_str()));
+  // Same traversal as SpriteLoader::build, so frame numbers match the atlas
+  for(xml_element::iterator sb=root->begin();sb!=root->end();++sb)
+  {
+    xml_element* sequence=*sb;
+    if (sequence->get_type()!="Sequence") continue;
+    SequenceRecord sr;
+    memset(&sr,0,sizeof(sr));
+    sr.base_velocity=atof(sequence->get_attribute("BaseVelocity").c_str());
+    sr.name=strings.add(sequence->get_attribute("Name"));
+    sr.first_frame=Uint32(frames.size());
+    for(xml_element::iterator fb=sequence->begin();fb!=sequence->end();++fb)
+    {
+      xml_element* frame=*fb;
+      if (frame->get_type()!="Frame") continue;
+      xstring image_name=frame->get_attribute("Image");
+      xstring rect_str=frame->get_attribute("Rect");
+      FrameRecord fr;
+      memset(&fr,0,sizeof(fr));
+      fr.image=strings.add(image_name);
+      fr.atlas_key=strings.add(TextureAtlas::frame_key(image_name,rect_str));
+      fr.duration=atoi(frame->get_attribute("Duration").c_str());
+      if (fr.duration<=0)
+        THROW("Invalid frame duration in " << name << ": " << fr.duration);
+      Bitmap image=BitmapCache::instance()->load(image_name,h.color_key);
+      if (!rect_str.empty())
+      {
+        iRect2 r=parse_rect(rect_str);
+        fr.has_rect=1;
+        fr.rect[0]=r.tl.x; fr.rect[1]=r.tl.y;
+        fr.rect[2]=r.br.x; fr.rect[3]=r.br.y;
+        image=image.cut(r);
+      }
+      std::map<Uint32,Sint32>::iterator mi=mask_of_key.find(fr.atlas_key);
+      if (mi!=mask_of_key.end()) fr.mask=mi->second;
+      else
+      {
+        CollisionModel2D cm(image);
+        MaskRecord mr;
+        mr.width=cm.get_width();
+        mr.height=cm.get_height();
+        mr.first_word=Uint32(words.size());
+        cm.get_words(words);
+        mr.word_count=Uint32(words.size())-mr.first_word;
+        fr.mask=Sint32(masks.size());
+        mask_of_key[fr.atlas_key]=fr.mask;
+        masks.push_back(mr);
+      }
+      frames.push_back(fr);
+    }
+    sr.frame_count=Uint32(frames.size())-sr.first_frame;
+    sequences.push_back(sr);
+  }
+  for(xml_element::iterator it=root->begin();it!=root->end();++it)
+  {
+    xml_element* flag=*it;
+    if (flag->get_type()!="Flag") continue;
+    FlagRecord fr = { strings.add(flag->get_attribute("Name")), strings.add(flag->get_attribute("Value")) };
+    flags.push_back(fr);
+  }
+  const char_vec& string_data=strings.get_data();
+  h.sequence_count=Uint32(sequences.size());
+  h.frame_count=Uint32(frames.size());
+  h.flag_count=Uint32(flags.size());
+  h.mask_count=Uint32(masks.size());
+  h.mask_words=Uint32(words.size());
+  h.string_bytes=Uint32(string_data.size());
+  char_vec out(reinterpret_cast<const char*>(&h),reinterpret_cast<const char*>(&h+1));
+  append_records(out,sequences);
+  append_records(out,frames);
+  append_records(out,flags);
+  append_records(out,masks);
+  append_records(out,words);
+  append_records(out,string_data);
+  w.add_resource(compiled_name(name).c_str(),&out[0],int(out.size()),codec);
+}
 
 
 AnimatedSprite::AnimatedSprite(Sprite& spr) 
   : m_Sprite(spr),
     m_ActiveSequence(0),
+    m_DT(0),
     m_CurrentFrame(-1),
     m_Volatile(false),
-    m_DT(0)
+    m_ThreadSafe(false)
 {
   init();
 }
@@ -211,9 +578,10 @@ AnimatedSprite::AnimatedSprite(Sprite& spr)
 AnimatedSprite::AnimatedSprite(const xstring& spr_xml)
   : m_Sprite(sprite(spr_xml)),
     m_ActiveSequence(0),
+    m_DT(0),
     m_CurrentFrame(-1),
     m_Volatile(false),
-    m_DT(0)
+    m_ThreadSafe(false)
 {
   init();
 }
@@ -247,6 +615,12 @@ void AnimatedSprite::set_active_sequence(int seq)
 {
   if (m_ActiveSequence!=seq) m_CurrentFrame=-1;
   m_ActiveSequence=seq; 
+  // Static sprites are not advanced every step, so their frame is set here
+  if (m_CurrentFrame<0 && is_static_sprite() && seq>=0 && seq<get_sequences_count())
+  {
+    m_CurrentFrame=m_Sprite.advance_sequence(m_ActiveSequence,m_DT,0,get_velocity());
+    m_CurrentImage=m_Sprite.get_bitmap(m_ActiveSequence,m_CurrentFrame);
+  }
 }
 
 int  AnimatedSprite::get_sequence_frame_count(int seq) const
@@ -288,7 +662,8 @@ void AnimatedSprite::render(GameView& gv)
 {
   const iRect2& view=gv.get_2D_view();
   iRect2 src=m_CurrentImage.get_rect();
-  iVec2 p=get_position();
+  dVec2 ip=get_interpolated_position(gv.get_interpolation());
+  iVec2 p(int(ip.x),int(ip.y));
   p-=gv.get_2D_offset();
   iVec2 half_size=src.get_size();
   //half_size.x/=2; half_size.y/=2;
@@ -313,67 +688,222 @@ iRect2 AnimatedSprite::get_rect() const
   return iRect2(tl,br);
 }
 
-inline bool y_pred(const RigidBody2D* a, const RigidBody2D* b)
+void AnimationManager::set_broadphase(broadphase_ptr bp)
 {
-  iRect2 ra=a->get_rect();
-  iRect2 rb=b->get_rect();
-  return ra.tl.y<rb.tl.y;
+  const Broadphase::body_vec& st=m_Broadphase->get_static();
+  for(Broadphase::body_vec::const_iterator it=st.begin();it!=st.end();++it)
+    bp->add(*it,true);
+  const Broadphase::body_vec& dyn=m_Broadphase->get_dynamic();
+  for(Broadphase::body_vec::const_iterator it=dyn.begin();it!=dyn.end();++it)
+    bp->add(*it,false);
+  m_Broadphase=bp;
 }
 
 void AnimationManager::check_for_collisions(int dt)
 {
-  m_CollidableObjects.sort(y_pred);
-  iterator it,b=m_CollidableObjects.begin(),e=m_CollidableObjects.end();
+  const int CONTACT_GRAIN=32;
+  m_Broadphase->find_pairs(m_Pairs);
+  m_Contacts.resize(m_Pairs.size());
+  int n=0;
+  Broadphase::pair_vec::iterator b=m_Pairs.begin(),e=m_Pairs.end();
   for(;b!=e;++b)
   {
-    RigidBody2D* o1=*b;
-    int bottom_y=o1->get_rect().br.y;
-    for(it=b;++it!=e;)
+    if (b->first->prepare_contact(b->second,m_Contacts[n])) ++n;
+  }
+  // All the tests see the bodies as they were before any response
+  contact_vec& contacts=m_Contacts;
+  if (m_Jobs)
+  {
+    m_Jobs->parallel_for(0,n,CONTACT_GRAIN,[&contacts](int b, int e) 
     {
-      RigidBody2D* o2=*it;
-      if (o2->get_rect().tl.y>=bottom_y) break;
-      o1->interact(o2,dt);
-    }
+      for(int i=b;i<e;++i)
+        RigidBody2D::test_contact(contacts[i]);
+    });
+  }
+  else
+  {
+    for(int i=0;i<n;++i)
+      RigidBody2D::test_contact(contacts[i]);
   }
+  // In pair order, whatever the thread count
+  for(int i=0;i<n;++i)
+    RigidBody2D::respond(contacts[i]);
+}
+
+void AnimationManager::join(RigidBody2D* obj, bool is_static)
+{
+  if (m_BatchKinematics && !is_static) obj->attach_kinematics(&m_Kinematics);
+  if (obj->is_collidable()) m_Broadphase->add(obj,is_static);
+}
+
+void AnimationManager::join_pending()
+{
+  for(size_t i=0;i<m_Joining.size();++i)
+  {
+    // Objects removed in the step they were added never join
+    Entry* e=m_Objects.get(m_Joining[i]);
+    if (e) join(e->obj,e->is_static);
+  }
+  m_Joining.clear();
+}
+
+void AnimationManager::remove_animation_object(SlotHandle h)
+{
+  Entry* e=m_Objects.get(h);
+  if (!e) return;
+  m_Removed.push_back(e->obj);
+  m_Objects.erase(h);
+  if (!m_InStep) flush_removed();
+}
+
+void AnimationManager::flush_removed()
+{
+  if (m_Removed.empty()) return;
+  m_Broadphase->remove(m_Removed);
+  for(size_t i=0;i<m_Removed.size();++i)
+  {
+    RigidBody2D* obj=m_Removed[i];
+    if (obj->get_kinematics()==&m_Kinematics) obj->detach_kinematics();
+    if (obj->is_volatile()) delete obj;
+  }
+  m_Removed.clear();
+  m_Objects.compact();
 }
 
 void AnimationManager::clear()
 {
-  obj_list::iterator b=m_Objects.begin(),e=m_Objects.end();
-  for(;b!=e;++b)
+  for(int i=0;i<m_Objects.size();++i)
   {
-    GameObject* obj=*b;
+    if (m_Objects.is_erased(i)) continue;
+    RigidBody2D* obj=m_Objects[i].obj;
+    if (obj->get_kinematics()==&m_Kinematics) obj->detach_kinematics();
     if (obj->is_volatile()) delete obj;
   }
+  m_Removed.clear();
   m_Objects.clear();
-  m_CollidableObjects.clear();
+  m_Joining.clear();
+  m_Broadphase->clear();
   m_Scene=false;
+  m_Accumulator=0;
 }
 
-bool AnimationManager::advance(int DT)
+void AnimationManager::set_fixed_step(int step_ms, int max_steps)
 {
-  int dt=Min(100,DT);
-  for(int i=0;i<DT;i+=dt)
+  m_FixedStep=Max(0,step_ms);
+  m_MaxSteps=Max(1,max_steps);
+  m_Accumulator=0;
+  // Nothing is drawn between steps until the next one saves them
+  for(int i=0;i<m_Objects.size();++i)
   {
-    dt=Min(dt,(DT-i));
-    obj_list::iterator b=m_Objects.begin(),e=m_Objects.end();
-    while(b!=e)
+    if (!m_Objects.is_erased(i)) m_Objects[i].obj->save_previous_position();
+  }
+}
+
+bool AnimationManager::advance_time(double ms)
+{
+  m_Accumulator+=Max(0.0,ms);
+  if (m_FixedStep==0)
+  {
+    int DT=int(m_Accumulator);
+    m_Accumulator-=DT;
+    int dt=Min(100,DT);
+    for(int i=0;i<DT;i+=dt)
     {
-      GameObject* obj=*b;
-      if (!obj->advance(dt)) 
-      {
-        if (obj->is_volatile()) delete obj;
-        obj_list::iterator ci=std::find(m_CollidableObjects.begin(),m_CollidableObjects.end(),obj);
-        if (ci!=m_CollidableObjects.end()) m_CollidableObjects.erase(ci);
-        b=m_Objects.erase(b);
-      }
-      else ++b;
+      dt=Min(dt,(DT-i));
+      step(dt);
+    }
+    return true;
+  }
+  int steps=0;
+  for(;m_Accumulator>=m_FixedStep && steps<m_MaxSteps;++steps)
+  {
+    for(int i=0;i<m_Objects.size();++i)
+    {
+      if (!m_Objects.is_erased(i)) m_Objects[i].obj->save_previous_position();
     }
-    check_for_collisions(dt);
+    step(m_FixedStep);
+    m_Accumulator-=m_FixedStep;
+  }
+  if (m_Accumulator>=m_FixedStep)
+  {
+    int dropped=int(m_Accumulator/m_FixedStep);
+    m_DroppedSteps+=dropped;
+    m_Accumulator-=double(dropped)*m_FixedStep;
   }
   return true;
 }
 
+void AnimationManager::advance_parallel(int dt, int n)
+{
+  const int INTEGRATE_GRAIN=4096;
+  const int ADVANCE_GRAIN=64;
+  KinematicsStore& store=m_Kinematics;
+  m_Jobs->parallel_for(0,store.get_slot_count(),INTEGRATE_GRAIN,
+                       [&store,dt](int b, int e) { store.integrate(dt,b,e); });
+  m_Parallel.clear();
+  for(int j=0;j<n;++j)
+  {
+    if (m_Objects.is_erased(j)) continue;
+    Entry& e=m_Objects[j];
+    if (e.is_static && e.advanced) continue;
+    if (!e.obj->is_thread_safe()) continue;
+    e.advanced=true;
+    m_Parallel.push_back(j);
+  }
+  m_Alive.resize(m_Parallel.size());
+  SlotMap<Entry>& objects=m_Objects;
+  const int_vec& parallel=m_Parallel;
+  std::vector<char>& alive=m_Alive;
+  m_Jobs->parallel_for(0,int(parallel.size()),ADVANCE_GRAIN,
+    [&objects,&parallel,&alive,dt](int b, int e) 
+    {
+      for(int k=b;k<e;++k)
+        alive[k]=objects[parallel[k]].obj->advance(dt) ? 1 : 0;
+    });
+}
+
+void AnimationManager::step(int dt)
+{
+  m_InStep=true;
+  // Objects added meanwhile are appended past n, and nothing moves until
+  // flush_removed(), so positions stay valid through the loop
+  int n=m_Objects.size();
+  if (m_Jobs) advance_parallel(dt,n);
+  else
+  {
+    m_Kinematics.integrate(dt);
+    m_Parallel.clear();
+  }
+  size_t next_parallel=0;
+  for(int j=0;j<n;++j)
+  {
+    // Skip parallel results of objects removed since, by serial objects
+    while (next_parallel<m_Parallel.size() && m_Parallel[next_parallel]<j) ++next_parallel;
+    bool was_parallel=(next_parallel<m_Parallel.size() && m_Parallel[next_parallel]==j);
+    if (m_Objects.is_erased(j)) continue;
+    Entry& e=m_Objects[j];
+    RigidBody2D* obj=e.obj;
+    bool alive;
+    if (was_parallel)
+      alive=(m_Alive[next_parallel++]!=0);
+    else
+    {
+      // New static objects get a single step, to pick their image
+      if (e.is_static && e.advanced) continue;
+      e.advanced=true;
+      alive=obj->advance(dt);
+    }
+    // Unless it already removed itself, with remove_animation_object()
+    if (!alive && m_Objects.erase(m_Objects.get_handle(j)))
+      m_Removed.push_back(obj);
+  }
+  flush_removed();
+  check_for_collisions(dt);
+  m_InStep=false;
+  flush_removed();
+  join_pending();
+}
+
 void TileLayer::render(GameView& view)
 {
   iRect2 window=view.get_2D_view();
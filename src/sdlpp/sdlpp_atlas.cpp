@@ -0,0 +1,404 @@
+#include <sdlpp_atlas.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace SDLPP
+{
+
+  AtlasPacker::AtlasPacker(int width, int height)
+    : m_Width(width)
+    , m_Height(height)
+  {
+    Segment s = { 0, 0, width };
+    m_Skyline.push_back(s);
+  }
+
+  /** Returns the y at which a w x h rectangle would rest when its left edge
+      is on segment 'index', or -1 if it does not fit there */
+  int AtlasPacker::fit(int index, int w, int h) const
+  {
+    int x = m_Skyline[index].x;
+    if (x + w > m_Width) return -1;
+    int y = 0, width_left = w;
+    for (int i = index; width_left > 0; ++i)
+    {
+      if (i >= int(m_Skyline.size())) return -1;
+      y = Max(y, m_Skyline[i].y);
+      if (y + h > m_Height) return -1;
+      width_left -= m_Skyline[i].width;
+    }
+    return y;
+  }
+
+  bool AtlasPacker::insert(int w, int h, iVec2& pos)
+  {
+    int best = -1, best_bottom = INT_MAX, best_width = INT_MAX;
+    for (int i = 0; i < int(m_Skyline.size()); ++i)
+    {
+      int y = fit(i, w, h);
+      if (y < 0) continue;
+      int bottom = y + h;
+      if (bottom < best_bottom || (bottom == best_bottom && m_Skyline[i].width < best_width))
+      {
+        best = i;
+        best_bottom = bottom;
+        best_width = m_Skyline[i].width;
+        pos = iVec2(m_Skyline[i].x, y);
+      }
+    }
+    if (best < 0) return false;
+
+    Segment s = { pos.x, pos.y + h, w };
+    m_Skyline.insert(m_Skyline.begin() + best, s);
+    // Shrink or remove the segments now covered by the new one
+    for (int i = best + 1; i < int(m_Skyline.size());)
+    {
+      const Segment& prev = m_Skyline[i - 1];
+      Segment& cur = m_Skyline[i];
+      int overlap = prev.x + prev.width - cur.x;
+      if (overlap <= 0) break;
+      cur.x += overlap;
+      cur.width -= overlap;
+      if (cur.width > 0) break;
+      m_Skyline.erase(m_Skyline.begin() + i);
+    }
+    // Merge neighbors at the same height
+    for (int i = 1; i < int(m_Skyline.size());)
+    {
+      if (m_Skyline[i - 1].y == m_Skyline[i].y)
+      {
+        m_Skyline[i - 1].width += m_Skyline[i].width;
+        m_Skyline.erase(m_Skyline.begin() + i);
+      }
+      else ++i;
+    }
+    return true;
+  }
+
+  int AtlasPacker::get_used_height() const
+  {
+    int h = 0;
+    for (segment_vec::const_iterator it = m_Skyline.begin(); it != m_Skyline.end(); ++it)
+      h = Max(h, it->y);
+    return h;
+  }
+
+
+  TextureAtlas::TextureAtlas(int page_size, int padding)
+    : m_PageSize(page_size)
+    , m_Padding(padding)
+  {}
+
+  xstring TextureAtlas::frame_key(const xstring& image, const xstring& rect)
+  {
+    if (rect.empty()) return image;
+    std::ostringstream os;
+    os << image << '|' << parse_rect(rect);
+    return os.str();
+  }
+
+  bitmap_pixels_ptr TextureAtlas::create_page(int w, int h)
+  {
+    SDL_Surface* s = SDL_CreateRGBSurface(0, w, h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if (!s) THROW("Failed to create atlas page " << w << 'x' << h);
+    SDL_FillRect(s, 0, 0);
+    bitmap_pixels_ptr page(new BitmapPixels(s));
+    page->set_alpha_key();
+    return page;
+  }
+
+  void TextureAtlas::add_sprite(const xstring& name)
+  {
+    std::unique_ptr<xml_element> root(load_xml(name));
+    if (!root) THROW("Resource not found: " << name);
+    Uint32 color_key = Uint32(atoi(root->get_attribute("ColorKey").c_str()));
+    frame_vec& frames = m_Sprites[name];
+    frames.clear();
+    // Frames are numbered the same way SpriteLoader::build adds them
+    int seq_id = 0;
+    for (xml_element::iterator sb = root->begin(); sb != root->end(); ++sb)
+    {
+      xml_element* sequence = *sb;
+      if (sequence->get_type() != "Sequence") continue;
+      int frame_id = 0;
+      for (xml_element::iterator fb = sequence->begin(); fb != sequence->end(); ++fb)
+      {
+        xml_element* frame = *fb;
+        if (frame->get_type() != "Frame") continue;
+        xstring image = frame->get_attribute("Image");
+        xstring rect = frame->get_attribute("Rect");
+        SpriteFrame sf = { seq_id, frame_id++, frame_key(image, rect) };
+        frames.push_back(sf);
+        if (m_Entries.count(sf.key) > 0) continue;
+        Bitmap base = BitmapCache::instance()->load(image, color_key);
+        Entry e;
+        e.image = image;
+        e.source = rect.empty() ? base.get_rect() : parse_rect(rect);
+        e.page = -1;
+        m_Entries[sf.key] = e;
+      }
+      ++seq_id;
+    }
+  }
+
+  namespace {
+    struct PendingEntry
+    {
+      xstring key;
+      iVec2   size;
+      bool operator< (const PendingEntry& rhs) const
+      {
+        if (size.y != rhs.size.y) return size.y > rhs.size.y;
+        return size.x > rhs.size.x;
+      }
+    };
+
+    /** Source image converted to 32 bit ARGB, with transparent pixels set to 0 */
+    SDL_Surface* convert_source(SDL_Surface* src)
+    {
+      SDL_Surface* s = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_ARGB8888, 0);
+      if (!s) THROW("Failed to convert atlas source image");
+      Uint32 key = 0, key_rgb = 0;
+      bool has_key = (SDL_GetColorKey(src, &key) == 0);
+      if (has_key)
+      {
+        Uint8 r, g, b;
+        SDL_GetRGB(key, src->format, &r, &g, &b);
+        key_rgb = (Uint32(r) << 16) | (Uint32(g) << 8) | b;
+      }
+      bool has_alpha = (src->format->Amask != 0);
+      for (int y = 0; y < s->h; ++y)
+      {
+        Uint32* row = reinterpret_cast<Uint32*>(reinterpret_cast<Uint8*>(s->pixels) + y*s->pitch);
+        for (int x = 0; x < s->w; ++x)
+        {
+          Uint32 p = row[x];
+          if ((has_key && (p & 0x00FFFFFF) == key_rgb) || (has_alpha && (p >> 24) == 0))
+            row[x] = 0;
+          else
+          if (!has_alpha)
+            row[x] = p | 0xFF000000;
+        }
+      }
+      return s;
+    }
+
+    void copy_rect(SDL_Surface* src, const iRect2& r, SDL_Surface* dst, const iVec2& at)
+    {
+      int bytes = r.get_width() * 4;
+      for (int y = 0; y < r.get_height(); ++y)
+      {
+        const Uint8* from = reinterpret_cast<const Uint8*>(src->pixels) + (r.tl.y + y)*src->pitch + r.tl.x * 4;
+        Uint8* to = reinterpret_cast<Uint8*>(dst->pixels) + (at.y + y)*dst->pitch + at.x * 4;
+        memcpy(to, from, bytes);
+      }
+    }
+  }
+
+  void TextureAtlas::build()
+  {
+    std::vector<PendingEntry> pending;
+    for (entry_map::iterator it = m_Entries.begin(); it != m_Entries.end(); ++it)
+    {
+      if (it->second.page >= 0) continue;
+      PendingEntry p = { it->first, it->second.source.get_size() };
+      pending.push_back(p);
+    }
+    if (pending.empty()) return;
+    // Tallest first packs tighter with a skyline
+    std::sort(pending.begin(), pending.end());
+
+    // Pack.  Earlier pages are left as they are, new frames go into new pages.
+    std::vector<AtlasPacker> packers;
+    std::vector<iVec2>       page_sizes;
+    int first_page = int(m_Pages.size());
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+      Entry& e = m_Entries[pending[i].key];
+      int w = pending[i].size.x + m_Padding, h = pending[i].size.y + m_Padding;
+      iVec2 pos;
+      int page = -1;
+      for (size_t j = 0; j < packers.size() && page < 0; ++j)
+        if (packers[j].insert(w, h, pos)) page = int(j);
+      if (page < 0)
+      {
+        // Frames larger than a page get a page of their own
+        iVec2 size(Max(w, m_PageSize), Max(h, m_PageSize));
+        packers.push_back(AtlasPacker(size.x, size.y));
+        page_sizes.push_back(size);
+        page = int(packers.size()) - 1;
+        packers.back().insert(w, h, pos);
+      }
+      e.page = first_page + page;
+      e.region = iRect2(pos, pos + pending[i].size);
+    }
+
+    // Pages are trimmed to the height actually used
+    for (size_t j = 0; j < packers.size(); ++j)
+      m_Pages.push_back(create_page(page_sizes[j].x, packers[j].get_used_height()));
+
+    // Copy the pixels, converting each source image once
+    typedef std::map<BitmapPixels*, SDL_Surface*> surface_map;
+    surface_map converted;
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+      const Entry& e = m_Entries[pending[i].key];
+      Bitmap base = BitmapCache::instance()->get(e.image);
+      BitmapPixels* pixels = base.get_pixels().get();
+      SDL_Surface*& src = converted[pixels];
+      if (!src) src = convert_source(pixels->get_surface());
+      iRect2 r = e.source.translate(base.get_region().tl);
+      if (r.tl.x < 0 || r.tl.y < 0 || r.br.x > src->w || r.br.y > src->h)
+        THROW("Frame " << r << " is outside of " << e.image);
+      copy_rect(src, r, m_Pages[e.page]->get_surface(), e.region.tl);
+    }
+    for (surface_map::iterator it = converted.begin(); it != converted.end(); ++it)
+      SDL_FreeSurface(it->second);
+
+    rebind_sprites();
+  }
+
+  void TextureAtlas::rebind_sprites()
+  {
+    SpriteCache* cache = SpriteCache::instance();
+    for (sprite_map::iterator it = m_Sprites.begin(); it != m_Sprites.end(); ++it)
+    {
+      if (!cache->is_loaded(it->first)) continue;
+      Sprite& s = cache->get(it->first);
+      const frame_vec& frames = it->second;
+      for (frame_vec::const_iterator fi = frames.begin(); fi != frames.end(); ++fi)
+      {
+        Bitmap bmp;
+        if (find_key(fi->key, bmp)) s.set_bitmap(fi->sequence, fi->frame, bmp);
+      }
+    }
+  }
+
+  bool TextureAtlas::find_key(const xstring& key, Bitmap& bmp) const
+  {
+    entry_map::const_iterator it = m_Entries.find(key);
+    if (it == m_Entries.end() || it->second.page < 0) return false;
+    bmp = Bitmap(m_Pages[it->second.page], it->second.region);
+    return true;
+  }
+
+  bool TextureAtlas::find(const xstring& image, const xstring& rect, Bitmap& bmp) const
+  {
+    if (m_Entries.empty()) return false;
+    return find_key(frame_key(image, rect), bmp);
+  }
+
+  void TextureAtlas::save(ResourceFileWriter& w, const xstring& name, ResourceCodec codec)
+  {
+    xml_element root("Atlas");
+    for (int i = 0; i < get_page_count(); ++i)
+    {
+      SDL_Surface* s = m_Pages[i]->get_surface();
+      xstring page_name = name + "." + xstring(i);
+      // Page resources are the width and height, followed by tightly packed ARGB rows
+      std::vector<Uint32> data(2 + s->w*s->h);
+      data[0] = s->w;
+      data[1] = s->h;
+      for (int y = 0; y < s->h; ++y)
+        memcpy(&data[2 + y*s->w], reinterpret_cast<const Uint8*>(s->pixels) + y*s->pitch, s->w * 4);
+      w.add_resource(page_name.c_str(), reinterpret_cast<const char*>(&data[0]), int(data.size() * 4), codec);
+      xml_element* page = root.add_child("Page");
+      page->set_attribute("Name", page_name);
+    }
+    for (entry_map::const_iterator it = m_Entries.begin(); it != m_Entries.end(); ++it)
+    {
+      const Entry& e = it->second;
+      if (e.page < 0) continue;
+      xml_element* frame = root.add_child("Frame");
+      frame->set_attribute("Key", it->first);
+      frame->set_attribute("Page", xstring(e.page));
+      std::ostringstream os;
+      os << e.region;
+      frame->set_attribute("Region", os.str());
+    }
+    // The frames of each added sprite, so that load() can rebind cached sprites
+    for (sprite_map::const_iterator it = m_Sprites.begin(); it != m_Sprites.end(); ++it)
+    {
+      xml_element* spr = root.add_child("Sprite");
+      spr->set_attribute("Name", it->first);
+      for (frame_vec::const_iterator fi = it->second.begin(); fi != it->second.end(); ++fi)
+      {
+        xml_element* use = spr->add_child("Use");
+        use->set_attribute("Sequence", xstring(fi->sequence));
+        use->set_attribute("Frame", xstring(fi->frame));
+        use->set_attribute("Key", fi->key);
+      }
+    }
+    xstring text = root.print(false);
+    w.add_resource(name.c_str(), text.c_str(), int(text.length()));
+  }
+
+  bool TextureAtlas::load(const xstring& name)
+  {
+    std::unique_ptr<xml_element> root(load_xml(name));
+    if (!root) return false;
+    int first_page = int(m_Pages.size());
+    for (xml_element::iterator it = root->begin(); it != root->end(); ++it)
+    {
+      xml_element* el = *it;
+      if (el->get_type() == "Page")
+      {
+        xstring page_name = el->get_attribute("Name");
+        char_vec cv;
+        if (!read_contents(page_name, cv) || cv.size() < 8)
+          THROW("Atlas page not found: " << page_name);
+        const Uint32* data = reinterpret_cast<const Uint32*>(&cv[0]);
+        int w = int(data[0]), h = int(data[1]);
+        // Checked by division, so that a bad header cannot overflow w*h
+        if (w <= 0 || h <= 0 || size_t(h) > (cv.size() / 4 - 2) / size_t(w))
+          THROW("Invalid atlas page: " << page_name);
+        bitmap_pixels_ptr page = create_page(w, h);
+        SDL_Surface* s = page->get_surface();
+        for (int y = 0; y < h; ++y)
+          memcpy(reinterpret_cast<Uint8*>(s->pixels) + y*s->pitch, &data[2 + y*w], w * 4);
+        m_Pages.push_back(page);
+      }
+      else
+      if (el->get_type() == "Frame")
+      {
+        Entry e;
+        int page = atoi(el->get_attribute("Page").c_str());
+        e.page = first_page + page;
+        e.region = parse_rect(el->get_attribute("Region"));
+        if (page < 0 || e.page >= int(m_Pages.size()))
+          THROW("Atlas frame on missing page " << page << ": " << el->get_attribute("Key"));
+        SDL_Surface* s = m_Pages[e.page]->get_surface();
+        if (e.region.tl.x < 0 || e.region.tl.y < 0 || e.region.br.x > s->w || e.region.br.y > s->h ||
+            e.region.tl.x > e.region.br.x || e.region.tl.y > e.region.br.y)
+          THROW("Atlas frame " << e.region << " is outside of its page: " << el->get_attribute("Key"));
+        m_Entries[el->get_attribute("Key")] = e;
+      }
+      else
+      if (el->get_type() == "Sprite")
+      {
+        frame_vec& frames = m_Sprites[el->get_attribute("Name")];
+        frames.clear();
+        for (xml_element::iterator fb = el->begin(); fb != el->end(); ++fb)
+        {
+          xml_element* use = *fb;
+          if (use->get_type() != "Use") continue;
+          SpriteFrame sf = { atoi(use->get_attribute("Sequence").c_str()),
+                             atoi(use->get_attribute("Frame").c_str()),
+                             use->get_attribute("Key") };
+          frames.push_back(sf);
+        }
+      }
+    }
+    rebind_sprites();
+    return true;
+  }
+
+  void TextureAtlas::clear()
+  {
+    m_Pages.clear();
+    m_Entries.clear();
+    m_Sprites.clear();
+  }
+
+} // namespace SDLPP
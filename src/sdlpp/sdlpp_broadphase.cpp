@@ -0,0 +1,187 @@
+#include <sdlpp.h>
+#include <algorithm>
+
+namespace SDLPP {
+
+void Broadphase::add(RigidBody2D* body, bool is_static)
+{
+  if (is_static)
+  {
+    m_Static.push_back(body);
+    m_StaticDirty=true;
+  }
+  else
+    m_Dynamic.push_back(body);
+}
+
+void Broadphase::remove(RigidBody2D* body)
+{
+  body_vec::iterator it=std::find(m_Dynamic.begin(),m_Dynamic.end(),body);
+  if (it!=m_Dynamic.end()) { m_Dynamic.erase(it); return; }
+  it=std::find(m_Static.begin(),m_Static.end(),body);
+  if (it!=m_Static.end())
+  {
+    m_Static.erase(it);
+    m_StaticDirty=true;
+  }
+}
+
+void Broadphase::remove(const body_vec& bodies)
+{
+  if (bodies.empty()) return;
+  body_vec sorted(bodies);
+  std::sort(sorted.begin(),sorted.end());
+  auto removed=[&sorted](RigidBody2D* b) { return std::binary_search(sorted.begin(),sorted.end(),b); };
+  m_Dynamic.erase(std::remove_if(m_Dynamic.begin(),m_Dynamic.end(),removed),m_Dynamic.end());
+  size_t n=m_Static.size();
+  m_Static.erase(std::remove_if(m_Static.begin(),m_Static.end(),removed),m_Static.end());
+  if (m_Static.size()!=n) m_StaticDirty=true;
+}
+
+void Broadphase::clear()
+{
+  m_Static.clear();
+  m_StaticRects.clear();
+  m_Dynamic.clear();
+  m_StaticDirty=true;
+}
+
+void Broadphase::update_static()
+{
+  if (!m_StaticDirty) return;
+  m_StaticRects.resize(m_Static.size());
+  for(size_t i=0;i<m_Static.size();++i)
+    m_StaticRects[i]=m_Static[i]->get_rect();
+  index_static();
+  m_StaticDirty=false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void GridBroadphase::add_cells(const iRect2& r, int index, cell_vec& cells) const
+{
+  if (r.is_null()) return;
+  int x0=cell_coord(r.tl.x),x1=cell_coord(r.br.x-1);
+  int y0=cell_coord(r.tl.y),y1=cell_coord(r.br.y-1);
+  for(int y=y0;y<=y1;++y)
+  {
+    for(int x=x0;x<=x1;++x)
+    {
+      CellEntry ce = { (Uint64(Uint32(x))<<32) | Uint32(y), index };
+      cells.push_back(ce);
+    }
+  }
+}
+
+void GridBroadphase::index_static()
+{
+  m_StaticCells.clear();
+  for(int i=0;i<int(m_StaticRects.size());++i)
+    add_cells(m_StaticRects[i],i,m_StaticCells);
+  std::sort(m_StaticCells.begin(),m_StaticCells.end());
+}
+
+void GridBroadphase::find_pairs(pair_vec& pairs)
+{
+  pairs.clear();
+  update_static();
+  int n=int(m_Dynamic.size());
+  m_DynamicRects.resize(n);
+  m_DynamicCells.clear();
+  for(int i=0;i<n;++i)
+  {
+    m_DynamicRects[i]=m_Dynamic[i]->get_rect();
+    add_cells(m_DynamicRects[i],i,m_DynamicCells);
+  }
+  std::sort(m_DynamicCells.begin(),m_DynamicCells.end());
+
+  // A pair that shares several cells is reported only from the cell
+  // that holds the top left corner of the overlap.
+  cell_vec::const_iterator b=m_DynamicCells.begin(),e=m_DynamicCells.end();
+  while (b!=e)
+  {
+    cell_vec::const_iterator run_end=b;
+    while (run_end!=e && run_end->cell==b->cell) ++run_end;
+    Uint64 cell=b->cell;
+
+    for(cell_vec::const_iterator i=b;i!=run_end;++i)
+    {
+      const iRect2& ri=m_DynamicRects[i->index];
+      for(cell_vec::const_iterator j=i+1;j!=run_end;++j)
+      {
+        const iRect2& rj=m_DynamicRects[j->index];
+        if (!ri.overlapping(rj)) continue;
+        if (cell_key(Max(ri.tl.x,rj.tl.x),Max(ri.tl.y,rj.tl.y))!=cell) continue;
+        pairs.push_back(body_pair(m_Dynamic[i->index],m_Dynamic[j->index]));
+      }
+
+      CellEntry key = { cell, 0 };
+      cell_vec::const_iterator s=std::lower_bound(m_StaticCells.begin(),m_StaticCells.end(),key);
+      for(;s!=m_StaticCells.end() && s->cell==cell;++s)
+      {
+        const iRect2& rs=m_StaticRects[s->index];
+        if (!ri.overlapping(rs)) continue;
+        if (cell_key(Max(ri.tl.x,rs.tl.x),Max(ri.tl.y,rs.tl.y))!=cell) continue;
+        pairs.push_back(body_pair(m_Dynamic[i->index],m_Static[s->index]));
+      }
+    }
+    b=run_end;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void SweepAndPrune::index_static()
+{
+  m_StaticSorted.clear();
+  m_MaxStaticWidth=0;
+  for(size_t i=0;i<m_Static.size();++i)
+  {
+    if (m_StaticRects[i].is_null()) continue;
+    Entry e = { m_Static[i], m_StaticRects[i] };
+    m_StaticSorted.push_back(e);
+    m_MaxStaticWidth=Max(m_MaxStaticWidth,e.rect.get_width());
+  }
+  std::stable_sort(m_StaticSorted.begin(),m_StaticSorted.end());
+}
+
+void SweepAndPrune::find_pairs(pair_vec& pairs)
+{
+  pairs.clear();
+  update_static();
+  int n=int(m_Dynamic.size());
+  m_DynamicSorted.resize(n);
+  for(int i=0;i<n;++i)
+  {
+    Entry& cur=m_DynamicSorted[i];
+    cur.body=m_Dynamic[i];
+    cur.rect=cur.body->get_rect();
+    // Insertion sort, since the order from the previous query is kept
+    for(int j=i;j>0 && m_DynamicSorted[j]<m_DynamicSorted[j-1];--j)
+      std::swap(m_DynamicSorted[j],m_DynamicSorted[j-1]);
+  }
+  for(int i=0;i<n;++i)
+    m_Dynamic[i]=m_DynamicSorted[i].body;
+
+  Entry probe;
+  for(int i=0;i<n;++i)
+  {
+    const Entry& d=m_DynamicSorted[i];
+    if (d.rect.is_null()) continue;
+    for(int j=i+1;j<n && m_DynamicSorted[j].rect.tl.x<d.rect.br.x;++j)
+    {
+      const iRect2& r=m_DynamicSorted[j].rect;
+      if (r.is_valid() && d.rect.overlapping(r))
+        pairs.push_back(body_pair(d.body,m_DynamicSorted[j].body));
+    }
+    probe.rect.tl.x=d.rect.tl.x-m_MaxStaticWidth+1;
+    entry_vec::const_iterator s=std::lower_bound(m_StaticSorted.begin(),m_StaticSorted.end(),probe);
+    for(;s!=m_StaticSorted.end() && s->rect.tl.x<d.rect.br.x;++s)
+    {
+      if (d.rect.overlapping(s->rect))
+        pairs.push_back(body_pair(d.body,s->body));
+    }
+  }
+}
+
+} // namespace SDLPP
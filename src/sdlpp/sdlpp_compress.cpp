@@ -0,0 +1,142 @@
+#include <sdlpp_compress.h>
+
+namespace SDLPP
+{
+
+  static const int MIN_MATCH     = 4;
+  static const int LAST_LITERALS = 5;   // Last 5 bytes are always literals
+  static const int MF_LIMIT      = 12;  // Last match must start 12 bytes before end
+  static const int HASH_LOG      = 12;
+  static const int MAX_OFFSET    = 65535;
+
+  inline Uint32 read32(const Uint8* p)
+  {
+    Uint32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  inline Uint32 lz4_hash(Uint32 seq)
+  {
+    return (seq * 2654435761U) >> (32 - HASH_LOG);
+  }
+
+  inline Uint8* write_length(Uint8* op, int len)
+  {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = Uint8(len);
+    return op;
+  }
+
+  int lz4_compress_bound(int size)
+  {
+    return size + size / 255 + 16;
+  }
+
+  int lz4_compress(const char* src, int size, char* dst, int capacity)
+  {
+    const Uint8* base = reinterpret_cast<const Uint8*>(src);
+    const Uint8* end = base + size;
+    const Uint8* anchor = base;
+    Uint8* op = reinterpret_cast<Uint8*>(dst);
+    Uint8* oend = op + capacity;
+    if (size >= MF_LIMIT + 1)
+    {
+      int table[1 << HASH_LOG];
+      std::fill(table, table + (1 << HASH_LOG), -1);
+      const Uint8* ip = base;
+      const Uint8* mf_limit = end - MF_LIMIT;
+      const Uint8* match_limit = end - LAST_LITERALS;
+      while (ip < mf_limit)
+      {
+        Uint32 seq = read32(ip);
+        Uint32 h = lz4_hash(seq);
+        int ref = table[h];
+        table[h] = int(ip - base);
+        if (ref < 0 || (ip - base) - ref > MAX_OFFSET || read32(base + ref) != seq)
+        {
+          ++ip;
+          continue;
+        }
+        const Uint8* match = base + ref;
+        while (ip > anchor && match > base && ip[-1] == match[-1]) { --ip; --match; }
+        const Uint8* mp = ip + MIN_MATCH;
+        const Uint8* mr = match + MIN_MATCH;
+        while (mp < match_limit && *mp == *mr) { ++mp; ++mr; }
+        int lit = int(ip - anchor);
+        int mlen = int(mp - ip) - MIN_MATCH;
+        if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend) return 0;
+        Uint8* token = op++;
+        *token = Uint8((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15) op = write_length(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        int offset = int(ip - match);
+        *op++ = Uint8(offset & 255);
+        *op++ = Uint8(offset >> 8);
+        *token |= Uint8(mlen < 15 ? mlen : 15);
+        if (mlen >= 15) op = write_length(op, mlen - 15);
+        ip = mp;
+        anchor = ip;
+      }
+    }
+    int lit = int(end - anchor);
+    if (op + 1 + lit + lit / 255 + 1 > oend) return 0;
+    *op++ = Uint8((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = write_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return int(op - reinterpret_cast<Uint8*>(dst));
+  }
+
+  int lz4_decompress(const char* src, int size, char* dst, int capacity)
+  {
+    const Uint8* ip = reinterpret_cast<const Uint8*>(src);
+    const Uint8* iend = ip + size;
+    Uint8* base = reinterpret_cast<Uint8*>(dst);
+    Uint8* op = base;
+    Uint8* oend = op + capacity;
+    while (ip < iend)
+    {
+      unsigned token = *ip++;
+      size_t lit = token >> 4;
+      if (lit == 15)
+      {
+        unsigned b;
+        do
+        {
+          if (ip >= iend) return -1;
+          b = *ip++;
+          lit += b;
+        } while (b == 255);
+      }
+      if (lit > size_t(iend - ip) || lit > size_t(oend - op)) return -1;
+      memcpy(op, ip, lit);
+      op += lit;
+      ip += lit;
+      if (ip >= iend) break; // Last sequence has no match
+      if (iend - ip < 2) return -1;
+      size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+      ip += 2;
+      if (offset == 0 || offset > size_t(op - base)) return -1;
+      size_t mlen = token & 15;
+      if (mlen == 15)
+      {
+        unsigned b;
+        do
+        {
+          if (ip >= iend) return -1;
+          b = *ip++;
+          mlen += b;
+        } while (b == 255);
+      }
+      mlen += MIN_MATCH;
+      if (mlen > size_t(oend - op)) return -1;
+      const Uint8* match = op - offset;
+      for (size_t i = 0; i < mlen; ++i) op[i] = match[i]; // Overlapping copy
+      op += mlen;
+    }
+    return int(op - base);
+  }
+
+} // namespace SDLPP
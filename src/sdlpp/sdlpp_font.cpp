@@ -1,4 +1,5 @@
 #include <memory>
+#include <cstring>
 #include <sdlpp_common.h>
 #include <sdlpp_io.h>
 #include <sdlpp_font.h>
@@ -14,6 +15,9 @@ namespace SDLPP
     typedef TTF_Font* (*open_func)(SDL_RWops *src, int freesrc, int ptsize);
     typedef int(*size_func)(TTF_Font*, const char*, int*, int*);
     typedef SDL_Surface* (*draw_func)(TTF_Font*, const char*, SDL_Color);
+    typedef int(*height_func)(const TTF_Font*);
+    typedef int(*metrics_func)(TTF_Font*, Uint16, int*, int*, int*, int*, int*);
+    typedef int(*kerning_func)(TTF_Font*, Uint16, Uint16);
 
     init_func TTF_Init;
     quit_func TTF_Quit;
@@ -21,6 +25,10 @@ namespace SDLPP
     close_func TTF_CloseFont;
     size_func TTF_SizeUTF8;
     draw_func TTF_RenderUTF8_Solid;
+    draw_func TTF_RenderUTF8_Blended;
+    height_func TTF_FontHeight;
+    metrics_func TTF_GlyphMetrics;
+    kerning_func TTF_GetFontKerningSizeGlyphs;   // Optional, SDL_ttf 2.0.14 and up
 
     typedef std::map<xstring, Font> font_map;
     typedef font_map::iterator iterator;
@@ -84,12 +92,86 @@ namespace SDLPP
       return s;
     }
 
+    /** Renders a single glyph, in white, to a surface the height of the font */
+    SDL_Surface* draw_glyph(TTF_Font* font, Uint32 ch)
+    {
+      char text[8];
+      encode_utf8(ch, text);
+      SDL_Color c = { 255, 255, 255, 255 };
+      return TTF_RenderUTF8_Blended(font, text, c);
+    }
+
+    int get_advance(TTF_Font* font, Uint32 ch)
+    {
+      int minx, maxx, miny, maxy, advance;
+      if (ch <= 0xFFFF && TTF_GlyphMetrics(font, Uint16(ch), &minx, &maxx, &miny, &maxy, &advance) == 0)
+        return advance;
+      char text[8];
+      encode_utf8(ch, text);
+      int w = 0, h = 0;
+      TTF_SizeUTF8(font, text, &w, &h);
+      return w;
+    }
+
+    int get_kerning(TTF_Font* font, Uint32 prev, Uint32 ch)
+    {
+      if (!TTF_GetFontKerningSizeGlyphs || prev > 0xFFFF || ch > 0xFFFF) return 0;
+      return TTF_GetFontKerningSizeGlyphs(font, Uint16(prev), Uint16(ch));
+    }
+
+    int get_height(TTF_Font* font)
+    {
+      return TTF_FontHeight(font);
+    }
+
+    static void encode_utf8(Uint32 ch, char* text)
+    {
+      if (ch < 0x80) { *text++ = char(ch); }
+      else
+      if (ch < 0x800)
+      {
+        *text++ = char(0xC0 | (ch >> 6));
+        *text++ = char(0x80 | (ch & 0x3F));
+      }
+      else
+      if (ch < 0x10000)
+      {
+        *text++ = char(0xE0 | (ch >> 12));
+        *text++ = char(0x80 | ((ch >> 6) & 0x3F));
+        *text++ = char(0x80 | (ch & 0x3F));
+      }
+      else
+      {
+        *text++ = char(0xF0 | (ch >> 18));
+        *text++ = char(0x80 | ((ch >> 12) & 0x3F));
+        *text++ = char(0x80 | ((ch >> 6) & 0x3F));
+        *text++ = char(0x80 | (ch & 0x3F));
+      }
+      *text = 0;
+    }
+
+    static Uint32 decode_utf8(const char*& p, const char* end)
+    {
+      Uint8 c = Uint8(*p++);
+      int extra = (c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0);
+      Uint32 ch = (extra == 0 ? c : c & (0x3F >> extra));
+      for (; extra > 0 && p < end && (Uint8(*p) & 0xC0) == 0x80; --extra)
+        ch = (ch << 6) | (Uint8(*p++) & 0x3F);
+      return ch;
+    }
+
   private:
     bool load(Font& font, const xstring& name, int point_size)
     {
-      ResourceFile* rf = get_default_resource_file();
-      if (!read_contents(name, font.m_FontData)) return false;
-      font.m_RWops = SDL_RWFromConstMem(&font.m_FontData[0], font.m_FontData.size());
+      size_t size = 0;
+      const char* data = get_contents_data(name, size);
+      if (data)
+        font.m_RWops = SDL_RWFromConstMem(data, int(size));
+      else
+      {
+        if (!read_contents(name, font.m_FontData)) return false;
+        font.m_RWops = SDL_RWFromConstMem(&font.m_FontData[0], font.m_FontData.size());
+      }
       font.m_TTF_Font = TTF_OpenFontRW(font.m_RWops, 1, point_size);
       if (!font.m_TTF_Font) return false;
       return true;
@@ -105,7 +187,11 @@ namespace SDLPP
       FM_F(close_func, TTF_CloseFont);
       FM_F(size_func, TTF_SizeUTF8);
       FM_F(draw_func, TTF_RenderUTF8_Solid);
+      FM_F(draw_func, TTF_RenderUTF8_Blended);
+      FM_F(height_func, TTF_FontHeight);
+      FM_F(metrics_func, TTF_GlyphMetrics);
 #undef FM_F
+      TTF_GetFontKerningSizeGlyphs = (kerning_func)get_function("SDL2_ttf", "TTF_GetFontKerningSizeGlyphs");
       if (TTF_Init()<0)
         THROW("Failed to initialize SDL_ttf");
     }
@@ -145,13 +231,103 @@ namespace SDLPP
     return Bitmap(bitmap_pixels_ptr(new BitmapPixels(surface)));
   }
 
+  const Font::Glyph& Font::get_glyph(Uint32 ch)
+  {
+    glyph_map::iterator it = m_Glyphs.find(ch);
+    if (it != m_Glyphs.end()) return it->second;
+    FontManager* fm = FontManager::instance();
+    Glyph& g = m_Glyphs[ch];
+    g.page = -1;
+    g.advance = fm->get_advance(m_TTF_Font, ch);
+    SDL_Surface* rendered = fm->draw_glyph(m_TTF_Font, ch);
+    if (!rendered) return g;   // Nothing to draw, such as for a space
+    SDL_Surface* s = SDL_ConvertSurfaceFormat(rendered, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(rendered);
+    if (!s) return g;
+
+    iVec2 pos;
+    int page = -1;
+    for (int i = 0; i < int(m_Packers.size()) && page < 0; ++i)
+      if (m_Packers[i].insert(s->w + 1, s->h + 1, pos)) page = i;
+    if (page < 0)
+    {
+      int size = 256;
+      while (size < 2048 && size < Max(s->w, s->h) * 8) size *= 2;
+      size = Max(size, Max(s->w, s->h) + 1);
+      SDL_Surface* ps = SDL_CreateRGBSurface(0, size, size, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+      if (!ps) THROW("Failed to create glyph page " << size << 'x' << size);
+      SDL_FillRect(ps, 0, 0);
+      SDL_SetSurfaceBlendMode(ps, SDL_BLENDMODE_BLEND);
+      m_Pages.push_back(bitmap_pixels_ptr(new BitmapPixels(ps)));
+      m_Packers.push_back(AtlasPacker(size, size));
+      page = int(m_Pages.size()) - 1;
+      m_Packers.back().insert(s->w + 1, s->h + 1, pos);
+    }
+    SDL_Surface* ps = m_Pages[page]->get_surface();
+    for (int y = 0; y < s->h; ++y)
+      memcpy(reinterpret_cast<Uint8*>(ps->pixels) + (pos.y + y)*ps->pitch + pos.x * 4,
+             reinterpret_cast<const Uint8*>(s->pixels) + y*s->pitch, s->w * 4);
+    g.page = page;
+    g.rect = iRect2(pos, pos + iVec2(s->w, s->h));
+    SDL_FreeSurface(s);
+    m_Pages[page]->update_texture(g.rect);
+    return g;
+  }
+
+  const Font::Layout& Font::get_layout(const xstring& text)
+  {
+    layout_map::iterator it = m_LayoutIndex.find(text);
+    if (it != m_LayoutIndex.end())
+    {
+      m_Layouts.splice(m_Layouts.begin(), m_Layouts, it->second);
+      return *it->second;
+    }
+    if (int(m_Layouts.size()) >= MAX_LAYOUTS)
+    {
+      m_LayoutIndex.erase(m_Layouts.back().text);
+      m_Layouts.pop_back();
+    }
+    m_Layouts.push_front(Layout());
+    Layout& l = m_Layouts.front();
+    l.text = text;
+    FontManager* fm = FontManager::instance();
+    const char* p = text.c_str();
+    const char* end = p + text.length();
+    int x = 0;
+    Uint32 prev = 0;
+    while (p < end)
+    {
+      Uint32 ch = FontManager::decode_utf8(p, end);
+      if (prev) x += fm->get_kerning(m_TTF_Font, prev, ch);
+      const Glyph& g = get_glyph(ch);
+      if (g.page >= 0)
+      {
+        GlyphQuad q = { g.page, g.rect, iVec2(x, 0) };
+        l.quads.push_back(q);
+      }
+      x += g.advance;
+      prev = ch;
+    }
+    l.size = iVec2(x, fm->get_height(m_TTF_Font));
+    m_LayoutIndex[text] = m_Layouts.begin();
+    return l;
+  }
+
   iVec2   Font::draw(int x, int y, const xstring& text, Uint32 color, int align)
   {
-    Bitmap bmp = get_bitmap(text, color);
-    if (align > 0 && bmp.get_width() < align) x += (align - bmp.get_width());
-    if (align < 0 && bmp.get_width() < (-align)) x += (-align - bmp.get_width()) / 2;
-    bmp.draw(x, y);
-    return bmp.get_size();
+    const Layout& l = get_layout(text);
+    if (align > 0 && l.size.x < align) x += (align - l.size.x);
+    if (align < 0 && l.size.x < (-align)) x += (-align - l.size.x) / 2;
+    SDL_Color c = { Uint8(color >> 16), Uint8(color >> 8), Uint8(color), Uint8(color >> 24) };
+    if (c.a == 0) c.a = 255;   // Colors mapped for formats without alpha
+    Graphics* g = Graphics::instance();
+    iVec2 pos(x, y);
+    for (std::vector<GlyphQuad>::const_iterator it = l.quads.begin(); it != l.quads.end(); ++it)
+    {
+      iVec2 tl = pos + it->offset;
+      g->draw(m_Pages[it->page], it->src, iRect2(tl, tl + it->src.get_size()), c);
+    }
+    return l.size;
   }
 
 //   iVec2   Font::draw(Bitmap target, int x, int y, const xstring& text, Uint32 color, int align)
@@ -39,6 +39,11 @@ namespace SDLPP
 
   void Graphics::shutdown()
   {
+#if SDL_VERSION_ATLEAST(2,0,18)
+    m_BatchVertices.clear();
+    m_BatchIndices.clear();
+    m_BatchPixels.reset();
+#endif
   }
 
   iVec2 Graphics::position(float x, float y) const
@@ -47,9 +52,78 @@ namespace SDLPP
   }
 
 
+  void Graphics::draw(bitmap_pixels_ptr pixels, const iRect2& src, const iRect2& dst)
+  {
+    SDL_Color white = { 255, 255, 255, 255 };
+    draw(pixels, src, dst, white);
+  }
+
+  void Graphics::draw(bitmap_pixels_ptr pixels, const iRect2& src, const iRect2& dst, const SDL_Color& color)
+  {
+#if SDL_VERSION_ATLEAST(2,0,18)
+    if (m_Batching)
+    {
+      batch(pixels, src, dst, color);
+      return;
+    }
+#endif
+    bool tinted = (color.r & color.g & color.b & color.a) != 255;
+    SDL_Texture* texture = pixels->get_texture();
+    if (tinted)
+    {
+      SDL_SetTextureColorMod(texture, color.r, color.g, color.b);
+      SDL_SetTextureAlphaMod(texture, color.a);
+    }
+    draw(texture, src, dst);
+    if (tinted)
+    {
+      SDL_SetTextureColorMod(texture, 255, 255, 255);
+      SDL_SetTextureAlphaMod(texture, 255);
+    }
+  }
+
+#if SDL_VERSION_ATLEAST(2,0,18)
+  void Graphics::batch(bitmap_pixels_ptr pixels, const iRect2& src, const iRect2& dst, const SDL_Color& color)
+  {
+    if (pixels != m_BatchPixels)
+    {
+      flush();
+      m_BatchPixels = pixels;
+    }
+    iVec2 size = pixels->get_rect().get_size();
+    float sx = 1.0f / size.x, sy = 1.0f / size.y;
+    float u0 = src.tl.x*sx, v0 = src.tl.y*sy, u1 = src.br.x*sx, v1 = src.br.y*sy;
+    float x0 = float(dst.tl.x), y0 = float(dst.tl.y), x1 = float(dst.br.x), y1 = float(dst.br.y);
+    int base = int(m_BatchVertices.size());
+    SDL_Vertex v[4] = {
+      { { x0, y0 }, color, { u0, v0 } },
+      { { x1, y0 }, color, { u1, v0 } },
+      { { x1, y1 }, color, { u1, v1 } },
+      { { x0, y1 }, color, { u0, v1 } }
+    };
+    m_BatchVertices.insert(m_BatchVertices.end(), v, v + 4);
+    int idx[6] = { base, base + 1, base + 2, base, base + 2, base + 3 };
+    m_BatchIndices.insert(m_BatchIndices.end(), idx, idx + 6);
+  }
+#endif
+
+  void Graphics::flush()
+  {
+#if SDL_VERSION_ATLEAST(2,0,18)
+    if (!m_BatchIndices.empty())
+      SDL_RenderGeometry(m_Renderer, m_BatchPixels->get_texture(),
+                         &m_BatchVertices[0], int(m_BatchVertices.size()),
+                         &m_BatchIndices[0], int(m_BatchIndices.size()));
+    m_BatchVertices.clear();
+    m_BatchIndices.clear();
+    m_BatchPixels.reset();
+#endif
+  }
+
   void Graphics::flip()
   {
     //display_message("Flipping...");
+    flush();
     SDL_SetRenderTarget(m_Renderer, NULL);
     SDL_RenderCopy(m_Renderer,m_BackBuffer,0,0);
     SDL_RenderPresent(m_Renderer);
@@ -66,10 +140,15 @@ namespace SDLPP
     return color;
   }
 
-  void BitmapPixels::draw(const iRect2& src, const iRect2& dst)
+  SDL_Texture* BitmapPixels::get_texture()
   {
     if (!m_Texture) m_Texture = Graphics::instance()->create_texture(m_Surface);
-    Graphics::instance()->draw(m_Texture, src, dst);
+    return m_Texture;
+  }
+
+  void BitmapPixels::draw(const iRect2& src, const iRect2& dst)
+  {
+    Graphics::instance()->draw(get_texture(), src, dst);
   }
 
   void Bitmap::draw(int x, int y)
@@ -79,22 +158,22 @@ namespace SDLPP
 
   void Bitmap::draw(const iVec2& at)
   {
-    m_Pixels->draw(m_Region, iRect2(at, at + m_Region.get_size()));
+    Graphics::instance()->draw(m_Pixels, m_Region, iRect2(at, at + m_Region.get_size()));
   }
 
   void Bitmap::draw(const iRect2& dst)
   {
-    m_Pixels->draw(m_Region, dst);
+    Graphics::instance()->draw(m_Pixels, m_Region, dst);
   }
 
   void Bitmap::draw(const iRect2& src, const iVec2& dst)
   {
-    m_Pixels->draw(src.translate(m_Region.tl), iRect2(dst, dst + src.get_size()));
+    Graphics::instance()->draw(m_Pixels, src.translate(m_Region.tl), iRect2(dst, dst + src.get_size()));
   }
 
   void Bitmap::draw(const iRect2& src, const iRect2& dst)
   {
-    m_Pixels->draw(src.translate(m_Region.tl), dst);
+    Graphics::instance()->draw(m_Pixels, src.translate(m_Region.tl), dst);
   }
 
 
@@ -123,24 +202,26 @@ namespace SDLPP
 
   static const int s_NumberOfImageTypes = sizeof(s_ImageTypes) / sizeof(ImageType);
 
-  image_loader get_loader(const xstring& file_name)
+  static int get_image_type(const xstring& file_name)
   {
     int p = file_name.find_last_of('.');
-    if (p < 0) return 0;
+    if (p < 0) return -1;
     xstring ext = file_name.substr(p + 1);
     for (xstring::iterator it = ext.begin(); it != ext.end(); ++it)
       if (*it >= 'a' && *it <= 'z') *it -= 32;
-    const char* loader_name = 0;
     for (int i = 0; i < s_NumberOfImageTypes; ++i)
     {
       if (ext == s_ImageTypes[i].extension)
-      {
-        loader_name = s_ImageTypes[i].loader_name;
-        break;
-      }
+        return i;
     }
-    if (!loader_name) return 0;
-    image_loader il = (image_loader)get_function("SDL2_image", loader_name);
+    return -1;
+  }
+
+  image_loader get_loader(const xstring& file_name)
+  {
+    int type = get_image_type(file_name);
+    if (type < 0) return 0;
+    image_loader il = (image_loader)get_function("SDL2_image", s_ImageTypes[type].loader_name);
     return il;
   }
 
@@ -157,17 +238,30 @@ namespace SDLPP
     //return Graphics::instance()->convert(loaded);
   }
 
-  bool BitmapLoader::load(const xstring& name, Bitmap& bmp)
+  SDL_Surface* BitmapLoader::decode(const xstring& name)
   {
+    size_t size = 0;
+    const char* data = get_contents_data(name, size);
+    if (data)
+      return load_bitmap(SDL_RWFromConstMem(data, int(size)), "");
     char_vec v;
     if (read_contents(name, v))
-    {
-      SDL_Surface* s = load_bitmap(SDL_RWFromConstMem(&v[0], v.size()), "");
-      //display_message("Loaded bitmap "+name+"  "+xstring(s->w)+"x"+xstring(s->h));
-      bmp = Bitmap(bitmap_pixels_ptr(new BitmapPixels(s)));
-      return true;
-    }
-    return false;
+      return load_bitmap(SDL_RWFromConstMem(&v[0], v.size()), "");
+    return 0;
+  }
+
+  bool BitmapLoader::is_image(const xstring& name)
+  {
+    return get_image_type(name) >= 0;
+  }
+
+  bool BitmapLoader::load(const xstring& name, Bitmap& bmp)
+  {
+    SDL_Surface* s = decode(name);
+    if (!s) return false;
+    //display_message("Loaded bitmap "+name+"  "+xstring(s->w)+"x"+xstring(s->h));
+    bmp = Bitmap(bitmap_pixels_ptr(new BitmapPixels(s)));
+    return true;
   }
 
 
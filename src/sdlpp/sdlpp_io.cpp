@@ -1,26 +1,400 @@
 #include <sdlpp_common.h>
 #include <sdlpp_io.h>
+#include <sdlpp_compress.h>
 //#include <cstring>
 
 namespace SDLPP {
 
 struct ResourceHeader
 {
-  ResourceHeader() : size(0), name_length(0), reserved1(0), reserved2(0) {}
+  ResourceHeader() : size(0), name_length(0), codec(CODEC_NONE), original_size(0) {}
   int size;
   int name_length;
-  int reserved1,reserved2;
+  int codec;          // Zero in old files
+  int original_size;  // Size after decompression
 };
 
-ResourceFile::ResourceFile(const char* filename)
+/** Compressed resources are stored as a sequence of independent chunks,
+    so they can be decompressed while streaming.
+    Each chunk is preceded by its stored size.  If the high bit is set,
+    the chunk is stored as is, since it did not compress. */
+static const int    CHUNK_SIZE = 65536;
+static const Uint32 CHUNK_RAW  = 0x80000000;
+
+/** Compresses one chunk, returning the compressed size, or 0 if it would not be smaller */
+static int compress_chunk(ResourceCodec codec, const char* src, int len, char* dst)
+{
+  switch (codec)
+  {
+    case CODEC_LZ4: return lz4_compress(src,len,dst,len-1);
+    default: THROW("Unsupported resource codec: " << int(codec));
+  }
+}
+
+static void compress_chunks(const char* src, int size, ResourceCodec codec, char_vec& out)
+{
+  out.clear();
+  char_vec buffer(lz4_compress_bound(CHUNK_SIZE));
+  for(int pos=0;pos<size;pos+=CHUNK_SIZE)
+  {
+    int len=Min(CHUNK_SIZE,size-pos);
+    int clen=compress_chunk(codec,src+pos,len,&buffer[0]);
+    Uint32 header=(clen>0 ? Uint32(clen) : (Uint32(len)|CHUNK_RAW));
+    const char* data=(clen>0 ? &buffer[0] : src+pos);
+    int n=(clen>0 ? clen : len);
+    out.insert(out.end(),(const char*)&header,(const char*)&header+sizeof(Uint32));
+    out.insert(out.end(),data,data+n);
+  }
+}
+
+/** Decompresses a chunk into dst, returning the number of bytes written, or -1 on error */
+static int decompress_chunk(Uint32 header, const char* src, char* dst, int capacity)
+{
+  int n=int(header&~CHUNK_RAW);
+  if ((header&CHUNK_RAW)!=0)
+  {
+    if (n>capacity) return -1;
+    std::copy(src,src+n,dst);
+    return n;
+  }
+  return lz4_decompress(src,n,dst,capacity);
+}
+
+static bool decompress_chunks(const char* src, int stored_size, char* dst, int size)
+{
+  int pos=0,out=0;
+  while (pos+int(sizeof(Uint32))<=stored_size)
+  {
+    Uint32 header;
+    std::copy(src+pos,src+pos+sizeof(Uint32),(char*)&header);
+    pos+=sizeof(Uint32);
+    int n=int(header&~CHUNK_RAW);
+    if (n>stored_size-pos) return false;
+    int act=decompress_chunk(header,src+pos,dst+out,Min(CHUNK_SIZE,size-out));
+    if (act<0) return false;
+    pos+=n;
+    out+=act;
+  }
+  return out==size;
+}
+
+/** Implements an SDL_RWops that decompresses a resource chunk by chunk
+    as it is being read.  The compressed data comes either from memory
+    (mapped resource file) or from a file positioned at the resource start.
+*/
+class CompressedStream
+{
+  SDL_RWops*  m_Source;      // Owned, NULL when reading from memory
+  const char* m_Memory;
+  Sint64      m_Base;        // Start of compressed data in the source file
+  int         m_StoredSize;
+  int         m_Size;        // Decompressed size
+  int         m_SourcePos;   // Next chunk header offset within compressed data
+  int         m_ChunkStart;  // Decompressed offset of the current chunk
+  int         m_Position;
+  char_vec    m_Chunk;
+  char_vec    m_Input;
+
+  bool read_source(char* dst, int n)
+  {
+    if (m_Memory)
+    {
+      std::copy(m_Memory+m_SourcePos,m_Memory+m_SourcePos+n,dst);
+    }
+    else
+    {
+      SDL_RWseek(m_Source, m_Base+m_SourcePos, RW_SEEK_SET);
+      if (n>0 && SDL_RWread(m_Source, dst, n, 1)!=1) return false;
+    }
+    m_SourcePos+=n;
+    return true;
+  }
+
+  bool next_chunk()
+  {
+    m_ChunkStart+=int(m_Chunk.size());
+    m_Chunk.clear();
+    if (m_SourcePos+int(sizeof(Uint32))>m_StoredSize) return false;
+    Uint32 header;
+    if (!read_source((char*)&header,sizeof(Uint32))) return false;
+    int n=int(header&~CHUNK_RAW);
+    if (n>m_StoredSize-m_SourcePos) return false;
+    m_Input.resize(n);
+    if (!read_source(m_Input.data(),n)) return false;
+    m_Chunk.resize(CHUNK_SIZE);
+    int act=decompress_chunk(header,m_Input.data(),&m_Chunk[0],CHUNK_SIZE);
+    if (act<0) { m_Chunk.clear(); return false; }
+    m_Chunk.resize(act);
+    return true;
+  }
+
+  void rewind()
+  {
+    m_SourcePos=0;
+    m_ChunkStart=0;
+    m_Chunk.clear();
+  }
+public:
+  CompressedStream(SDL_RWops* source, const char* memory, int stored_size, int size)
+    : m_Source(source)
+    , m_Memory(memory)
+    , m_Base(source ? SDL_RWtell(source) : 0)
+    , m_StoredSize(stored_size)
+    , m_Size(size)
+    , m_SourcePos(0)
+    , m_ChunkStart(0)
+    , m_Position(0)
+  {}
+
+  ~CompressedStream()
+  {
+    if (m_Source) SDL_RWclose(m_Source);
+  }
+
+  Sint64 size() const { return m_Size; }
+
+  Sint64 seek(Sint64 offset, int whence)
+  {
+    Sint64 target=offset;
+    if (whence==RW_SEEK_CUR) target+=m_Position;
+    if (whence==RW_SEEK_END) target+=m_Size;
+    if (target<0 || target>m_Size) return -1;
+    m_Position=int(target);
+    if (m_Position<m_ChunkStart) rewind();
+    return m_Position;
+  }
+
+  size_t read(void* ptr, size_t size, size_t maxnum)
+  {
+    if (size==0) return 0;
+    char* dst=(char*)ptr;
+    size_t total=size*maxnum,done=0;
+    while (done<total && m_Position<m_Size)
+    {
+      int chunk_end=m_ChunkStart+int(m_Chunk.size());
+      if (m_Position>=chunk_end)
+      {
+        if (!next_chunk()) break;
+        continue;
+      }
+      size_t n=Min(size_t(chunk_end-m_Position),total-done);
+      const char* src=&m_Chunk[m_Position-m_ChunkStart];
+      std::copy(src,src+n,dst+done);
+      done+=n;
+      m_Position+=int(n);
+    }
+    return done/size;
+  }
+
+  static Sint64 SDLCALL rw_size(SDL_RWops* context)
+  {
+    return get(context)->size();
+  }
+
+  static Sint64 SDLCALL rw_seek(SDL_RWops* context, Sint64 offset, int whence)
+  {
+    return get(context)->seek(offset,whence);
+  }
+
+  static size_t SDLCALL rw_read(SDL_RWops* context, void* ptr, size_t size, size_t maxnum)
+  {
+    return get(context)->read(ptr,size,maxnum);
+  }
+
+  static size_t SDLCALL rw_write(SDL_RWops* context, const void* ptr, size_t size, size_t num)
+  {
+    return 0;
+  }
+
+  static int SDLCALL rw_close(SDL_RWops* context)
+  {
+    delete get(context);
+    SDL_FreeRW(context);
+    return 0;
+  }
+
+  static SDL_RWops* create(SDL_RWops* source, const char* memory, int stored_size, int size)
+  {
+    SDL_RWops* rw=SDL_AllocRW();
+    if (!rw)
+    {
+      if (source) SDL_RWclose(source);
+      return 0;
+    }
+    rw->size=rw_size;
+    rw->seek=rw_seek;
+    rw->read=rw_read;
+    rw->write=rw_write;
+    rw->close=rw_close;
+    rw->type=SDL_RWOPS_UNKNOWN;
+    rw->hidden.unknown.data1=new CompressedStream(source,memory,stored_size,size);
+    return rw;
+  }
+private:
+  static CompressedStream* get(SDL_RWops* context)
+  {
+    return reinterpret_cast<CompressedStream*>(context->hidden.unknown.data1);
+  }
+};
+
+/** Fixed size footer at the end of a resource file, locating the table of contents.
+    The table is an array of ResourceFile::Resource sorted by name hash,
+    followed by the concatenated resource names. */
+struct ResourceFooter
+{
+  ResourceFooter() : version(0), toc_position(0), toc_count(0), names_size(0) 
+  {
+    std::fill(magic,magic+8,0);
+  }
+  char magic[8];
+  int  version;
+  int  toc_position;
+  int  toc_count;
+  int  names_size;
+};
+
+static const char RESOURCE_MAGIC[8] = { 'S','D','L','P','P','R','S','C' };
+static const int  RESOURCE_VERSION = 2;
+
+static bool valid_footer(const ResourceFooter& f, size_t file_size, size_t entry_size)
+{
+  if (!std::equal(f.magic,f.magic+8,RESOURCE_MAGIC)) return false;
+  if (f.version!=RESOURCE_VERSION) return false;
+  if (f.toc_position<0 || f.toc_count<0 || f.names_size<0) return false;
+  size_t toc_end=size_t(f.toc_position)+size_t(f.toc_count)*entry_size+size_t(f.names_size);
+  return toc_end+sizeof(ResourceFooter)==file_size;
+}
+
+Uint32 ResourceFile::hash_name(const char* name, int length)
+{
+  // FNV-1a
+  Uint32 h=2166136261U;
+  for(int i=0;i<length;++i)
+  {
+    h^=Uint8(name[i]);
+    h*=16777619U;
+  }
+  return h;
+}
+
+void ResourceFile::build_index(const rsc_map& m, rsc_vec& resources, char_vec& names)
+{
+  resources.clear();
+  names.clear();
+  for(rsc_map::const_iterator it=m.begin();it!=m.end();++it)
+  {
+    const xstring& name=it->first;
+    Resource r=it->second;
+    r.name_offset=int(names.size());
+    r.name_length=int(name.length());
+    r.hash=hash_name(name.c_str(),r.name_length);
+    names.insert(names.end(),name.begin(),name.end());
+    resources.push_back(r);
+  }
+  const char_vec& nv=names;
+  std::sort(resources.begin(),resources.end(),[&nv](const Resource& a, const Resource& b)
+  {
+    if (a.hash!=b.hash) return a.hash<b.hash;
+    return std::lexicographical_compare(nv.begin()+a.name_offset,nv.begin()+a.name_offset+a.name_length,
+                                        nv.begin()+b.name_offset,nv.begin()+b.name_offset+b.name_length);
+  });
+}
+
+const ResourceFile::Resource* ResourceFile::find(const xstring& resource_name) const
+{
+  int length=int(resource_name.length());
+  Resource key;
+  key.hash=hash_name(resource_name.c_str(),length);
+  rsc_vec::const_iterator it=std::lower_bound(m_Resources.begin(),m_Resources.end(),key,
+    [](const Resource& a, const Resource& b) { return a.hash<b.hash; });
+  for(;it!=m_Resources.end() && it->hash==key.hash;++it)
+  {
+    if (it->name_length==length && 
+        std::equal(resource_name.begin(),resource_name.end(),m_Names.begin()+it->name_offset))
+      return &(*it);
+  }
+  return 0;
+}
+
+ResourceFile::ResourceFile(const char* filename, bool memory_mapped)
 : m_Filename(filename?filename:"")
+, m_Mapping(0)
+, m_MappingSize(0)
+, m_DataEnd(0)
 {
   if (m_Filename.empty()) return;
-  SDL_RWops* rw = SDL_RWFromFile(filename, "rb");
+  if (memory_mapped)
+  {
+    m_Mapping=map_file(filename,m_MappingSize);
+    if (m_Mapping)
+    {
+      index_mapping();
+      return;
+    }
+  }
+  index_file();
+}
+
+ResourceFile::~ResourceFile()
+{
+  unmap_file(m_Mapping,m_MappingSize);
+}
+
+void ResourceFile::index_file()
+{
+  SDL_RWops* rw = SDL_RWFromFile(m_Filename, "rb");
   if (!rw) 
-    THROW ("File not found: "+xstring(filename));
-  char name_buffer[1024];
+    THROW ("File not found: "+m_Filename);
   size_t size = size_t(SDL_RWsize(rw));
+  if (size>=sizeof(ResourceFooter))
+  {
+    ResourceFooter f;
+    SDL_RWseek(rw, size-sizeof(ResourceFooter), RW_SEEK_SET);
+    SDL_RWread(rw, &f, sizeof(ResourceFooter), 1);
+    if (valid_footer(f,size,sizeof(Resource)))
+    {
+      m_Resources.resize(f.toc_count);
+      m_Names.resize(f.names_size);
+      SDL_RWseek(rw, f.toc_position, RW_SEEK_SET);
+      if (f.toc_count>0) SDL_RWread(rw, &m_Resources[0], sizeof(Resource), f.toc_count);
+      if (f.names_size>0) SDL_RWread(rw, &m_Names[0], 1, f.names_size);
+      m_DataEnd=size_t(f.toc_position);
+      SDL_RWclose(rw);
+      return;
+    }
+  }
+  index_headers(rw,size);
+  SDL_RWclose(rw);
+}
+
+void ResourceFile::index_mapping()
+{
+  if (m_MappingSize>=sizeof(ResourceFooter))
+  {
+    ResourceFooter f;
+    const char* fp=m_Mapping+m_MappingSize-sizeof(ResourceFooter);
+    std::copy(fp,fp+sizeof(ResourceFooter),(char*)&f);
+    if (valid_footer(f,m_MappingSize,sizeof(Resource)))
+    {
+      const Resource* toc=reinterpret_cast<const Resource*>(m_Mapping+f.toc_position);
+      const char* names=reinterpret_cast<const char*>(toc+f.toc_count);
+      m_Resources.resize(f.toc_count);
+      std::copy((const char*)toc,names,(char*)m_Resources.data());
+      m_Names.assign(names,names+f.names_size);
+      m_DataEnd=size_t(f.toc_position);
+      return;
+    }
+  }
+  SDL_RWops* rw = SDL_RWFromConstMem(m_Mapping, int(m_MappingSize));
+  index_headers(rw,m_MappingSize);
+  SDL_RWclose(rw);
+}
+
+/** Walks all headers of a file in the old format, without table of contents */
+void ResourceFile::index_headers(SDL_RWops* rw, size_t size)
+{
+  rsc_map resources;
+  char name_buffer[1024];
   SDL_RWseek(rw, 0, RW_SEEK_SET);
   while (SDL_RWtell(rw)<size)
   {
@@ -36,10 +410,18 @@ ResourceFile::ResourceFile(const char* filename)
     Resource r;
     r.position=int(SDL_RWtell(rw));
     r.size=rh.size;
+    r.codec=rh.codec;
+    r.original_size=rh.original_size;
+    if (r.codec!=CODEC_NONE && r.codec!=CODEC_LZ4)
+      THROW("Unsupported codec in resource file: "+m_Filename);
+    if (r.size<0 || size_t(r.position)+size_t(r.size)>size)
+      THROW("Truncated resource file: "+m_Filename);
     SDL_RWseek(rw, rh.size, RW_SEEK_CUR);
     //f.seekg(r.size,std::ios::cur);
-    m_Resources[name_buffer]=r;
+    resources[name_buffer]=r;
   }
+  m_DataEnd=size;
+  build_index(resources,m_Resources,m_Names);
 }
 
 class block_streambuf : public std::streambuf
@@ -112,10 +494,19 @@ size_t        ResourceFile::get_size(const xstring& resource_name)
     SDL_RWclose(rw);
     return res;
   }
-  rsc_map::iterator it = m_Resources.find(resource_name);
-  if (it == m_Resources.end()) return 0;
-  Resource& r = it->second;
-  return r.size;
+  const Resource* r = find(resource_name);
+  if (!r) return 0;
+  if (r->codec!=CODEC_NONE) return r->original_size;
+  return r->size;
+}
+
+const char* ResourceFile::get_data(const xstring& resource_name, size_t& size)
+{
+  if (!m_Mapping) return 0;
+  const Resource* r=find(resource_name);
+  if (!r || r->codec!=CODEC_NONE) return 0;
+  size=size_t(r->size);
+  return m_Mapping+r->position;
 }
 
 SDL_RWops* ResourceFile::get(const xstring& resource_name)
@@ -124,34 +515,126 @@ SDL_RWops* ResourceFile::get(const xstring& resource_name)
   {
     return SDL_RWFromFile(resource_name, "rb");
   }
-  rsc_map::iterator it=m_Resources.find(resource_name);
-  if (it==m_Resources.end()) return 0;
-  Resource& r=it->second;
+  const Resource* r=find(resource_name);
+  if (!r) return 0;
+  if (m_Mapping) 
+  {
+    if (r->codec!=CODEC_NONE)
+      return CompressedStream::create(0, m_Mapping+r->position, r->size, r->original_size);
+    return SDL_RWFromConstMem(m_Mapping+r->position, r->size);
+  }
   SDL_RWops* rw = SDL_RWFromFile(m_Filename, "rb");
-  SDL_RWseek(rw, r.position, RW_SEEK_SET);
+  if (!rw) return 0;
+  SDL_RWseek(rw, r->position, RW_SEEK_SET);
+  if (r->codec!=CODEC_NONE)
+    return CompressedStream::create(rw, 0, r->size, r->original_size);
   return rw;
 }
 
+bool ResourceFile::read_contents(const xstring& resource_name, char_vec& cv)
+{
+  if (m_Filename.empty())
+  {
+    SDL_RWops* rw = SDL_RWFromFile(resource_name, "rb");
+    if (!rw) return false;
+    int size = int(SDL_RWsize(rw));
+    cv.resize(size);
+    if (size>0) SDL_RWread(rw, &cv[0], 1, size);
+    SDL_RWclose(rw);
+    return true;
+  }
+  const Resource* r=find(resource_name);
+  if (!r) return false;
+  char_vec input;
+  const char* stored=0;
+  if (m_Mapping) stored=m_Mapping+r->position;
+  else
+  {
+    SDL_RWops* rw = SDL_RWFromFile(m_Filename, "rb");
+    if (!rw) return false;
+    SDL_RWseek(rw, r->position, RW_SEEK_SET);
+    char_vec& target=(r->codec==CODEC_NONE ? cv : input);
+    target.resize(r->size);
+    if (r->size>0) SDL_RWread(rw, &target[0], 1, r->size);
+    SDL_RWclose(rw);
+    if (r->codec==CODEC_NONE) return true;
+    stored=input.data();
+  }
+  if (r->codec==CODEC_NONE)
+  {
+    cv.assign(stored, stored+r->size);
+    return true;
+  }
+  cv.resize(r->original_size);
+  return decompress_chunks(stored, r->size, cv.data(), r->original_size);
+}
+
 
 ResourceFileWriter::ResourceFileWriter(const char* filename, bool append)
-: m_File(filename,(append?std::ios::app:std::ios::out)|std::ios::binary)
+: m_Closed(false)
 {
+  std::streamoff data_end=0;
+  if (append && std::ifstream(filename,std::ios::in|std::ios::binary).good())
+  {
+    ResourceFile existing(filename);
+    ResourceFile::rsc_vec::const_iterator b=existing.m_Resources.begin(),e=existing.m_Resources.end();
+    for(;b!=e;++b)
+      m_Entries[existing.get_name(*b)]=*b;
+    data_end=std::streamoff(existing.m_DataEnd);
+    m_File.open(filename,std::ios::in|std::ios::out|std::ios::binary);
+  }
+  else
+    m_File.open(filename,std::ios::out|std::ios::trunc|std::ios::binary);
   if (m_File.fail()) 
     THROW ("Cannot open file for writing: "+xstring(filename));
+  m_File.seekp(data_end);
+}
+
+ResourceFileWriter::~ResourceFileWriter()
+{
+  close();
 }
 
-void ResourceFileWriter::add_resource(const char* filename)
+void ResourceFileWriter::begin_entry(const char* name, int length, ResourceCodec codec, int original_size)
+{
+  if (m_Closed)
+    THROW ("Resource file already closed, cannot add: "+xstring(name));
+  ResourceHeader rh;
+  rh.name_length=strlen(name);
+  rh.size=length;
+  rh.codec=codec;
+  rh.original_size=original_size;
+  m_File.write((const char*)&rh,sizeof(ResourceHeader));
+  m_File.write(name,rh.name_length);
+  ResourceFile::Resource r;
+  r.hash=0;
+  r.position=int(m_File.tellp());
+  r.size=length;
+  r.name_offset=0;
+  r.name_length=0;
+  r.codec=rh.codec;
+  r.original_size=rh.original_size;
+  m_Entries[name]=r;
+}
+
+void ResourceFileWriter::add_resource(const char* filename, ResourceCodec codec)
 {
   std::ifstream f(filename,std::ios::in|std::ios::binary);
   if (f.fail())
     THROW ("File not found: "+xstring(filename));
-  ResourceHeader rh;
-  rh.name_length=strlen(filename);
   f.seekg(0,std::ios::end);
-  rh.size=int(f.tellg());
+  int size=int(f.tellg());
   f.seekg(0);
-  m_File.write((const char*)&rh,sizeof(ResourceHeader));
-  m_File.write(filename,rh.name_length);
+  if (codec!=CODEC_NONE)
+  {
+    char_vec data(size);
+    if (size>0) f.read(&data[0],size);
+    if (int(f.gcount()) != size)
+      THROW ("Mismatch in file size between seek and read: "+xstring(filename));
+    add_resource(filename,data.data(),size,codec);
+    return;
+  }
+  begin_entry(filename,size,CODEC_NONE,size);
   char buffer[65536];
   int total=0;
   while (!f.eof())
@@ -162,20 +645,46 @@ void ResourceFileWriter::add_resource(const char* filename)
     total+=act;
     m_File.write(buffer,act);
   }
-  if (total != rh.size)
+  if (total != size)
     THROW ("Mismatch in file size between seek and read: "+xstring(filename));
 }
 
-void ResourceFileWriter::add_resource(const char* name, const char* buffer, int length)
+void ResourceFileWriter::add_resource(const char* name, const char* buffer, int length, ResourceCodec codec)
 {
-  ResourceHeader rh;
-  rh.name_length=strlen(name);
-  rh.size=length;
-  m_File.write((const char*)&rh,sizeof(ResourceHeader));
-  m_File.write(name,rh.name_length);
+  if (codec!=CODEC_NONE)
+  {
+    char_vec packed;
+    compress_chunks(buffer,length,codec,packed);
+    if (int(packed.size())<length)
+    {
+      begin_entry(name,int(packed.size()),codec,length);
+      m_File.write(packed.data(),packed.size());
+      return;
+    }
+  }
+  begin_entry(name,length,CODEC_NONE,length);
   m_File.write(buffer,length);
 }
 
+void ResourceFileWriter::close()
+{
+  if (m_Closed) return;
+  m_Closed=true;
+  ResourceFile::rsc_vec toc;
+  char_vec names;
+  ResourceFile::build_index(m_Entries,toc,names);
+  ResourceFooter f;
+  std::copy(RESOURCE_MAGIC,RESOURCE_MAGIC+8,f.magic);
+  f.version=RESOURCE_VERSION;
+  f.toc_position=int(m_File.tellp());
+  f.toc_count=int(toc.size());
+  f.names_size=int(names.size());
+  if (!toc.empty()) m_File.write((const char*)&toc[0],toc.size()*sizeof(ResourceFile::Resource));
+  if (!names.empty()) m_File.write(&names[0],names.size());
+  m_File.write((const char*)&f,sizeof(ResourceFooter));
+  m_File.close();
+}
+
 Sint64 SDLCALL istream_seek(struct SDL_RWops *context, Sint64 offset, int whence)
 {
   std::istream* is=reinterpret_cast<std::istream*>(context->hidden.unknown.data1);
@@ -213,34 +722,35 @@ int SDLCALL istream_close(struct SDL_RWops *context)
 
 
 
+const char* get_contents_data(const xstring& name, size_t& size)
+{
+  ResourceFile* rf = get_default_resource_file();
+  if (!rf) return 0;
+  return rf->get_data(name, size);
+}
+
 bool        read_contents(const xstring& name, char_vec& cv)
 {
   ResourceFile* rf = get_default_resource_file();
-  SDL_RWops* rw = 0;
-  int size = 0;
-  if (rf) 
-  {
-    size = rf->get_size(name);
-    rw = rf->get(name);
-    if (!rw) return false;
-  }
-  else
-  {
-    rw = SDL_RWFromFile(name, "rb");
-    size = int(SDL_RWsize(rw));
-    SDL_RWseek(rw, 0, RW_SEEK_SET);
-  }
+  if (rf) return rf->read_contents(name, cv);
+  SDL_RWops* rw = SDL_RWFromFile(name, "rb");
+  if (!rw) return false;
+  int size = int(SDL_RWsize(rw));
+  SDL_RWseek(rw, 0, RW_SEEK_SET);
   cv.resize(size);
-  SDL_RWread(rw, &cv[0], 1, size);
+  if (size>0) SDL_RWread(rw, &cv[0], 1, size);
   SDL_RWclose(rw);
   return true;
 }
 
 xstring read_contents_as_string(const xstring& name)
 {
+  size_t size = 0;
+  const char* mapped = get_contents_data(name, size);
+  if (mapped) return xstring(mapped, size);
   char_vec cv;
-  if (!read_contents(name,cv)) return "";
-  return (&cv.front());
+  if (!read_contents(name,cv) || cv.empty()) return "";
+  return xstring(&cv.front(), cv.size());
 }
 
 void handle_xml_eol(xstring& s)
@@ -257,12 +767,17 @@ void handle_xml_eol(xstring& s)
 
 xml_element* load_xml(const xstring& name)
 {
-  xstring cfg=read_contents_as_string(name);
-  //if (name.ends_with(".xml")) display_message("Loaded ("+name+"): " + cfg);
-  if (cfg.empty())
+  // The parser works in place, writing terminators into its buffer, so a
+  // mapped resource, which is read only, is copied once.  Anything else is
+  // read straight into the buffer the parser takes over.
+  char_vec cv;
+  size_t size = 0;
+  const char* mapped = get_contents_data(name, size);
+  if (mapped) cv.assign(mapped, mapped+size);
+  else read_contents(name,cv);
+  if (cv.empty())
     THROW("Not found: " << name);
-  handle_xml_eol(cfg);
-  return load_xml_from_text(cfg);
+  return xml_parser().parse(cv);
 }
 
 
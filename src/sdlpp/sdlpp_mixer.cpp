@@ -0,0 +1,313 @@
+#include <sdlpp_mixer.h>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SDLPP_MIX_X86
+#define SDLPP_TARGET(x) __attribute__((target(x)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SDLPP_MIX_X86
+#define SDLPP_TARGET(x)
+#include <intrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SDLPP_MIX_NEON
+#include <arm_neon.h>
+#endif
+
+namespace SDLPP
+{
+
+  namespace {
+
+    const float MIN_SAMPLE = -32768.0f;
+    const float MAX_SAMPLE = 32767.0f;
+
+    inline short scalar_sample(int s, const float* gain, int i)
+    {
+      if (gain)
+      {
+        // Clamp before the conversion, so that it is always defined
+        float v = float(s) * gain[i];
+        v = Max(MIN_SAMPLE, Min(MAX_SAMPLE, v));
+        return short(int(v));
+      }
+      return short(Max(-0x8000, Min(0x7FFF, s)));
+    }
+
+    void scalar_accumulate(int* acc, const short* src, int n)
+    {
+      for (int i = 0; i < n; ++i)
+        acc[i] += src[i];
+    }
+
+    void scalar_output(short* out, const int* acc, int n, const float* gain)
+    {
+      for (int i = 0; i < n; ++i)
+        out[i] = scalar_sample(acc[i], gain, i);
+    }
+
+    const MixKernels g_Scalar = { "scalar", scalar_accumulate, scalar_output };
+
+#ifdef SDLPP_MIX_X86
+
+    SDLPP_TARGET("sse2")
+    void sse2_accumulate(int* acc, const short* src, int n)
+    {
+      int i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        // Sign extend by moving each sample to the high half and shifting back
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        __m128i* a = (__m128i*)(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), lo));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), hi));
+      }
+      scalar_accumulate(acc + i, src + i, n - i);
+    }
+
+    SDLPP_TARGET("sse2")
+    __m128i sse2_apply_gain(__m128i s, const float* gain)
+    {
+      __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(s), _mm_loadu_ps(gain));
+      v = _mm_max_ps(_mm_set1_ps(MIN_SAMPLE), _mm_min_ps(_mm_set1_ps(MAX_SAMPLE), v));
+      return _mm_cvttps_epi32(v);
+    }
+
+    SDLPP_TARGET("sse2")
+    void sse2_output(short* out, const int* acc, int n, const float* gain)
+    {
+      int i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(acc + i + 4));
+        if (gain)
+        {
+          lo = sse2_apply_gain(lo, gain + i);
+          hi = sse2_apply_gain(hi, gain + i + 4);
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+      }
+      for (; i < n; ++i)
+        out[i] = scalar_sample(acc[i], gain, i);
+    }
+
+    SDLPP_TARGET("avx2")
+    void avx2_accumulate(int* acc, const short* src, int n)
+    {
+      int i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i + 8)));
+        __m256i* a = (__m256i*)(acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), lo));
+        _mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), hi));
+      }
+      scalar_accumulate(acc + i, src + i, n - i);
+    }
+
+    SDLPP_TARGET("avx2")
+    __m256i avx2_apply_gain(__m256i s, const float* gain)
+    {
+      __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(s), _mm256_loadu_ps(gain));
+      v = _mm256_max_ps(_mm256_set1_ps(MIN_SAMPLE), _mm256_min_ps(_mm256_set1_ps(MAX_SAMPLE), v));
+      return _mm256_cvttps_epi32(v);
+    }
+
+    SDLPP_TARGET("avx2")
+    void avx2_output(short* out, const int* acc, int n, const float* gain)
+    {
+      int i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(acc + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(acc + i + 8));
+        if (gain)
+        {
+          lo = avx2_apply_gain(lo, gain + i);
+          hi = avx2_apply_gain(hi, gain + i + 8);
+        }
+        // Packing works within 128 bit lanes, so put the quarters back in order
+        __m256i packed = _mm256_packs_epi32(lo, hi);
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), packed);
+      }
+      for (; i < n; ++i)
+        out[i] = scalar_sample(acc[i], gain, i);
+    }
+
+    const MixKernels g_SSE2 = { "sse2", sse2_accumulate, sse2_output };
+    const MixKernels g_AVX2 = { "avx2", avx2_accumulate, avx2_output };
+
+#endif // SDLPP_MIX_X86
+
+#ifdef SDLPP_MIX_NEON
+
+    void neon_accumulate(int* acc, const short* src, int n)
+    {
+      int i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        int16x8_t s = vld1q_s16(src + i);
+        vst1q_s32(acc + i, vaddq_s32(vld1q_s32(acc + i), vmovl_s16(vget_low_s16(s))));
+        vst1q_s32(acc + i + 4, vaddq_s32(vld1q_s32(acc + i + 4), vmovl_s16(vget_high_s16(s))));
+      }
+      scalar_accumulate(acc + i, src + i, n - i);
+    }
+
+    int32x4_t neon_apply_gain(int32x4_t s, const float* gain)
+    {
+      float32x4_t v = vmulq_f32(vcvtq_f32_s32(s), vld1q_f32(gain));
+      v = vmaxq_f32(vdupq_n_f32(MIN_SAMPLE), vminq_f32(vdupq_n_f32(MAX_SAMPLE), v));
+      return vcvtq_s32_f32(v);
+    }
+
+    void neon_output(short* out, const int* acc, int n, const float* gain)
+    {
+      int i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        int32x4_t lo = vld1q_s32(acc + i);
+        int32x4_t hi = vld1q_s32(acc + i + 4);
+        if (gain)
+        {
+          lo = neon_apply_gain(lo, gain + i);
+          hi = neon_apply_gain(hi, gain + i + 4);
+        }
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+      }
+      for (; i < n; ++i)
+        out[i] = scalar_sample(acc[i], gain, i);
+    }
+
+    const MixKernels g_NEON = { "neon", neon_accumulate, neon_output };
+
+#endif // SDLPP_MIX_NEON
+
+  } // anonymous namespace
+
+  std::vector<const MixKernels*> get_supported_mix_kernels()
+  {
+    std::vector<const MixKernels*> res;
+    res.push_back(&g_Scalar);
+#ifdef SDLPP_MIX_X86
+    if (SDL_HasSSE2()) res.push_back(&g_SSE2);
+#if SDL_VERSION_ATLEAST(2,0,4)
+    if (SDL_HasAVX2()) res.push_back(&g_AVX2);
+#endif
+#endif
+#ifdef SDLPP_MIX_NEON
+#if SDL_VERSION_ATLEAST(2,0,6)
+    if (SDL_HasNEON()) res.push_back(&g_NEON);
+#else
+    res.push_back(&g_NEON);
+#endif
+#endif
+    return res;
+  }
+
+  const MixKernels& get_mix_kernels()
+  {
+    static const MixKernels* best = get_supported_mix_kernels().back();
+    return *best;
+  }
+
+  namespace {
+
+    const int    SINC_TAPS = 8;
+    const int    SINC_PHASES = 256;
+    const double PI = 3.14159265358979323846;
+
+    /** Filter coefficients for each fractional position.
+        Phase p holds the taps for samples -3..4 around position p/SINC_PHASES. */
+    struct SincTable
+    {
+      float taps[SINC_PHASES + 1][SINC_TAPS];
+
+      SincTable()
+      {
+        const double half = SINC_TAPS / 2;
+        for (int p = 0; p <= SINC_PHASES; ++p)
+        {
+          double t = double(p) / SINC_PHASES;
+          double sum = 0;
+          double c[SINC_TAPS];
+          for (int k = 0; k < SINC_TAPS; ++k)
+          {
+            double x = (k - (half - 1)) - t;
+            double sinc = (x == 0 ? 1.0 : sin(PI * x) / (PI * x));
+            double window = 0.42 + 0.5 * cos(PI * x / half) + 0.08 * cos(2 * PI * x / half);
+            c[k] = sinc * window;
+            sum += c[k];
+          }
+          // Normalize, so that a constant signal keeps its level
+          for (int k = 0; k < SINC_TAPS; ++k)
+            taps[p][k] = float(c[k] / sum);
+        }
+      }
+    };
+
+    const SincTable g_Sinc;
+
+    inline float fetch(const MixSource& src, int frame, int channel)
+    {
+      if (frame < 0 || frame >= src.frames)
+      {
+        if (!src.loop) return 0.0f;
+        frame %= src.frames;
+        if (frame < 0) frame += src.frames;
+      }
+      return src.data[frame * src.channels + channel];
+    }
+
+  } // anonymous namespace
+
+  double mix_resampled(int* acc, int n, const MixSource& src, double pos, double step,
+                       const float* gains, ResampleMode mode)
+  {
+    if (src.frames <= 0 || pos < 0) return -1.0;
+    const int channels = src.channels;
+    for (int f = 0; f < n; ++f, acc += channels)
+    {
+      if (pos >= src.frames)
+      {
+        if (!src.loop) return -1.0;
+        pos = fmod(pos, double(src.frames));
+      }
+      int i = int(pos);
+      float t = float(pos - i);
+      if (mode == RESAMPLE_SINC)
+      {
+        const float* taps = g_Sinc.taps[int(t * SINC_PHASES + 0.5f)];
+        int first = i - (SINC_TAPS / 2 - 1);
+        for (int c = 0; c < channels; ++c)
+        {
+          float v = 0.0f;
+          for (int k = 0; k < SINC_TAPS; ++k)
+            v += fetch(src, first + k, c) * taps[k];
+          acc[c] += int(floor(v * gains[c] + 0.5f));
+        }
+      }
+      else
+      {
+        for (int c = 0; c < channels; ++c)
+        {
+          float a = fetch(src, i, c);
+          float v = a + (fetch(src, i + 1, c) - a) * t;
+          acc[c] += int(floor(v * gains[c] + 0.5f));
+        }
+      }
+      pos += step;
+    }
+    if (pos >= src.frames)
+    {
+      if (!src.loop) return -1.0;
+      pos = fmod(pos, double(src.frames));
+    }
+    return pos;
+  }
+
+} // namespace SDLPP
@@ -1,7 +1,72 @@
 #include <sdlpp.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 namespace SDLPP {
 
+int BitRow::test(const BitRow& br, int offset, int br_offset) const
+{
+  if (offset<0) return br.test(*this,-offset,0);
+  int len=Min(m_Size-offset,br.m_Size-br_offset);
+  // Outside of both spans at least one of the rows is empty
+  int i=Max(0,Max(m_First-offset,br.m_First-br_offset));
+  int end=Min(len,Min(m_Last-offset,br.m_Last-br_offset));
+  if (i>=end) return -1;
+  // Skip ahead in blocks of words, while there are no common bits
+#if defined(__AVX2__)
+  for(;i+4*BITS<=end;i+=4*BITS)
+  {
+    int p=i+offset,bp=i+br_offset;
+    __m128i s=_mm_cvtsi32_si128(p&(BITS-1)),rs=_mm_cvtsi32_si128(BITS-(p&(BITS-1)));
+    __m128i bs=_mm_cvtsi32_si128(bp&(BITS-1)),brs=_mm_cvtsi32_si128(BITS-(bp&(BITS-1)));
+    const __m256i* a=reinterpret_cast<const __m256i*>(&m_Data[p>>6]);
+    const __m256i* b=reinterpret_cast<const __m256i*>(&br.m_Data[bp>>6]);
+    __m256i wa=_mm256_or_si256(_mm256_srl_epi64(_mm256_loadu_si256(a),s),
+                               _mm256_sll_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&m_Data[(p>>6)+1])),rs));
+    __m256i wb=_mm256_or_si256(_mm256_srl_epi64(_mm256_loadu_si256(b),bs),
+                               _mm256_sll_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&br.m_Data[(bp>>6)+1])),brs));
+    if (!_mm256_testz_si256(wa,wb)) break;
+  }
+#elif defined(__SSE2__) || defined(_M_X64)
+  for(;i+2*BITS<=end;i+=2*BITS)
+  {
+    int p=i+offset,bp=i+br_offset;
+    __m128i s=_mm_cvtsi32_si128(p&(BITS-1)),rs=_mm_cvtsi32_si128(BITS-(p&(BITS-1)));
+    __m128i bs=_mm_cvtsi32_si128(bp&(BITS-1)),brs=_mm_cvtsi32_si128(BITS-(bp&(BITS-1)));
+    __m128i wa=_mm_or_si128(_mm_srl_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_Data[p>>6])),s),
+                            _mm_sll_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&m_Data[(p>>6)+1])),rs));
+    __m128i wb=_mm_or_si128(_mm_srl_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&br.m_Data[bp>>6])),bs),
+                            _mm_sll_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&br.m_Data[(bp>>6)+1])),brs));
+    __m128i w=_mm_and_si128(wa,wb);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(w,_mm_setzero_si128()))!=0xFFFF) break;
+  }
+#endif
+  for(;i<end;i+=BITS)
+  {
+    Uint64 w=get_word_at(i+offset)&br.get_word_at(i+br_offset);
+    if (w) return i+get_first_one(w);
+  }
+  return -1;
+}
+
+void BitRow::assign(const Uint64* words)
+{
+  int n=get_word_count();
+  std::copy(words,words+n,m_Data.begin());
+  if ((m_Size&(BITS-1))!=0) m_Data[n-1]&=(Uint64(1)<<(m_Size&(BITS-1)))-1;
+  m_First=m_Size;
+  m_Last=0;
+  for(int i=0;i<n;++i)
+  {
+    if (!m_Data[i]) continue;
+    if (m_First==m_Size) m_First=i*BITS+get_first_one(m_Data[i]);
+    m_Last=i*BITS+get_last_one(m_Data[i])+1;
+  }
+}
+
 CollisionModel2D::CollisionModel2D(Bitmap image)
 {
   build(image);
@@ -12,6 +77,8 @@ void CollisionModel2D::build(Bitmap image)
   m_Grid.clear();
   m_Grid.resize(image.get_height(),BitRow(image.get_width()));
   m_Rect=iRect2(0,0,image.get_width(),image.get_height());
+  m_FirstRow=image.get_height();
+  m_LastRow=0;
   Uint32 ck=image.get_colorkey();
   int w=image.get_width(),h=image.get_height();
   //SDL_Surface* s=image.get_surface();
@@ -24,7 +91,84 @@ void CollisionModel2D::build(Bitmap image)
     {
       if (row[x]!=ck) br.set(x);
     }
+    if (!br.empty())
+    {
+      m_FirstRow=Min(m_FirstRow,y);
+      m_LastRow=y+1;
+    }
+  }
+  if (m_FirstRow>=m_LastRow) m_FirstRow=m_LastRow=0;
+}
+
+void CollisionModel2D::get_words(std::vector<Uint64>& words) const
+{
+  for(size_t y=0;y<m_Grid.size();++y)
+  {
+    const BitRow& br=m_Grid[y];
+    for(int i=0;i<br.get_word_count();++i)
+      words.push_back(br.get_word(i));
+  }
+}
+
+void CollisionModel2D::assign(int width, int height, const Uint64* words)
+{
+  m_Grid.clear();
+  m_Grid.resize(height,BitRow(width));
+  m_Rect=iRect2(0,0,width,height);
+  m_FirstRow=height;
+  m_LastRow=0;
+  for(int y=0;y<height;++y)
+  {
+    BitRow& br=m_Grid[y];
+    br.assign(words);
+    words+=br.get_word_count();
+    if (!br.empty())
+    {
+      m_FirstRow=Min(m_FirstRow,y);
+      m_LastRow=y+1;
+    }
+  }
+  if (m_FirstRow>=m_LastRow) m_FirstRow=m_LastRow=0;
+}
+
+collision_model_ptr CollisionModelCache::find(const xstring& key) const
+{
+  model_map::const_iterator it=m_Models.find(key);
+  if (it==m_Models.end()) return collision_model_ptr();
+  return it->second;
+}
+
+void CollisionModelCache::resolve(request_vec& requests)
+{
+  std::vector<Request*> build;
+  for(size_t i=0;i<requests.size();++i)
+  {
+    Request& r=requests[i];
+    collision_model_ptr& model=m_Models[r.key];
+    if (!model)
+    {
+      model.reset(new CollisionModel2D);
+      build.push_back(&r);
+    }
+    r.model=model;
+  }
+  if (build.empty()) return;
+  if (!m_Pool || build.size()==1)
+  {
+    for(size_t i=0;i<build.size();++i)
+      build[i]->model->build(build[i]->image);
+    return;
+  }
+  // Tasks only read the pixels, and the requests keep the bitmaps alive until all are done
+  SDL_sem* done=SDL_CreateSemaphore(0);
+  for(size_t i=0;i<build.size();++i)
+  {
+    Request* r=build[i];
+    m_Pool->push([r,done]() { r->model->build(r->image); SDL_SemPost(done); });
   }
+  for(size_t i=0;i<build.size();++i)
+    SDL_SemWait(done);
+  SDL_DestroySemaphore(done);
 }
 
 unsigned CollisionModel2D::get_bits(const iVec2& offset, int len) const
@@ -39,9 +183,11 @@ bool CollisionModel2D::test(const CollisionModel2D& o, iVec2& offset)
   iRect2 orect=o.m_Rect;
   orect+=offset;
   iRect2 overlap=m_Rect.overlap(orect);
-  int h=overlap.get_height();
   int oy=overlap.tl.y-offset.y;
-  for(int y=0;y<h;++y)
+  // Only rows where both models have bits need testing
+  int y0=Max(0,Max(m_FirstRow-overlap.tl.y,o.m_FirstRow-oy));
+  int h=Min(overlap.get_height(),Min(m_LastRow-overlap.tl.y,o.m_LastRow-oy));
+  for(int y=y0;y<h;++y)
   {
     const BitRow& br=get_row(y+overlap.tl.y);
     const BitRow& obr=o.get_row(oy+y);
@@ -55,7 +201,103 @@ bool CollisionModel2D::test(const CollisionModel2D& o, iVec2& offset)
   return false;
 }
 
-dVec2 RigidBody2D::get_collision_normal(CollisionModel2D& cm, const iVec2& offset)
+int KinematicsStore::add()
+{
+  if (!m_Free.empty())
+  {
+    int h=m_Free.back();
+    m_Free.pop_back();
+    return h;
+  }
+  int h=int(m_PX.size());
+  double_vec* all[] = { &m_PX, &m_PY, &m_VX, &m_VY, &m_AX, &m_AY, &m_Angle, &m_AVelocity, &m_AAcceleration };
+  for(int i=0;i<9;++i)
+    all[i]->push_back(0.0);
+  return h;
+}
+
+void KinematicsStore::remove(int h)
+{
+  set_position(h,dVec2(0,0));
+  set_velocity(h,dVec2(0,0));
+  set_acceleration(h,dVec2(0,0));
+  m_Angle[h]=m_AVelocity[h]=m_AAcceleration[h]=0;
+  m_Free.push_back(h);
+}
+
+namespace {
+  /** v+=a*DT, and then p+=v*DT, for n bodies */
+  void integrate_axis(double* p, double* v, const double* a, int n, double DT)
+  {
+    int i=0;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128d d=_mm_set1_pd(DT);
+    for(;i+2<=n;i+=2)
+    {
+      __m128d vi=_mm_add_pd(_mm_loadu_pd(v+i),_mm_mul_pd(_mm_loadu_pd(a+i),d));
+      _mm_storeu_pd(v+i,vi);
+      _mm_storeu_pd(p+i,_mm_add_pd(_mm_loadu_pd(p+i),_mm_mul_pd(vi,d)));
+    }
+#endif
+    for(;i<n;++i)
+    {
+      v[i]+=a[i]*DT;
+      p[i]+=v[i]*DT;
+    }
+  }
+}
+
+void KinematicsStore::integrate(int dt, int begin, int end)
+{
+  const double DT=dt*0.001;
+  const double TWO_PI=2.0*PI;
+  const int n=end-begin;
+  if (n<=0) return;
+  // Each pass streams through three arrays
+  integrate_axis(&m_Angle[begin],&m_AVelocity[begin],&m_AAcceleration[begin],n,DT);
+  double* w=&m_Angle[begin];
+  for(int i=0;i<n;++i)
+  {
+    // Same result as the fmod in RigidBody2D::advance, which only changes values out of range
+    if (w[i]>=TWO_PI || w[i]<=-TWO_PI) w[i]=fmod(w[i],TWO_PI);
+  }
+  integrate_axis(&m_PX[begin],&m_VX[begin],&m_AX[begin],n,DT);
+  integrate_axis(&m_PY[begin],&m_VY[begin],&m_AY[begin],n,DT);
+}
+
+void RigidBody2D::attach_kinematics(KinematicsStore* store)
+{
+  if (store==m_Kinematics) return;
+  detach_kinematics();
+  if (!store) return;
+  int h=store->add();
+  store->set_position(h,m_Position);
+  store->set_velocity(h,m_Velocity);
+  store->set_acceleration(h,m_Acceleration);
+  store->set_angle(h,m_Angle);
+  store->set_angular_velocity(h,m_AVelocity);
+  store->set_angular_acceleration(h,m_AAcceleration);
+  m_Kinematics=store;
+  m_Handle=h;
+}
+
+void RigidBody2D::detach_kinematics()
+{
+  if (!m_Kinematics) return;
+  KinematicsStore* store=m_Kinematics;
+  int h=m_Handle;
+  m_Position=store->get_position(h);
+  m_Velocity=store->get_velocity(h);
+  m_Acceleration=store->get_acceleration(h);
+  m_Angle=store->get_angle(h);
+  m_AVelocity=store->get_angular_velocity(h);
+  m_AAcceleration=store->get_angular_acceleration(h);
+  store->remove(h);
+  m_Kinematics=0;
+  m_Handle=-1;
+}
+
+dVec2 RigidBody2D::get_collision_normal(const CollisionModel2D& cm, const iVec2& offset)
 {
   unsigned w[] = { cm.get_bits(offset-iVec2(1,1),3),
                    cm.get_bits(offset-iVec2(1,0),3),
@@ -81,7 +323,7 @@ dVec2 RigidBody2D::get_collision_normal(CollisionModel2D& cm, const iVec2& offse
   return center.normalized();
 }
 
-void RigidBody2D::interact(RigidBody2D* o, int dt)
+bool RigidBody2D::prepare_contact(RigidBody2D* o, Contact2D& c)
 {
   RigidBody2D* rb1=this;
   RigidBody2D* rb2=o;
@@ -89,33 +331,52 @@ void RigidBody2D::interact(RigidBody2D* o, int dt)
 
   iRect2 r=rb1->get_rect();
   iRect2 r2=rb2->get_rect();
-  if (!r.overlapping(r2)) return;
+  if (!r.overlapping(r2)) return false;
 
-  CollisionModel2D& cm=rb1->get_col_model();
-  CollisionModel2D& ocm=rb2->get_col_model();
-  iVec2 offset=r2.tl-r.tl;
-  if (cm.test(ocm,offset))
-  {
-    dVec2 dir=rb1->get_collision_normal(cm,offset);
-    rb1->handle_collision(rb2,-dir);
-    rb2->handle_collision(rb1,dir);
-    /*
-    dVec2 dir=rb1->get_collision_normal(cm,offset);
-    SoundClip("boing.wav").play();
-
-    // Collision response test code.  Will be upgraded to more realistic physics
-    //dVec2 total_momentum=get_velocity()*get_mass() + o->get_velocity()*o->get_mass();
-    //double momentum_mag=total_momentum.magnitude();
-    //double new_mon2=momentum_mag/o->get_mass();
-
-
-    dVec2 v=rb2->get_velocity();
-    dVec2 nv=(v*dir)*dir;
-    v-=2*nv;
-    rb2->offset_position(-rb2->get_velocity()*(dt*0.001));
-    rb2->set_velocity(v);
-    */
-  }
+  c.body1=rb1;
+  c.body2=rb2;
+  c.model1=&rb1->get_col_model();
+  c.model2=&rb2->get_col_model();
+  c.offset=r2.tl-r.tl;
+  c.hit=false;
+  return true;
+}
+
+void RigidBody2D::test_contact(Contact2D& c)
+{
+  c.hit=c.model1->test(*c.model2,c.offset);
+  if (c.hit) c.normal=get_collision_normal(*c.model1,c.offset);
+}
+
+void RigidBody2D::respond(const Contact2D& c)
+{
+  if (!c.hit) return;
+  c.body1->handle_collision(c.body2,-c.normal);
+  c.body2->handle_collision(c.body1,c.normal);
+  /*
+  dVec2 dir=rb1->get_collision_normal(cm,offset);
+  SoundClip("boing.wav").play();
+
+  // Collision response test code.  Will be upgraded to more realistic physics
+  //dVec2 total_momentum=get_velocity()*get_mass() + o->get_velocity()*o->get_mass();
+  //double momentum_mag=total_momentum.magnitude();
+  //double new_mon2=momentum_mag/o->get_mass();
+
+
+  dVec2 v=rb2->get_velocity();
+  dVec2 nv=(v*dir)*dir;
+  v-=2*nv;
+  rb2->offset_position(-rb2->get_velocity()*(dt*0.001));
+  rb2->set_velocity(v);
+  */
+}
+
+void RigidBody2D::interact(RigidBody2D* o, int dt)
+{
+  Contact2D c;
+  if (!prepare_contact(o,c)) return;
+  test_contact(c);
+  respond(c);
 }
 
 
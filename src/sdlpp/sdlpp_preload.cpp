@@ -0,0 +1,254 @@
+#include <sdlpp_preload.h>
+#include <sdlpp_io.h>
+
+namespace SDLPP
+{
+
+  Preloader::Preloader(int threads)
+    : m_Mutex(SDL_CreateMutex())
+    , m_PendingSprites(0)
+    , m_Total(0)
+    , m_Finished(0)
+    , m_Completed(0)
+    , m_Pool(threads)
+  {
+    // Resolve the image loader on this thread, since the library lookup table
+    // is not safe to modify from the workers.
+    get_function("SDL2_image", "IMG_LoadBMP_RW");
+  }
+
+  Preloader::~Preloader()
+  {
+    m_Pool.wait_idle();
+    for (LoadedBitmap& lb : m_Bitmaps)
+      SDL_FreeSurface(lb.surface);
+    for (LoadedSprite& ls : m_Sprites)
+      delete ls.root;
+    SDL_DestroyMutex(m_Mutex);
+  }
+
+  void Preloader::add_manifest(const xstring& manifest_name)
+  {
+    xstring text = read_contents_as_string(manifest_name);
+    if (text.empty())
+      THROW("Manifest not found: " << manifest_name);
+    xstring_tokenizer st(text, " \t\r\n");
+    str_vec bitmaps;
+    while (st.has_more_tokens())
+    {
+      xstring name = st.get_next_token();
+      if (name.ends_with(".xml")) add_sprite(name);
+      else
+      if (BitmapLoader::is_image(name)) bitmaps.push_back(name);
+    }
+    for (const xstring& name : bitmaps)
+      add_bitmap(name);
+  }
+
+  void Preloader::add_sprite(const xstring& name)
+  {
+    if (SpriteCache::instance()->is_loaded(name)) return;
+    MutexLock lock(m_Mutex);
+    ++m_Total;
+    ++m_PendingSprites;
+    m_Pool.push([this, name]() { load_sprite(name); });
+  }
+
+  void Preloader::add_bitmap(const xstring& name)
+  {
+    if (BitmapCache::instance()->is_loaded(name)) return;
+    MutexLock lock(m_Mutex);
+    if (m_PendingSprites > 0)
+      m_Deferred.push_back(name);
+    else
+      request_bitmap(name, false, 0);
+  }
+
+  /** Must be called with the mutex locked */
+  void Preloader::request_bitmap(const xstring& name, bool use_key, Uint32 color_key)
+  {
+    if (!m_Requested.insert(name).second) return;
+    ++m_Total;
+    m_Pool.push([this, name, use_key, color_key]() { load_bitmap(name, use_key, color_key); });
+  }
+
+  /** Must be called with the mutex locked */
+  void Preloader::release_deferred()
+  {
+    for (const xstring& name : m_Deferred)
+      request_bitmap(name, false, 0);
+    m_Deferred.clear();
+  }
+
+  void Preloader::load_sprite(const xstring& name)
+  {
+    xml_element* root = 0;
+    str_vec images;
+    Uint32 color_key = 0;
+    std::shared_ptr<CompiledSprite> compiled(new CompiledSprite);
+    if (compiled->load(name))
+    {
+      color_key = compiled->get_color_key();
+      compiled->get_images(images);
+    }
+    else
+    {
+      compiled.reset();
+      try
+      {
+        root = load_xml(name);
+      }
+      catch (...)
+      {
+      }
+    }
+    bool is_sprite = (compiled || (root && root->get_type() == "Animation"));
+    if (root && is_sprite)
+    {
+      color_key = Uint32(atoi(root->get_attribute("ColorKey").c_str()));
+      for (xml_element* sequence : *root)
+      {
+        if (sequence->get_type() != "Sequence") continue;
+        for (xml_element* frame : *sequence)
+        {
+          if (frame->get_type() != "Frame") continue;
+          xstring image = frame->get_attribute("Image");
+          if (std::find(images.begin(), images.end(), image) == images.end())
+            images.push_back(image);
+        }
+      }
+    }
+    MutexLock lock(m_Mutex);
+    if (is_sprite)
+    {
+      for (const xstring& image : images)
+        request_bitmap(image, true, color_key);
+      LoadedSprite ls;
+      ls.name = name;
+      ls.root = root;
+      ls.compiled = compiled;
+      ls.images = images;
+      m_Sprites.push_back(ls);
+    }
+    else
+    {
+      // Not found, or some other XML (configuration etc.)
+      if (!root) m_NewErrors.push_back(name);
+      delete root;
+      ++m_Completed;
+    }
+    ++m_Finished;
+    if (--m_PendingSprites == 0) release_deferred();
+  }
+
+  void Preloader::load_bitmap(const xstring& name, bool use_key, Uint32 color_key)
+  {
+    SDL_Surface* s = 0;
+    try
+    {
+      s = BitmapLoader::decode(name);
+    }
+    catch (...)
+    {
+    }
+    if (s && use_key) SDL_SetColorKey(s, 1, color_key);
+    MutexLock lock(m_Mutex);
+    ++m_Finished;
+    if (s)
+    {
+      LoadedBitmap lb;
+      lb.name = name;
+      lb.surface = s;
+      m_Bitmaps.push_back(lb);
+    }
+    else
+    {
+      m_NewErrors.push_back(name);
+      ++m_Completed;
+    }
+  }
+
+  bool Preloader::sprite_ready(const LoadedSprite& ls, bool all_done)
+  {
+    if (all_done) return true;
+    BitmapCache* bc = BitmapCache::instance();
+    for (const xstring& image : ls.images)
+      if (!bc->is_loaded(image)) return false;
+    return true;
+  }
+
+  bool Preloader::poll()
+  {
+    std::vector<LoadedBitmap> bitmaps;
+    std::list<LoadedSprite> sprites;
+    bool all_done;
+    {
+      MutexLock lock(m_Mutex);
+      bitmaps.swap(m_Bitmaps);
+      sprites.swap(m_Sprites);
+      m_Errors.insert(m_Errors.end(), m_NewErrors.begin(), m_NewErrors.end());
+      m_NewErrors.clear();
+      all_done = (m_Finished == m_Total);
+    }
+    BitmapCache* bc = BitmapCache::instance();
+    for (LoadedBitmap& lb : bitmaps)
+    {
+      if (bc->is_loaded(lb.name)) SDL_FreeSurface(lb.surface);
+      else bc->insert(lb.name, Bitmap(bitmap_pixels_ptr(new BitmapPixels(lb.surface))));
+    }
+    int published = int(bitmaps.size());
+    std::list<LoadedSprite>::iterator it = sprites.begin();
+    while (it != sprites.end())
+    {
+      if (!sprite_ready(*it, all_done)) { ++it; continue; }
+      SpriteCache* sc = SpriteCache::instance();
+      if (!sc->is_loaded(it->name))
+      {
+        try
+        {
+          Sprite s;
+          if (it->compiled) it->compiled->build(s);
+          else SpriteLoader::build(it->root, s);
+          sc->insert(it->name, s);
+        }
+        catch (const xstring&)
+        {
+          m_Errors.push_back(it->name);
+        }
+      }
+      delete it->root;
+      it = sprites.erase(it);
+      ++published;
+    }
+    MutexLock lock(m_Mutex);
+    m_Sprites.splice(m_Sprites.end(), sprites);
+    m_Completed += published;
+    return m_Completed == m_Total && m_Sprites.empty() && m_Bitmaps.empty();
+  }
+
+  void Preloader::wait()
+  {
+    m_Pool.wait_idle();
+    poll();
+  }
+
+  int Preloader::get_total() const
+  {
+    MutexLock lock(m_Mutex);
+    return m_Total;
+  }
+
+  int Preloader::get_completed() const
+  {
+    MutexLock lock(m_Mutex);
+    return m_Completed;
+  }
+
+  double Preloader::get_progress() const
+  {
+    MutexLock lock(m_Mutex);
+    if (m_Total == 0) return 1.0;
+    return double(m_Completed) / m_Total;
+  }
+
+} // namespace SDLPP
@@ -8,7 +8,7 @@ namespace SDLPP {
 static std::ofstream* flog=0;
 static const int FRAMES = 32;
 static const int BUFFER_SIZE = SOUND_BUFFER_SIZE;
-Accumulator<int> SoundManager::s_MixingBuffer(BUFFER_SIZE);
+int_vec SoundManager::s_MixingBuffer(BUFFER_SIZE);
 
 namespace {
   class LogInit
@@ -71,16 +71,62 @@ namespace SDL_sound {
 }
 
 
+namespace {
+  const Uint32 PCM_MAGIC = 0x4D435053;  // "SPCM"
+
+  /** Header of a converted clip resource.  The samples follow it */
+  struct PcmHeader
+  {
+    Uint32 magic;
+    Uint32 freq;
+    Uint32 channels;
+    Uint32 format;
+  };
+
+  /** Loads a WAV and converts it to the given format */
+  void load_wav(SDL_RWops* rwops, const char* name, int freq, int channels,
+                SDL_AudioFormat format, uint8_vec& buffer)
+  {
+    SDL_AudioSpec wav_spec;
+    Uint8* wave=0;
+    Uint32 length;
+    if (!SDL_LoadWAV_RW(rwops, 1, &wav_spec, &wave, &length))
+      THROW("File not found " << name);
+    SDL_AudioCVT cvt;
+    if (SDL_BuildAudioCVT(&cvt,wav_spec.format,wav_spec.channels,wav_spec.freq,
+                          format,channels,freq) < 0)
+    {
+      SDL_FreeWAV(wave);
+      THROW("WAV format cannot be converted to match audio hardware: " << name);
+    }
+    buffer.resize(cvt.needed ? length*cvt.len_mult : length);
+    std::copy(wave, wave + length, buffer.begin());
+    SDL_FreeWAV(wave);
+    if (cvt.needed && length>0)
+    {
+      cvt.len=length;
+      cvt.buf=&buffer[0];
+      if (SDL_ConvertAudio(&cvt) < 0)
+        THROW("Failed to convert " << name << ": " << SDL_GetError());
+      buffer.resize(cvt.len_cvt);
+    }
+  }
+}
+
 SoundClip::SoundClip(const xstring& filename)
-: m_Wave(0)
+: m_Peak(0)
 {
   ResourceFile* rf = get_default_resource_file();
   if (rf && !filename.empty())
   {
-    SDL_RWops* rw=rf->get(filename);
-    if (!rw) 
-      THROW ("Resource not found: "+filename);
-    load_from_rwop(rw,filename);
+    if (!load_converted(rf,filename))
+    {
+      SDL_RWops* rw=rf->get(filename);
+      if (!rw) 
+        THROW ("Resource not found: "+filename);
+      load_from_rwop(rw,filename);
+    }
+    compute_peak();
   }
   else
     THROW("Resource not found: " + filename);
@@ -93,39 +139,59 @@ SoundClip::~SoundClip()
 
 void SoundClip::destroy()
 {
-  if (m_Wave)
-  {
-    SDL_FreeWAV(m_Wave);
-    m_Wave = 0;
-  }
   m_Buffer.clear();
 }
 
 void SoundClip::load_from_rwop(SDL_RWops* rwops, const char* name)
 {
   SDL_AudioSpec *spec=SoundManager::instance()->get_audio_spec();
-  SDL_AudioSpec wav_spec;
-  Uint32 length;
-  if (!SDL_LoadWAV_RW(rwops, 1, &wav_spec, &m_Wave, &length))
-    THROW("File not found " << name);
-  if (spec->format     != wav_spec.format     ||
-      spec->channels   != wav_spec.channels   || 
-      spec->freq       != wav_spec.freq)
-  {
-    SDL_AudioCVT cvt;
-    if (SDL_BuildAudioCVT(&cvt,wav_spec.format,wav_spec.channels,wav_spec.freq,
-                          spec->format,spec->channels,spec->freq) < 0)
-      THROW("WAV format cannot be converted to match audio hardware: " << name);    
-    cvt.len=length;
-    int new_len=length * cvt.len_mult;
-    m_Buffer.resize(new_len);
-    //Uint8* new_buffer=new Uint8[new_len];
-    std::copy(m_Wave, m_Wave + length, &m_Buffer[0]);
-    SDL_FreeWAV(m_Wave);
-    m_Wave = 0;
-    cvt.buf=&m_Buffer[0];
-    int rc=SDL_ConvertAudio(&cvt);
-  }
+  load_wav(rwops,name,spec->freq,spec->channels,spec->format,m_Buffer);
+}
+
+bool SoundClip::load_converted(ResourceFile* rf, const xstring& name)
+{
+  char_vec cv;
+  if (!rf->read_contents(name+".pcm",cv) || cv.size()<sizeof(PcmHeader)) return false;
+  PcmHeader h;
+  memcpy(&h,&cv[0],sizeof(h));
+  SDL_AudioSpec *spec=SoundManager::instance()->get_audio_spec();
+  if (h.magic!=PCM_MAGIC || int(h.freq)!=spec->freq ||
+      h.channels!=spec->channels || h.format!=spec->format) 
+    return false;
+  m_Buffer.assign(cv.begin()+sizeof(h),cv.end());
+  return true;
+}
+
+void SoundClip::write_converted(ResourceFileWriter& w, const xstring& name, int freq, bool stereo,
+                                ResourceCodec codec)
+{
+  ResourceFile* rf = get_default_resource_file();
+  SDL_RWops* rw = (rf ? rf->get(name) : SDL_RWFromFile(name, "rb"));
+  if (!rw)
+    THROW("Resource not found: " << name);
+  PcmHeader h = { PCM_MAGIC, Uint32(freq), Uint32(stereo ? 2 : 1), AUDIO_S16 };
+  uint8_vec buffer;
+  load_wav(rw,name,h.freq,h.channels,AUDIO_S16,buffer);
+  uint8_vec data(sizeof(h)+buffer.size());
+  memcpy(&data[0],&h,sizeof(h));
+  std::copy(buffer.begin(),buffer.end(),data.begin()+sizeof(h));
+  xstring pcm_name=name+".pcm";
+  w.add_resource(pcm_name.c_str(),(const char*)&data[0],int(data.size()),codec);
+}
+
+void SoundClip::compute_peak()
+{
+  m_Peak=0;
+  const short* sbuf=(const short*)(m_Buffer.empty() ? 0 : &m_Buffer[0]);
+  int n=int(m_Buffer.size()/2);
+  for(int i=0;i<n;++i)
+    m_Peak=Max(m_Peak,std::abs(int(sbuf[i])));
+}
+
+bool SoundClipLoader::load(const xstring& name, sound_clip_ptr& clip)
+{
+  clip.reset(new SoundClip(name));
+  return true;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -154,138 +220,227 @@ SoundStream::~SoundStream()
 void SoundStream::stop()
 {
   m_Data->m_Finished=true;
-  while (!m_Data->m_ThreadDone) SDL_Delay(10);
+  StreamDecoder::instance()->remove(this);
+  m_Data->m_DecodeDone=true;
+}
+
+bool SoundStream::prefill(int frames)
+{
+  int bytes=Min(frames*BUFFER_SIZE*2,m_Data->m_Ring.capacity()-BUFFER_SIZE);
+  return StreamDecoder::instance()->wait_for(this,bytes);
 }
 
 void SoundStream::destroy()
 {
-  delete[] m_Data->m_Buffer;
-  m_Data->m_Buffer=0;
+  stop();
   //if (m_Data->m_State.sample) SDL_sound::Wrapper.free_sample(m_Data->m_State);
   if (m_Data->m_Decoder) m_Data->m_Decoder->destroy();
   delete m_Data;
   m_Data=0;
 }
 
-int SoundStream::frames_available()
+bool SoundStream::is_finished() const
 {
-  int diff=m_Data->m_Stop-m_Data->m_Start;
-  if (diff<0) diff+=FRAMES*BUFFER_SIZE*2;
-  return diff/(BUFFER_SIZE*2);
+  // Check the flag first, so that the last data written is visible
+  return m_Data->m_DecodeDone && m_Data->m_Ring.size()==0;
 }
 
-int SoundStream::frames_to_fill()
+bool SoundStream::needs_decode() const
 {
-  return FRAMES-1-frames_available();
+  return !m_Data->m_DecodeDone && m_Data->m_Ring.space()>=BUFFER_SIZE;
 }
 
 Uint8* SoundStream::get_frame(int bytes)
 {
-  int fa=frames_available();
-  if (fa > 0)
+  bool done=m_Data->m_DecodeDone;
+  uint8_vec& frame=m_Data->m_Frame;
+  if (int(frame.size())!=bytes) frame.resize(bytes);
+  int n=m_Data->m_Ring.read(&frame[0],bytes);
+  if (n<bytes)
   {
-    Uint8* frame=&m_Data->m_Buffer[m_Data->m_Start];
-    if (0)
+    if (done && n==0) return 0;
+    if (!done)
     {
-      static std::ofstream fout("gf_dump.raw",std::ios::out|std::ios::binary);
-      fout.write((char*)frame,BUFFER_SIZE*2);
+      ++m_Data->m_Underruns;
+      if (flog) *flog << "Stream under-run: " << n << '/' << bytes << std::endl;
     }
-    //m_Data->m_Start+=BUFFER_SIZE*2;
-    m_Data->m_Start+=bytes;
-    if (m_Data->m_Start>=(BUFFER_SIZE*2*FRAMES)) 
-    {
-      if (flog) *flog << "Rewinding start ptr from: " << m_Data->m_Start 
-                      << " / " << (BUFFER_SIZE*2*FRAMES) << std::endl;
-      m_Data->m_Start=0;
-    }
-    //SDL_SemPost(m_Data->m_Semaphore);
-    return frame;
+    std::fill(frame.begin()+n,frame.end(),Uint8(0));
   }
-  return 0;
+  if (0)
+  {
+    static std::ofstream fout("gf_dump.raw",std::ios::out|std::ios::binary);
+    fout.write((char*)&frame[0],bytes);
+  }
+  StreamDecoder::instance()->wake();
+  return &frame[0];
 }
 
-int SoundStream::decode_thread()
+void SoundStream::decode_chunk()
 {
-  int rc=0;
-  m_Data->m_Decoder=SDL_sound::MP3DecoderWrapper::instance()->create();
-  if (!m_Data->m_Decoder)
+  if (m_Data->m_Finished)
   {
-    if (flog) *flog << "Could not create decoder.\n";
-    m_Data->m_Finished=true;
+    m_Data->m_DecodeDone=true;
+    return;
   }
-  unsigned char src_buffer[BUFFER_SIZE];
-  //unsigned char tmp_buf[BUFFER_SIZE];
-  //unsigned      tmp_buf_size=0;
-  while (!m_Data->m_Finished)
+  if (!m_Data->m_Decoder)
   {
-    if (frames_to_fill()<=2)
+    m_Data->m_Decoder=SDL_sound::MP3DecoderWrapper::instance()->create();
+    if (!m_Data->m_Decoder)
     {
-      SDL_Delay(10);
-      continue;
-      //if ((rc=SDL_SemWait(m_Data->m_Semaphore)) < 0) break;
+      if (flog) *flog << "Could not create decoder.\n";
+      m_Data->m_DecodeDone=true;
+      return;
     }
-    Uint8* dst=&(m_Data->m_Buffer[m_Data->m_Stop]);
+  }
+  unsigned char src_buffer[BUFFER_SIZE];
+  Uint8 pcm[BUFFER_SIZE];
+  // Output left over from previous input comes first
+  unsigned act=BUFFER_SIZE;
+  m_Data->m_Decoder->decode(0,0,pcm,&act);
+  unsigned filled=act;
+  bool eof=false;
+  while (filled<BUFFER_SIZE)
+  {
+    unsigned input_size=unsigned(m_Data->m_Source->read(m_Data->m_Source,src_buffer,1,BUFFER_SIZE));
     if (flog)
     {
-      //*flog << "start=" << m_Data->m_Start << "   stop=" << m_Data->m_Stop << std::endl;
-      //*flog << "FA=" << frames_available() << std::endl;
+      *flog << "Reading " << input_size << " bytes from file." << std::endl;
     }
-    unsigned missing=0,act=BUFFER_SIZE;
-    m_Data->m_Decoder->decode(0,0,dst,&act);
-    if (act<BUFFER_SIZE)
-    {
-      if (flog)
-        *flog << "Decoded only " << act << " bytes.  Completing to BUFFER_SIZE" << std::endl;
-      m_Data->m_Stop+=act;
-      dst+=act;
-      missing=BUFFER_SIZE-act;
-      act=0;
-    }
-    while (act==0)
-    {
-      unsigned input_size=m_Data->m_Source->read(m_Data->m_Source,src_buffer,1,BUFFER_SIZE);
-      if (flog)
-      {
-        *flog << "Reading " << input_size << " bytes from file." << std::endl;
-      }
-      if (input_size==0) break; // EOF
-      if (missing>0) act=missing;
-      else           act=BUFFER_SIZE;
-      m_Data->m_Decoder->decode(src_buffer,input_size,dst,&act);
-    }
-
-    if (flog && act>0)
-      *flog << "Decoded " << act << " bytes" << std::endl;
-    m_Data->m_Stop+=act;
-    if (m_Data->m_Stop>=(BUFFER_SIZE*2*FRAMES)) m_Data->m_Stop=0;
+    if (input_size==0) { eof=true; break; }
+    act=BUFFER_SIZE-filled;
+    m_Data->m_Decoder->decode(src_buffer,input_size,pcm+filled,&act);
+    filled+=act;
   }
-  m_Data->m_ThreadDone=true;
-  if (flog) *flog << "Thread exiting\n";
-  return rc;
-}
 
-struct SoundStream_Thread
-{
-  static int thread(void* stream)
+  if (flog && filled>0)
+    *flog << "Decoded " << filled << " bytes" << std::endl;
+  m_Data->m_Ring.write(pcm,int(filled));
+  if (eof)
   {
-    SoundStream* s=(SoundStream*)stream;
-    return s->decode_thread();
+    if (flog) *flog << "Stream decoded\n";
+    m_Data->m_DecodeDone=true;
   }
-};
+}
 
 void SoundStream::load_from_rwop(SDL_RWops* rwops, const char* name)
 {
   m_Data->m_Source=rwops;
-  SDL_CreateThread(SoundStream_Thread::thread,"SoundStream",this);
-  SDL_Delay(200);
+  StreamDecoder::instance()->add(this);
 }
 
 void SoundStream::load(const xstring& filename)
 {
   SDL_RWops* rw = SDL_RWFromFile(filename, "rb");
+  if (!rw)
+    THROW("File not found " << filename);
   load_from_rwop(rw,filename);
 }
 
+////////////////////////////////////////////////////////////////////
+
+StreamDecoder::StreamDecoder()
+: m_Thread(0),
+  m_Mutex(SDL_CreateMutex()),
+  m_Progress(SDL_CreateCond()),
+  m_Wakeup(SDL_CreateSemaphore(0)),
+  m_Stop(false)
+{}
+
+StreamDecoder::~StreamDecoder()
+{
+  shutdown();
+  SDL_DestroySemaphore(m_Wakeup);
+  SDL_DestroyCond(m_Progress);
+  SDL_DestroyMutex(m_Mutex);
+}
+
+void StreamDecoder::shutdown()
+{
+  if (!m_Thread) return;
+  {
+    MutexLock lock(m_Mutex);
+    m_Stop=true;
+    SDL_CondBroadcast(m_Progress);
+  }
+  wake();
+  SDL_WaitThread(m_Thread,0);
+  m_Thread=0;
+}
+
+void StreamDecoder::add(SoundStream* stream)
+{
+  MutexLock lock(m_Mutex);
+  if (!m_Thread && !m_Stop)
+  {
+    m_Thread=SDL_CreateThread(thread_main,"StreamDecoder",this);
+    if (!m_Thread) THROW("Failed to create stream decoder thread: " << SDL_GetError());
+  }
+  m_Streams.push_back(stream);
+  wake();
+}
+
+void StreamDecoder::remove(SoundStream* stream)
+{
+  MutexLock lock(m_Mutex);
+  std::vector<SoundStream*>::iterator it=std::find(m_Streams.begin(),m_Streams.end(),stream);
+  if (it!=m_Streams.end()) m_Streams.erase(it);
+  SDL_CondBroadcast(m_Progress);
+}
+
+bool StreamDecoder::wait_for(SoundStream* stream, int bytes)
+{
+  MutexLock lock(m_Mutex);
+  const SpscRing<Uint8>& ring=stream->m_Data->m_Ring;
+  while (!m_Stop && ring.size()<bytes && !stream->m_Data->m_DecodeDone &&
+         std::find(m_Streams.begin(),m_Streams.end(),stream)!=m_Streams.end())
+    SDL_CondWait(m_Progress,m_Mutex);
+  return ring.size()>=bytes;
+}
+
+int SDLCALL StreamDecoder::thread_main(void* decoder)
+{
+  static_cast<StreamDecoder*>(decoder)->run();
+  return 0;
+}
+
+SoundStream* StreamDecoder::pick() const
+{
+  SoundStream* best=0;
+  float best_fill=1.0f;
+  for(SoundStream* s : m_Streams)
+  {
+    if (!s->needs_decode()) continue;
+    float fill=s->get_fill();
+    if (!best || fill<best_fill)
+    {
+      best=s;
+      best_fill=fill;
+    }
+  }
+  return best;
+}
+
+void StreamDecoder::run()
+{
+  SDL_LockMutex(m_Mutex);
+  while (!m_Stop)
+  {
+    SoundStream* s=pick();
+    if (!s)
+    {
+      // Every buffer is full.  Sleep until the audio callback takes a frame
+      SDL_UnlockMutex(m_Mutex);
+      SDL_SemWait(m_Wakeup);
+      SDL_LockMutex(m_Mutex);
+      continue;
+    }
+    s->decode_chunk();
+    SDL_CondBroadcast(m_Progress);
+  }
+  SDL_UnlockMutex(m_Mutex);
+}
+
+
 
 
 
@@ -295,59 +450,244 @@ void SoundStream::load(const xstring& filename)
 
 
 
-void SoundManager::cleanup()
+void VoicePool::resize(int capacity)
 {
-  clip_seq::iterator b=m_Clips.begin(),e=m_Clips.end();
-  while(b!=e)
+  m_Voices.assign(capacity,Voice());
+  m_Active.clear();
+  m_Active.reserve(capacity);
+  m_Free.clear();
+  m_Free.reserve(capacity);
+  for(int i=capacity-1;i>=0;--i) m_Free.push_back(i);
+  m_Serial=0;
+}
+
+VoicePool::Voice* VoicePool::allocate(StealPolicy policy, int priority)
+{
+  Voice* v=0;
+  if (!m_Free.empty())
   {
-    SoundClipState& scs=*b;
-    if (scs.pos<0) b=m_Clips.erase(b);
-    else ++b;
+    int index=m_Free.back();
+    m_Free.pop_back();
+    m_Active.push_back(index);
+    v=&m_Voices[index];
   }
+  else
+  {
+    v=find_victim(policy,priority);
+    if (!v) return 0;
+  }
+  v->pos=0;
+  v->priority=priority;
+  v->serial=m_Serial++;
+  return v;
+}
+
+void VoicePool::free(int i)
+{
+  m_Free.push_back(m_Active[i]);
+  m_Active[i]=m_Active.back();
+  m_Active.pop_back();
+}
+
+VoicePool::Voice* VoicePool::find_victim(StealPolicy policy, int priority)
+{
+  Voice* best=0;
+  for(int i=0;i<size();++i)
+  {
+    Voice& v=active(i);
+    if (!best) { best=&v; continue; }
+    // Serial numbers wrap, so compare their difference
+    bool older=Sint32(v.serial-best->serial)<0;
+    switch (policy)
+    {
+      case STEAL_QUIETEST:
+      {
+        float l=v.clip->get_peak()*v.params.gain,bl=best->clip->get_peak()*best->params.gain;
+        if (l<bl || (l==bl && older)) best=&v;
+        break;
+      }
+      case STEAL_PRIORITY:
+        if (v.priority<best->priority || (v.priority==best->priority && older)) best=&v;
+        break;
+      default:
+        if (older) best=&v;
+    }
+  }
+  if (best && policy==STEAL_PRIORITY && best->priority>priority) return 0;
+  return best;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void SoundManager::cleanup()
+{
   stream_seq::iterator sb=m_Streams.begin(),se=m_Streams.end();
   while(sb!=se)
   {
     sound_stream_ptr s=*sb;
-    if (s->frames_available()==0) sb=m_Streams.erase(sb);
+    if (s->is_finished()) sb=m_Streams.erase(sb);
     else ++sb;
   }
 }
 
+void SoundManager::send(const Command& cmd)
+{
+  if (!m_Commands || m_Commands->write(&cmd,1)==1) return;
+  if (cmd.type==Command::PLAY)
+  {
+    m_Dropped.fetch_add(1,std::memory_order_relaxed);
+    if (flog) *flog << "Sound command queue full.  Dropping command\n";
+    return;
+  }
+  // Control commands must not be lost.  The queue is full, so the audio thread
+  // is behind or paused: run its queued commands here under the audio lock,
+  // which keeps the callback out, and queue this one behind them.
+  if (flog) *flog << "Sound command queue full.  Processing commands\n";
+  SDL_LockAudio();
+  process_commands();
+  m_Commands->write(&cmd,1);
+  SDL_UnlockAudio();
+}
+
+void SoundManager::release_retired()
+{
+  if (!m_Retired) return;
+  sound_clip_ptr clip;
+  while (m_Retired->read(&clip,1)==1)
+    clip.reset();
+}
+
+void SoundManager::retire(sound_clip_ptr& clip)
+{
+  // The retired ring is large enough for every voice and every queued command,
+  // so the last reference is always dropped on the game thread.
+  if (clip) m_Retired->write(&clip,1);
+  clip.reset();
+}
+
+void SoundManager::process_commands()
+{
+  VoicePool::StealPolicy policy=get_steal_policy();
+  Command cmd;
+  while (m_Commands->read(&cmd,1)==1)
+  {
+    if (cmd.type==Command::SET_PARAMS || cmd.type==Command::STOP)
+    {
+      VoicePool::Voice* v=find_voice(cmd.id);
+      if (!v) continue;
+      if (cmd.type==Command::STOP) v->pos=-1.0;  // Freed when mixing
+      else                         v->params=cmd.params;
+      continue;
+    }
+    if (cmd.type==Command::STOP_ALL)
+    {
+      while (m_Voices.size()>0)
+      {
+        retire(m_Voices.active(0).clip);
+        m_Voices.free(0);
+      }
+      m_Fading=false;
+      m_Gain=1.0;
+      m_dGain=0.0;
+      continue;
+    }
+    VoicePool::Voice* v=m_Voices.allocate(policy,cmd.priority);
+    if (!v)
+    {
+      m_Dropped.fetch_add(1,std::memory_order_relaxed);
+      retire(cmd.clip);
+      continue;
+    }
+    if (v->clip) m_Steals.fetch_add(1,std::memory_order_relaxed);
+    retire(v->clip);
+    v->clip=std::move(cmd.clip);
+    v->loop=cmd.loop;
+    v->id=cmd.id;
+    v->params=cmd.params;
+  }
+}
+
+VoicePool::Voice* SoundManager::find_voice(int id)
+{
+  for(int i=0;i<m_Voices.size();++i)
+  {
+    VoicePool::Voice& v=m_Voices.active(i);
+    if (v.id==id) return &v;
+  }
+  return 0;
+}
+
+void SoundManager::mix_voice(VoicePool::Voice& v, int* mix, int samples, const MixKernels& kernels)
+{
+  if (v.pos<0) return;
+  int channels=m_Spec.channels;
+  MixSource src;
+  src.data=(v.clip->m_Buffer.empty() ? 0 : (const short*)(&v.clip->m_Buffer[0]));
+  src.frames=int(v.clip->m_Buffer.size()/2)/channels;
+  src.channels=channels;
+  src.loop=v.loop;
+  if (flog) *flog << v.pos << '/' << src.frames << "    ";
+  if (v.params.is_unity() && v.pos==floor(v.pos))
+  {
+    // Natural rate and level, so the samples are added as they are
+    int slen=src.frames*channels;
+    int spos=int(v.pos)*channels;
+    int done=0;
+    while (done<samples && spos<slen)
+    {
+      int n=Min(samples-done,slen-spos);
+      kernels.accumulate(mix+done,src.data+spos,n);
+      done+=n;
+      spos+=n;
+      if (spos>=slen && v.loop) spos=0;
+    }
+    v.pos=(spos>=slen ? -1.0 : double(spos/channels));
+    return;
+  }
+  float gains[8];
+  std::fill(gains,gains+8,v.params.gain);
+  if (channels==2)
+  {
+    gains[0]*=Min(1.0f,1.0f-v.params.pan);
+    gains[1]*=Min(1.0f,1.0f+v.params.pan);
+  }
+  v.pos=mix_resampled(mix,samples/channels,src,v.pos,v.params.rate,gains,get_resample_mode());
+}
+
 void SoundManager::AudioCallback(Uint8 *stream, int len)
 {
-  int start_ticks=SDL_GetTicks(),stop_ticks=0;
+  Uint64 start=SDL_GetPerformanceCounter();
   int samples=len/2; // 16 bit samples
   if (int(s_MixingBuffer.size()) != samples)
     s_MixingBuffer.resize(samples);
-  s_MixingBuffer.reset();
-  int max_samples=0;
-  for(auto& scs : m_Clips)
+  std::fill(s_MixingBuffer.begin(),s_MixingBuffer.end(),0);
+  int* mix=&s_MixingBuffer[0];
+  const MixKernels& kernels=get_mix_kernels();
+  process_commands();
+  for(int i=0;i<m_Voices.size();)
   {
-    if (scs.pos<0) continue;
-    short* sbuf=(short*)(&scs.clip->m_Buffer[0]);
-    int    slen = scs.clip->m_Buffer.size() / 2;
-    int    spos=scs.pos/2;
-    if (flog) *flog << spos << '/' << slen << "    ";
-    BufferReader<short> br(sbuf,slen,spos,scs.loop);
-    s_MixingBuffer.start_sequence();
-    int n=s_MixingBuffer.acc_data(br.current(),br.end());
-    br.advance(n);
-    scs.pos=br.get_position()*2;
-    if (scs.pos>=int(scs.clip->m_Buffer.size())) scs.pos=-1;
+    VoicePool::Voice& v=m_Voices.active(i);
+    mix_voice(v,mix,samples,kernels);
+    if (v.pos<0)
+    {
+      retire(v.clip);
+      m_Voices.free(i);
+    }
+    else ++i;
   }
   if (flog) *flog << std::endl;
+  int min_fill=1000;
   stream_seq::iterator sb=m_Streams.begin(),se=m_Streams.end();
   while (sb!=se)
   {
     sound_stream_ptr s=*sb;
+    int underruns=s->get_underruns();
     Uint8* buffer=s->get_frame(len);
     if (buffer)
     {
-      short* sbuf=(short*)buffer;
-      //int slen=BUFFER_SIZE;
-      int slen=samples;
-      s_MixingBuffer.start_sequence();
-      s_MixingBuffer.acc_data(sbuf,sbuf+slen);
+      kernels.accumulate(mix,(const short*)buffer,samples);
+      if (s->get_underruns()!=underruns) m_Underruns.fetch_add(1,std::memory_order_relaxed);
+      min_fill=Min(min_fill,int(s->get_fill()*1000));
       ++sb;
     }
     else
@@ -356,37 +696,82 @@ void SoundManager::AudioCallback(Uint8 *stream, int len)
       sb=m_Streams.erase(sb);
     }
   }
-  s_MixingBuffer.flush();
-  short* outsbuf=(short*)stream;
-  Accumulator<int>::const_iterator it=s_MixingBuffer.begin();
-  for(int i=0;i<samples;++i,++it)
+  const float* gain=0;
+  if (m_Fading)
   {
-    //int sample=s_MixingBuffer[i];
-    int sample=*it;
-    if (m_Fading)
-    { 
-      sample=int(sample*m_Gain); 
-      m_Gain+=m_dGain; 
-      if (m_Gain<=0.0) 
-      { 
-        m_Gain=0.0; 
-        m_dGain=0.0; 
-      } 
+    // The fade is a per sample ramp, computed here so that all kernels agree
+    if (int(m_GainRamp.size()) != samples)
+      m_GainRamp.resize(samples);
+    for(int i=0;i<samples;++i)
+    {
+      m_GainRamp[i]=float(m_Gain);
+      m_Gain+=m_dGain;
+      if (m_Gain<=0.0)
+      {
+        m_Gain=0.0;
+        m_dGain=0.0;
+      }
     }
-    if (sample>0x7FFF)  sample=0x00007FFF;
-    if (sample<-0x8000) sample=0xFFFF8000;
-    outsbuf[i]=short(sample);
+    gain=&m_GainRamp[0];
   }
+  short* outsbuf=(short*)stream;
+  kernels.output(outsbuf,mix,samples,gain);
   if (0)
   {
     static std::ofstream dump("dump.raw",std::ios::binary|std::ios::out);
     dump.write((char*)outsbuf,samples*2);
   }
-  if (flog)
-  {
-    stop_ticks=SDL_GetTicks();
-    //*flog << "ticks=" << start_ticks << "     bytes=" << len << "   cb took: " << (stop_ticks-start_ticks) << std::endl;
-  }
+  m_MinStreamFill.store(min_fill,std::memory_order_relaxed);
+  record_callback(start,samples);
+}
+
+void SoundManager::record_callback(Uint64 start, int samples)
+{
+  Uint64 elapsed=SDL_GetPerformanceCounter()-start;
+  Uint32 us=Uint32(elapsed*1000000/m_PerfFrequency);
+  int bucket=0;
+  while (bucket<AudioStats::HISTOGRAM_BUCKETS-1 && us>=AudioStats::bucket_limit(bucket)) ++bucket;
+  m_Histogram[bucket].fetch_add(1,std::memory_order_relaxed);
+  m_Callbacks.fetch_add(1,std::memory_order_relaxed);
+  // Only this thread writes the maximums, so load and store are enough
+  if (us>m_MaxCallback.load(std::memory_order_relaxed))
+    m_MaxCallback.store(us,std::memory_order_relaxed);
+  Uint64 budget_us=Uint64(samples/m_Spec.channels)*1000000/m_Spec.freq;
+  if (us>budget_us) m_LateCallbacks.fetch_add(1,std::memory_order_relaxed);
+  int voices=m_Voices.size();
+  m_VoiceCount.store(voices,std::memory_order_relaxed);
+  if (voices>m_MaxVoices.load(std::memory_order_relaxed))
+    m_MaxVoices.store(voices,std::memory_order_relaxed);
+}
+
+void SoundManager::get_stats(AudioStats& stats) const
+{
+  for(int i=0;i<AudioStats::HISTOGRAM_BUCKETS;++i)
+    stats.callback_histogram[i]=m_Histogram[i].load(std::memory_order_relaxed);
+  stats.callbacks=m_Callbacks.load(std::memory_order_relaxed);
+  stats.max_callback_us=m_MaxCallback.load(std::memory_order_relaxed);
+  stats.late_callbacks=m_LateCallbacks.load(std::memory_order_relaxed);
+  stats.voices=m_VoiceCount.load(std::memory_order_relaxed);
+  stats.max_voices=m_MaxVoices.load(std::memory_order_relaxed);
+  stats.min_stream_fill=m_MinStreamFill.load(std::memory_order_relaxed)*0.001f;
+  stats.underruns=m_Underruns.load(std::memory_order_relaxed);
+  stats.steals=m_Steals.load(std::memory_order_relaxed);
+  stats.dropped=m_Dropped.load(std::memory_order_relaxed);
+}
+
+void SoundManager::reset_stats()
+{
+  for(int i=0;i<AudioStats::HISTOGRAM_BUCKETS;++i)
+    m_Histogram[i]=0;
+  m_Callbacks=0;
+  m_MaxCallback=0;
+  m_LateCallbacks=0;
+  m_VoiceCount=0;
+  m_MaxVoices=0;
+  m_MinStreamFill=1000;
+  m_Underruns=0;
+  m_Steals=0;
+  m_Dropped=0;
 }
 
 void SoundManager::AudioCallback(void *userdata, Uint8 *stream, int len)
@@ -395,8 +780,11 @@ void SoundManager::AudioCallback(void *userdata, Uint8 *stream, int len)
   mgr->AudioCallback(stream,len);
 }
 
-void SoundManager::initialize(int freq, bool stereo)
+void SoundManager::initialize(int freq, bool stereo, int voices)
 {
+  m_Voices.resize(voices);
+  m_Commands.reset(new SpscRing<Command>(Max(64,voices*2)));
+  m_Retired.reset(new SpscRing<sound_clip_ptr>(voices+m_Commands->capacity()));
   m_Gain=1.0;
   m_dGain=0.0;
   SDL_AudioSpec requested;
@@ -416,26 +804,52 @@ void SoundManager::pause(bool state)
 
 void SoundManager::clear(int duration)
 {
-  SDL_LockAudio();
-  m_Gain=1.0;
-  m_dGain=-1000.0/(duration*m_Spec.freq);
-  m_Fading=true;
-  SDL_UnlockAudio();
-  while (m_Gain>0) SDL_Delay(10);
-  SDL_LockAudio();
-  m_Clips.clear();
-  m_Fading=false;
-  m_Gain=1.0;
-  m_dGain=0;
-  SDL_UnlockAudio();
+  if (duration>0)
+  {
+    SDL_LockAudio();
+    m_Gain=1.0;
+    m_dGain=-1000.0/(duration*m_Spec.freq);
+    m_Fading=true;
+    SDL_UnlockAudio();
+    while (m_Gain>0) SDL_Delay(10);
+  }
+  // Stopping also ends the fade
+  send(Command(Command::STOP_ALL));
+  release_retired();
 }
 
-void SoundManager::play(sound_clip_ptr clip, bool loop)
+static VoiceParams sanitize(const VoiceParams& params)
 {
-  SDL_LockAudio();
-  cleanup();
-  m_Clips.push_back(SoundClipState(clip,loop));
-  SDL_UnlockAudio();
+  return VoiceParams(Max(0.0f,params.gain),
+                     Max(-1.0f,Min(1.0f,params.pan)),
+                     Max(1.0f/64,Min(64.0f,params.rate)));
+}
+
+int SoundManager::play(sound_clip_ptr clip, bool loop, int priority, const VoiceParams& params)
+{
+  if (!m_Commands) return 0;
+  release_retired();
+  if (m_NextVoiceId==0x7FFFFFFF) m_NextVoiceId=0;
+  ++m_NextVoiceId;
+  Command cmd(Command::PLAY,m_NextVoiceId);
+  cmd.clip=clip;
+  cmd.loop=loop;
+  cmd.priority=priority;
+  cmd.params=sanitize(params);
+  send(cmd);
+  return cmd.id;
+}
+
+void SoundManager::set_voice_params(int id, const VoiceParams& params)
+{
+  Command cmd(Command::SET_PARAMS,id);
+  cmd.params=sanitize(params);
+  send(cmd);
+}
+
+void SoundManager::stop_voice(int id)
+{
+  send(Command(Command::STOP,id));
 }
 
 void SoundManager::play(sound_stream_ptr stream)
@@ -445,7 +859,7 @@ void SoundManager::play(sound_stream_ptr stream)
   bool exists=false;
   for (sound_stream_ptr& s : m_Streams)
   {
-    if (s->m_Data->m_Decoder == stream->m_Data->m_Decoder)
+    if (s == stream)
       exists=true;
   }
   if (!exists) m_Streams.push_back(stream);
@@ -458,9 +872,9 @@ void SoundManager::shutdown()
   instance(true); 
 }
 
-void play(sound_clip_ptr clip, bool loop)
+int play(sound_clip_ptr clip, bool loop, int priority, const VoiceParams& params)
 {
-  SoundManager::instance()->play(clip, loop);
+  return SoundManager::instance()->play(clip, loop, priority, params);
 }
 
 } // namespace SDLPP
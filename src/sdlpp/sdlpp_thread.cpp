@@ -0,0 +1,255 @@
+#include <sdlpp_thread.h>
+
+namespace SDLPP
+{
+
+  WorkerPool::WorkerPool(int threads)
+    : m_Mutex(SDL_CreateMutex())
+    , m_TaskReady(SDL_CreateCond())
+    , m_Idle(SDL_CreateCond())
+    , m_Busy(0)
+    , m_Stop(false)
+  {
+    if (threads <= 0) threads = Max(1, SDL_GetCPUCount() - 1);
+    for (int i = 0; i < threads; ++i)
+    {
+      SDL_Thread* t = SDL_CreateThread(thread_main, "WorkerPool", this);
+      if (!t) THROW("Failed to create worker thread: " << SDL_GetError());
+      m_Threads.push_back(t);
+    }
+  }
+
+  WorkerPool::~WorkerPool()
+  {
+    {
+      MutexLock lock(m_Mutex);
+      m_Stop = true;
+      m_Tasks.clear();
+      SDL_CondBroadcast(m_TaskReady);
+    }
+    for (SDL_Thread* t : m_Threads)
+      SDL_WaitThread(t, 0);
+    SDL_DestroyCond(m_Idle);
+    SDL_DestroyCond(m_TaskReady);
+    SDL_DestroyMutex(m_Mutex);
+  }
+
+  void WorkerPool::push(const task& t)
+  {
+    MutexLock lock(m_Mutex);
+    m_Tasks.push_back(t);
+    SDL_CondSignal(m_TaskReady);
+  }
+
+  void WorkerPool::wait_idle()
+  {
+    MutexLock lock(m_Mutex);
+    while (!m_Tasks.empty() || m_Busy > 0)
+      SDL_CondWait(m_Idle, m_Mutex);
+  }
+
+  int SDLCALL WorkerPool::thread_main(void* pool)
+  {
+    static_cast<WorkerPool*>(pool)->run();
+    return 0;
+  }
+
+  void WorkerPool::run()
+  {
+    SDL_LockMutex(m_Mutex);
+    while (true)
+    {
+      while (m_Tasks.empty() && !m_Stop)
+        SDL_CondWait(m_TaskReady, m_Mutex);
+      if (m_Stop) break;
+      task t = m_Tasks.front();
+      m_Tasks.pop_front();
+      ++m_Busy;
+      SDL_UnlockMutex(m_Mutex);
+      try
+      {
+        t();
+      }
+      catch (...)
+      {
+      }
+      SDL_LockMutex(m_Mutex);
+      --m_Busy;
+      if (m_Tasks.empty() && m_Busy == 0)
+        SDL_CondBroadcast(m_Idle);
+    }
+    SDL_UnlockMutex(m_Mutex);
+  }
+
+  //////////////////////////////////////////////////////////////////////////
+
+  namespace {
+
+    /** Set for the threads of a JobSystem */
+    thread_local const void* t_System = 0;
+    thread_local int         t_Queue = 0;
+
+  } // anonymous namespace
+
+  JobSystem::JobSystem(int threads)
+    : m_Wake(SDL_CreateSemaphore(0))
+    , m_Stop(false)
+  {
+    if (threads <= 0) threads = SDL_GetCPUCount() - 1;
+    threads = Max(0, threads);
+    m_Queues.resize(threads + 1);
+    m_Workers.resize(threads);
+    for (int i = 0; i < threads; ++i)
+    {
+      m_Workers[i].system = this;
+      m_Workers[i].index = i + 1;
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+      SDL_Thread* t = SDL_CreateThread(thread_main, "JobSystem", &m_Workers[i]);
+      if (!t) THROW("Failed to create job thread: " << SDL_GetError());
+      m_Threads.push_back(t);
+    }
+  }
+
+  JobSystem::~JobSystem()
+  {
+    m_Stop.store(true);
+    for (size_t i = 0; i < m_Threads.size(); ++i)
+      SDL_SemPost(m_Wake);
+    for (SDL_Thread* t : m_Threads)
+      SDL_WaitThread(t, 0);
+    SDL_DestroySemaphore(m_Wake);
+  }
+
+  int JobSystem::current_queue() const
+  {
+    return t_System == this ? t_Queue : 0;
+  }
+
+  void JobSystem::push(JobGroup& group, const job& j)
+  {
+    group.m_Pending.fetch_add(1, std::memory_order_relaxed);
+    Job entry = { j, &group };
+    Queue& q = m_Queues[current_queue()];
+    SDL_AtomicLock(&q.lock);
+    q.jobs.push_back(entry);
+    SDL_AtomicUnlock(&q.lock);
+    if (!m_Threads.empty()) SDL_SemPost(m_Wake);
+  }
+
+  bool JobSystem::find_job(int index, Job& j)
+  {
+    // The newest job of our own queue is the most likely to be in the cache
+    Queue& own = m_Queues[index];
+    SDL_AtomicLock(&own.lock);
+    bool found = !own.jobs.empty();
+    if (found)
+    {
+      j = own.jobs.back();
+      own.jobs.pop_back();
+    }
+    SDL_AtomicUnlock(&own.lock);
+    if (found) return true;
+    // Steal the oldest job of another queue, which is usually the biggest
+    int n = int(m_Queues.size());
+    for (int i = 1; i < n; ++i)
+    {
+      Queue& q = m_Queues[(index + i) % n];
+      SDL_AtomicLock(&q.lock);
+      found = !q.jobs.empty();
+      if (found)
+      {
+        j = q.jobs.front();
+        q.jobs.pop_front();
+      }
+      SDL_AtomicUnlock(&q.lock);
+      if (found) return true;
+    }
+    return false;
+  }
+
+  void JobSystem::execute(Job& j)
+  {
+    JobGroup* group = j.group;
+    try
+    {
+      j.run();
+    }
+    catch (...)
+    {
+      SDL_AtomicLock(&group->m_ErrorLock);
+      if (!group->m_Error) group->m_Error = std::current_exception();
+      SDL_AtomicUnlock(&group->m_ErrorLock);
+    }
+    j.run = job();
+    group->m_Pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  void JobSystem::wait(JobGroup& group)
+  {
+    int index = current_queue();
+    Job j;
+    while (!group.is_done())
+    {
+      if (find_job(index, j)) execute(j);
+      else SDL_Delay(0);   // The last jobs are running on other threads
+    }
+    if (group.m_Error)
+    {
+      std::exception_ptr e = group.m_Error;
+      group.m_Error = std::exception_ptr();
+      std::rethrow_exception(e);
+    }
+  }
+
+  void JobSystem::split(int begin, int end, int grain, const range_func& f, JobGroup& group)
+  {
+    while (end - begin > grain)
+    {
+      int mid = begin + (end - begin) / 2;
+      int last = end;
+      push(group, [this, mid, last, grain, &f, &group]() { split(mid, last, grain, f, group); });
+      end = mid;
+    }
+    f(begin, end);
+  }
+
+  void JobSystem::parallel_for(int begin, int end, int grain, const range_func& f)
+  {
+    if (end <= begin) return;
+    grain = Max(1, grain);
+    JobGroup group;
+    try
+    {
+      split(begin, end, grain, f, group);
+    }
+    catch (...)
+    {
+      // The pieces already pushed refer to f and group
+      try { wait(group); } catch (...) {}
+      throw;
+    }
+    wait(group);
+  }
+
+  int SDLCALL JobSystem::thread_main(void* worker)
+  {
+    Worker* w = static_cast<Worker*>(worker);
+    w->system->run(w->index);
+    return 0;
+  }
+
+  void JobSystem::run(int index)
+  {
+    t_System = this;
+    t_Queue = index;
+    Job j;
+    while (!m_Stop.load())
+    {
+      if (find_job(index, j)) execute(j);
+      else SDL_SemWait(m_Wake);
+    }
+  }
+
+} // namespace SDLPP
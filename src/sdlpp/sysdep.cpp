@@ -1,6 +1,13 @@
 #include <sdlpp_common.h>
 #include <sysdep.h>
 
+#if defined(LINUX) || defined(__ANDROID__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace SDLPP {
 /////////////////////////////////////////////////
 //
@@ -48,6 +55,31 @@ unsigned get_tick_count()
   return GetTickCount();
 }
 
+const char* map_file(const char* filename, size_t& size)
+{
+  HANDLE file=CreateFileA(filename,GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
+  if (file==INVALID_HANDLE_VALUE) return 0;
+  LARGE_INTEGER li;
+  if (!GetFileSizeEx(file,&li) || li.QuadPart==0)
+  {
+    CloseHandle(file);
+    return 0;
+  }
+  HANDLE mapping=CreateFileMappingA(file,0,PAGE_READONLY,0,0,0);
+  CloseHandle(file);
+  if (!mapping) return 0;
+  const char* data=(const char*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+  CloseHandle(mapping); // The view keeps the mapping alive
+  if (!data) return 0;
+  size=size_t(li.QuadPart);
+  return data;
+}
+
+void unmap_file(const char* data, size_t size)
+{
+  if (data) UnmapViewOfFile(data);
+}
+
 #endif
 
 #if defined(LINUX) || defined(__ANDROID__)
@@ -87,6 +119,28 @@ unsigned get_tick_count()
   return t;
 }
 
+const char* map_file(const char* filename, size_t& size)
+{
+  int fd=open(filename,O_RDONLY);
+  if (fd<0) return 0;
+  struct stat st;
+  if (fstat(fd,&st)<0 || st.st_size==0)
+  {
+    close(fd);
+    return 0;
+  }
+  void* data=mmap(0,size_t(st.st_size),PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd); // The mapping keeps the file referenced
+  if (data==MAP_FAILED) return 0;
+  size=size_t(st.st_size);
+  return (const char*)data;
+}
+
+void unmap_file(const char* data, size_t size)
+{
+  if (data) munmap((void*)data,size);
+}
+
 #endif
 
 #ifdef LINUX